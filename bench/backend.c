@@ -0,0 +1,161 @@
+/*
+    数据传输方式基准测试
+    本机 TCP 连接上比较 read/write (FTPTransmit), splice/sendfile 和 io_uring
+    下载: socket -> 文件, 上传: 文件 -> socket; 对端在子进程中, 只统计本进程的 CPU 时间
+    输出吞吐量和每 GB 消耗的 CPU 秒数 (user + sys)
+
+    make bench && ./bench/backend [MB] [临时文件]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "../ftpclient.h"
+
+#define PEER_CHUNK (1 << 20)
+
+enum { BACKEND_RW, BACKEND_ZERO_COPY, BACKEND_URING };
+
+static const char* backend_names[] = {"read/write", "splice", "io_uring"};
+static const char* upload_names[] = {"read/write", "sendfile", "io_uring"};
+
+static long total_bytes;
+
+/* 对端: 下载测试时发送 total_bytes 字节, 上传测试时读到连接关闭 */
+static void Peer(int fd, int send_data) {
+    char* buf = (char*) calloc(1, PEER_CHUNK);
+    if (send_data) {
+        long left = total_bytes;
+        while (left > 0) {
+            ssize_t n = write(fd, buf, left > PEER_CHUNK ? PEER_CHUNK : left);
+            if (n <= 0) break;
+            left -= n;
+        }
+    } else {
+        while (read(fd, buf, PEER_CHUNK) > 0) continue;
+    }
+    close(fd);
+    free(buf);
+    _exit(0);
+}
+
+/* 建立一对本机 TCP 连接 */
+static int LoopbackPair(int fds[2]) {
+    int lfd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(lfd, (struct sockaddr*) &addr, sizeof(addr)) < 0 ||
+        listen(lfd, 1) < 0 ||
+        getsockname(lfd, (struct sockaddr*) &addr, &len) < 0) {
+        close(lfd);
+        return -1;
+    }
+    fds[0] = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(fds[0], (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+        close(lfd);
+        return -1;
+    }
+    fds[1] = accept(lfd, NULL, NULL);
+    close(lfd);
+    return fds[1] < 0 ? -1 : 0;
+}
+
+static double CpuSeconds(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+           ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static long RunBackend(ftp_session* s, int backend, int dest_fd, int src_fd) {
+    if (backend == BACKEND_URING) return FTPUringTransmit(s, dest_fd, src_fd);
+    if (backend == BACKEND_RW) return FTPTransmit(s, dest_fd, src_fd);
+    // 文件可 lseek, socket 不可
+    return lseek(src_fd, 0, SEEK_CUR) < 0 ? FTPSplice(s, dest_fd, src_fd)
+                                          : FTPSendfile(s, dest_fd, src_fd);
+}
+
+/* 一次传输, upload 为 0 时从 socket 写入文件, 否则从文件发送到 socket */
+static int RunOnce(ftp_session* s, int backend, int upload, const char* path) {
+    int fds[2];
+    if (LoopbackPair(fds) < 0) {
+        perror("loopback");
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        Peer(fds[1], !upload);
+    }
+    close(fds[1]);
+
+    int file_fd = upload ? open(path, O_RDONLY)
+                         : open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (file_fd < 0) {
+        perror(path);
+        close(fds[0]);
+        waitpid(pid, NULL, 0);
+        return -1;
+    }
+
+    struct timespec t0, t1;
+    double cpu = CpuSeconds();
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    long n = upload ? RunBackend(s, backend, fds[0], file_fd)
+                    : RunBackend(s, backend, file_fd, fds[0]);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    cpu = CpuSeconds() - cpu;
+    close(fds[0]);
+    close(file_fd);
+    waitpid(pid, NULL, 0);
+
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    if (n <= 0) {
+        printf("%8s %10s %10s\n",
+               upload ? "put" : "get",
+               (upload ? upload_names : backend_names)[backend],
+               "unsupported");
+        return 0;
+    }
+    printf("%8s %10s %10.1f %10.3f\n",
+           upload ? "put" : "get",
+           (upload ? upload_names : backend_names)[backend],
+           n / secs / (1 << 20),
+           cpu / ((double) n / (1 << 30)));
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    int mb = argc > 1 ? atoi(argv[1]) : 1024;
+    const char* path = argc > 2 ? argv[2] : "bench_backend.tmp";
+    total_bytes = (long) mb << 20;
+    signal(SIGPIPE, SIG_IGN);
+
+    ftp_session s;
+    FTPSessionInit(&s);
+
+    printf("%8s %10s %10s %10s\n", "dir", "backend", "MB/s", "cpu_s/GB");
+    int backend;
+    // 下载生成的文件作为之后上传的数据
+    for (backend = BACKEND_RW; backend <= BACKEND_URING; backend++) {
+        if (RunOnce(&s, backend, 0, path) == -1) return 1;
+    }
+    for (backend = BACKEND_RW; backend <= BACKEND_URING; backend++) {
+        if (RunOnce(&s, backend, 1, path) == -1) return 1;
+    }
+    unlink(path);
+    return 0;
+}
@@ -0,0 +1,114 @@
+/*
+    数据缓冲区大小基准测试
+    本机 TCP 连接上发送固定数据量, 接收端用 FTPTransmit 按不同 data_buf_size
+    写入 /dev/null, 输出吞吐量和 read 次数 (/proc/self/io syscr)
+
+    make bench && ./bench/bufsize [MB]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "../ftpclient.h"
+
+#define SEND_CHUNK (1 << 20)
+
+static long total_bytes;
+
+static void* Sender(void* arg) {
+    int fd = *(int*) arg;
+    char* buf = (char*) calloc(1, SEND_CHUNK);
+    long left = total_bytes;
+    while (left > 0) {
+        ssize_t n = write(fd, buf, left > SEND_CHUNK ? SEND_CHUNK : left);
+        if (n <= 0) break;
+        left -= n;
+    }
+    close(fd);
+    free(buf);
+    return NULL;
+}
+
+static long ReadSyscalls(void) {
+    FILE* fp = fopen("/proc/self/io", "r");
+    char line[128];
+    long syscr = -1;
+    while (fp && fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "syscr: %ld", &syscr) == 1) break;
+    }
+    if (fp) fclose(fp);
+    return syscr;
+}
+
+/* 建立一对本机 TCP 连接 */
+static int LoopbackPair(int fds[2]) {
+    int lfd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(lfd, (struct sockaddr*) &addr, sizeof(addr)) < 0 ||
+        listen(lfd, 1) < 0 ||
+        getsockname(lfd, (struct sockaddr*) &addr, &len) < 0) {
+        close(lfd);
+        return -1;
+    }
+    fds[0] = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(fds[0], (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+        close(lfd);
+        return -1;
+    }
+    fds[1] = accept(lfd, NULL, NULL);
+    close(lfd);
+    return fds[1] < 0 ? -1 : 0;
+}
+
+int main(int argc, char* argv[]) {
+    int mb = argc > 1 ? atoi(argv[1]) : 512;
+    total_bytes = (long) mb << 20;
+    int sizes[] = {1, 4, 16, 64, 256, 1024, 4096};  // KB
+    int null_fd = open("/dev/null", O_WRONLY);
+
+    ftp_session s;
+    FTPSessionInit(&s);
+
+    printf("%10s %10s %12s %10s\n", "buffer_KB", "MB/s", "reads", "reads/MB");
+    size_t i;
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        int fds[2];
+        if (LoopbackPair(fds) < 0) {
+            perror("loopback");
+            return 1;
+        }
+        FTPSetDataBuffer(&s, sizes[i] * 1024);
+
+        pthread_t tid;
+        pthread_create(&tid, NULL, Sender, &fds[1]);
+        struct timespec t0, t1;
+        long syscr = ReadSyscalls();
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        long n = FTPTransmit(&s, null_fd, fds[0]);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        syscr = ReadSyscalls() - syscr;
+        pthread_join(tid, NULL);
+        close(fds[0]);
+
+        double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+        printf("%10d %10.1f %12ld %10.1f\n",
+               s.data_buf_size / 1024,
+               n / secs / (1 << 20),
+               syscr,
+               (double) syscr / mb);
+    }
+    close(null_fd);
+    return 0;
+}
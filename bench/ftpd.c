@@ -0,0 +1,784 @@
+/*
+    基准测试用的本机 FTP 服务器
+    支持 USER/PASS/PASV/PORT/RETR/STOR/APPE/REST/SIZE/MDTM/MFMT/LIST/NLST/MLSD
+    以及 MLST/CWD/PWD/MKD/RMD/DELE/RNFR/RNTO/TYPE/MODE/FEAT/NOOP/QUIT
+    和 HASH/XCRC (摘要计算与客户端共用 ftp_hash.c)
+    MODE B 时数据连接在文件之间保留, 传输结束响应 250
+    MODE Z 时数据为 zlib 压缩流, 压缩级别由 OPTS MODE Z LEVEL n 设置
+    HASH 的算法由 OPTS HASH SHA-256|CRC32 设置, 默认 SHA-256
+    不校验用户名密码, 路径限制在根目录内
+    默认控制连接关闭 Nagle (TCP_NODELAY), -n 保留 Nagle, 模拟多数未设置的服务器,
+    客户端流水线发送的命令会遇到 Nagle 与延迟 ACK 互相等待
+
+    make bench && ./bench/ftpd [-n] [port] [root]
+*/
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include <zlib.h>
+
+#include "../ftpclient.h"
+#include "ftpd.h"
+
+#define FTPD_LINE 1024
+#define FTPD_BUF (256 << 10)
+#define FTPD_BLOCK_EOF 0x40
+#define FTPD_BLOCK_MAX 65535
+
+typedef struct ftpd_conn {
+    int ctl_fd;
+    int pasv_fd;                   // PASV 监听套接字, 无则为 -1
+    struct sockaddr_in port_addr;  // PORT 给出的地址
+    int has_port;
+    long rest;                     // REST 偏移, 下一次传输后清零
+    int block;                     // MODE B
+    int data_fd;                   // 块模式保留的数据连接, 无则为 -1
+    int deflate;                   // MODE Z
+    int level;                     // MODE Z 压缩级别
+    z_stream zs;                   // 正在发送的压缩流
+    int zs_open;
+    int hash;                      // HASH 的算法 FTP_HASH_*
+    char cwd[PATH_MAX];            // 以 "/" 开头的虚拟路径
+    char rnfr[PATH_MAX];
+    char in[FTPD_LINE * 4];        // 未处理的命令
+    int in_len;
+    char* buf;                     // 数据传输缓冲区
+} ftpd_conn;
+
+static void FtpdReply(ftpd_conn* c, const char* fmt, ...)
+        __attribute__((format(printf, 2, 3)));
+
+static void FtpdReply(ftpd_conn* c, const char* fmt, ...) {
+    char line[FTPD_LINE + PATH_MAX];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(line, sizeof(line) - 2, fmt, ap);
+    va_end(ap);
+    if (n > (int) sizeof(line) - 3) n = sizeof(line) - 3;
+    line[n++] = '\r';
+    line[n++] = '\n';
+    send(c->ctl_fd, line, n, MSG_NOSIGNAL);
+}
+
+/*
+    虚拟路径 arg 转换为相对根目录的真实路径 "./..."
+    处理 "." 和 "..", 不会越过根目录
+*/
+static void FtpdPath(const ftpd_conn* c, const char* arg, char* out) {
+    char full[PATH_MAX * 2];
+    if (arg[0] == '/') {
+        snprintf(full, sizeof(full), "%s", arg);
+    } else {
+        snprintf(full, sizeof(full), "%s/%s", c->cwd, arg);
+    }
+    int len = 1;
+    out[0] = '.';
+    char* save = NULL;
+    char* part;
+    for (part = strtok_r(full, "/", &save); part != NULL;
+         part = strtok_r(NULL, "/", &save)) {
+        if (strcmp(part, ".") == 0) continue;
+        if (strcmp(part, "..") == 0) {
+            while (len > 1 && out[len - 1] != '/') len--;
+            if (len > 1) len--;
+            continue;
+        }
+        int n = strlen(part);
+        if (len + n + 2 >= PATH_MAX) break;
+        out[len++] = '/';
+        memcpy(out + len, part, n);
+        len += n;
+    }
+    out[len] = '\0';
+}
+
+/* 打开数据连接, PASV 时 accept, PORT 时 connect */
+static int FtpdDataOpen(ftpd_conn* c) {
+    int fd = -1;
+    if (c->data_fd >= 0) {
+        fd = c->data_fd;
+        c->data_fd = -1;
+    } else if (c->pasv_fd >= 0) {
+        fd = accept(c->pasv_fd, NULL, NULL);
+        close(c->pasv_fd);
+        c->pasv_fd = -1;
+    } else if (c->has_port) {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd >= 0 && connect(fd,
+                               (struct sockaddr*) &c->port_addr,
+                               sizeof(c->port_addr)) < 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd < 0) FtpdReply(c, "425 Can't open data connection.");
+    return fd;
+}
+
+/* 传输结束, 块模式保留数据连接并响应 250, 流模式关闭连接并响应 226 */
+static void FtpdDataDone(ftpd_conn* c, int fd, int ok) {
+    if (c->zs_open) deflateEnd(&c->zs);
+    c->zs_open = 0;
+    if (ok && c->block) {
+        c->data_fd = fd;
+        FtpdReply(c, "250 Transfer complete, data connection kept open.");
+        return;
+    }
+    close(fd);
+    FtpdReply(c, ok ? "226 Transfer complete." : "426 Transfer aborted.");
+}
+
+static void FtpdDataDrop(ftpd_conn* c) {
+    if (c->data_fd >= 0) close(c->data_fd);
+    c->data_fd = -1;
+}
+
+/* 压缩后发送, finish 为 1 时结束压缩流 */
+static int FtpdDeflate(ftpd_conn* c,
+                       int fd,
+                       const char* buf,
+                       int len,
+                       int finish) {
+    if (!c->zs_open) {
+        memset(&c->zs, 0, sizeof(c->zs));
+        if (deflateInit(&c->zs, c->level) != Z_OK) return -1;
+        c->zs_open = 1;
+    }
+    unsigned char out[64 << 10];
+    c->zs.next_in = (unsigned char*) buf;
+    c->zs.avail_in = len;
+    do {
+        c->zs.next_out = out;
+        c->zs.avail_out = sizeof(out);
+        deflate(&c->zs, finish ? Z_FINISH : Z_NO_FLUSH);
+        int n = sizeof(out) - c->zs.avail_out;
+        if (n > 0 && send(fd, out, n, MSG_NOSIGNAL) != n) return -1;
+    } while (c->zs.avail_out == 0);
+    return 0;
+}
+
+/* 数据连接上的 zlib 流解压后写入 fd */
+static int FtpdInflate(ftpd_conn* c, int data_fd, int fd) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit(&zs) != Z_OK) return -1;
+    unsigned char out[64 << 10];
+    int ret = Z_OK;
+    ssize_t n;
+    while (ret != Z_STREAM_END &&
+           (n = read(data_fd, c->buf, FTPD_BUF)) != 0) {
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) break;
+        zs.next_in = (unsigned char*) c->buf;
+        zs.avail_in = n;
+        do {
+            zs.next_out = out;
+            zs.avail_out = sizeof(out);
+            ret = inflate(&zs, Z_NO_FLUSH);
+            int have = sizeof(out) - zs.avail_out;
+            if ((ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) ||
+                write(fd, out, have) != have) {
+                ret = Z_DATA_ERROR;
+                break;
+            }
+        } while (zs.avail_out == 0 && ret != Z_STREAM_END);
+        if (ret == Z_DATA_ERROR) break;
+    }
+    inflateEnd(&zs);
+    return ret == Z_STREAM_END ? 0 : -1;
+}
+
+/*
+    发送数据, 块模式下分成不超过 65535 字节的块, flags 为最后一块的描述符
+    压缩模式下 flags 为 FTPD_BLOCK_EOF 时结束压缩流
+*/
+static int FtpdSend(ftpd_conn* c, int fd, const char* buf, int len, int flags) {
+    if (c->deflate) {
+        return FtpdDeflate(c, fd, buf, len, flags == FTPD_BLOCK_EOF);
+    }
+    if (!c->block) {
+        return send(fd, buf, len, MSG_NOSIGNAL) == len ? 0 : -1;
+    }
+    do {
+        int n = len > FTPD_BLOCK_MAX ? FTPD_BLOCK_MAX : len;
+        unsigned char header[3] = {n == len ? flags : 0, n >> 8, n & 0xff};
+        if (send(fd, header, 3, MSG_NOSIGNAL | MSG_MORE) != 3 ||
+            send(fd, buf, n, MSG_NOSIGNAL) != n) {
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    } while (len > 0);
+    return 0;
+}
+
+/* 块模式接收到 EOF 块, 数据写入 fd */
+static int FtpdBlockRecv(ftpd_conn* c, int data_fd, int fd) {
+    while (1) {
+        unsigned char header[3];
+        if (recv(data_fd, header, 3, MSG_WAITALL) != 3) return -1;
+        int n = header[1] << 8 | header[2];
+        if (n > 0 && (recv(data_fd, c->buf, n, MSG_WAITALL) != n ||
+                      write(fd, c->buf, n) != n)) {
+            return -1;
+        }
+        if (header[0] & FTPD_BLOCK_EOF) return 0;
+    }
+}
+
+static void FtpdPasv(ftpd_conn* c) {
+    if (c->pasv_fd >= 0) close(c->pasv_fd);
+    FtpdDataDrop(c);
+    int port;
+    c->pasv_fd = FtpdListen(0, &port);
+    if (c->pasv_fd < 0) {
+        FtpdReply(c, "425 Can't open passive connection.");
+        return;
+    }
+    c->has_port = 0;
+    FtpdReply(c,
+              "227 Entering Passive Mode (127,0,0,1,%d,%d).",
+              port >> 8,
+              port & 0xff);
+}
+
+static void FtpdPort(ftpd_conn* c, const char* arg) {
+    int h1, h2, h3, h4, p1, p2;
+    if (sscanf(arg, "%d,%d,%d,%d,%d,%d", &h1, &h2, &h3, &h4, &p1, &p2) != 6) {
+        FtpdReply(c, "501 Syntax error in PORT.");
+        return;
+    }
+    char ip[INET_ADDRSTRLEN];
+    snprintf(ip, sizeof(ip), "%d.%d.%d.%d", h1, h2, h3, h4);
+    memset(&c->port_addr, 0, sizeof(c->port_addr));
+    c->port_addr.sin_family = AF_INET;
+    c->port_addr.sin_port = htons(p1 * 256 + p2);
+    inet_pton(AF_INET, ip, &c->port_addr.sin_addr);
+    c->has_port = 1;
+    if (c->pasv_fd >= 0) close(c->pasv_fd);
+    c->pasv_fd = -1;
+    FtpdDataDrop(c);
+    FtpdReply(c, "200 PORT command successful.");
+}
+
+static void FtpdRetr(ftpd_conn* c, const char* path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        if (fd >= 0) close(fd);
+        FtpdReply(c, "550 %s: No such file.", path + 1);
+        return;
+    }
+    off_t off = c->rest;
+    c->rest = 0;
+    int data_fd = FtpdDataOpen(c);
+    if (data_fd < 0) {
+        close(fd);
+        return;
+    }
+    FtpdReply(c, "150 Opening BINARY mode data connection.");
+    int ok = 1;
+    while (!c->block && !c->deflate && off < st.st_size) {
+        ssize_t n = sendfile(data_fd, fd, &off, st.st_size - off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            ok = 0;
+            break;
+        }
+    }
+    // 块模式和压缩模式逐段读取文件, 最后一块带 EOF 标志 (结束压缩流)
+    // 空文件只发送空的 EOF 块
+    while ((c->block || c->deflate) && ok) {
+        ssize_t n = pread(fd, c->buf, FTPD_BUF, off);
+        if (n < 0) {
+            ok = 0;
+            break;
+        }
+        off += n;
+        int last = n == 0 || off >= st.st_size;
+        ok = FtpdSend(c, data_fd, c->buf, n, last ? FTPD_BLOCK_EOF : 0) == 0;
+        if (last) break;
+    }
+    close(fd);
+    FtpdDataDone(c, data_fd, ok);
+}
+
+/* STOR/APPE, append 为 1 时追加到文件末尾 */
+static void FtpdStor(ftpd_conn* c, const char* path, int append) {
+    int flags = O_WRONLY | O_CREAT;
+    if (append) {
+        flags |= O_APPEND;
+    } else if (c->rest == 0) {
+        flags |= O_TRUNC;
+    }
+    int fd = open(path, flags, 0644);
+    if (fd < 0) {
+        FtpdReply(c, "553 %s: %s.", path + 1, strerror(errno));
+        return;
+    }
+    if (!append && c->rest > 0) lseek(fd, c->rest, SEEK_SET);
+    c->rest = 0;
+    int data_fd = FtpdDataOpen(c);
+    if (data_fd < 0) {
+        close(fd);
+        return;
+    }
+    FtpdReply(c, "150 Ok to send data.");
+    int ok = 1;
+    ssize_t n = 0;
+    if (c->block) ok = FtpdBlockRecv(c, data_fd, fd) == 0;
+    if (c->deflate) ok = FtpdInflate(c, data_fd, fd) == 0;
+    while (!c->block && !c->deflate &&
+           (n = read(data_fd, c->buf, FTPD_BUF)) != 0) {
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 || write(fd, c->buf, n) != n) {
+            ok = 0;
+            break;
+        }
+    }
+    close(fd);
+    FtpdDataDone(c, data_fd, ok);
+}
+
+/* ls -l 格式的一行 */
+static int FtpdListLine(const char* name, const struct stat* st, char* line) {
+    char mode[11] = "----------";
+    if (S_ISDIR(st->st_mode)) mode[0] = 'd';
+    if (S_ISLNK(st->st_mode)) mode[0] = 'l';
+    const char* rwx = "rwxrwxrwx";
+    int i;
+    for (i = 0; i < 9; i++) {
+        if (st->st_mode & (0400 >> i)) mode[i + 1] = rwx[i];
+    }
+    char date[16];
+    struct tm tm;
+    localtime_r(&st->st_mtime, &tm);
+    strftime(date, sizeof(date), "%b %e %H:%M", &tm);
+    return sprintf(line,
+                   "%s %3d ftp ftp %12lld %s %s\r\n",
+                   mode,
+                   (int) st->st_nlink,
+                   (long long) st->st_size,
+                   date,
+                   name);
+}
+
+/* MLSD/MLST 格式的一行 "type=file;size=1;modify=...;perm=...; name" */
+static int FtpdFactsLine(const char* name, const struct stat* st, char* line) {
+    const char* type = S_ISDIR(st->st_mode)   ? "dir"
+                       : S_ISREG(st->st_mode) ? "file"
+                       : S_ISLNK(st->st_mode) ? "OS.unix=symlink"
+                                              : "OS.unix=other";
+    if (strcmp(name, ".") == 0) type = "cdir";
+    if (strcmp(name, "..") == 0) type = "pdir";
+    char stamp[32];
+    struct tm tm;
+    gmtime_r(&st->st_mtime, &tm);
+    strftime(stamp, sizeof(stamp), "%Y%m%d%H%M%S", &tm);
+    const char* perm = S_ISDIR(st->st_mode)
+                               ? (st->st_mode & 0200 ? "elcmfd" : "el")
+                               : (st->st_mode & 0200 ? "rwadf" : "r");
+    return sprintf(line,
+                   "type=%s;size=%lld;modify=%s;perm=%s; %s\r\n",
+                   type,
+                   (long long) st->st_size,
+                   stamp,
+                   perm,
+                   name);
+}
+
+/* LIST/NLST/MLSD, format 为 'L', 'N' 或 'M' */
+static void FtpdList(ftpd_conn* c, const char* path, int format) {
+    DIR* dir = opendir(path);
+    if (dir == NULL) {
+        FtpdReply(c, "550 %s: No such directory.", path + 1);
+        return;
+    }
+    int data_fd = FtpdDataOpen(c);
+    if (data_fd < 0) {
+        closedir(dir);
+        return;
+    }
+    FtpdReply(c, "150 Here comes the directory listing.");
+    int len = 0;
+    struct dirent* ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (format == 'N' && ent->d_name[0] == '.') continue;
+        char file[PATH_MAX * 2];
+        struct stat st;
+        snprintf(file, sizeof(file), "%s/%s", path, ent->d_name);
+        if (lstat(file, &st) < 0) continue;
+        if (len > FTPD_BUF - PATH_MAX - 128) {
+            FtpdSend(c, data_fd, c->buf, len, 0);
+            len = 0;
+        }
+        if (format == 'N') {
+            len += sprintf(c->buf + len, "%s\r\n", ent->d_name);
+        } else if (format == 'M') {
+            len += FtpdFactsLine(ent->d_name, &st, c->buf + len);
+        } else {
+            len += FtpdListLine(ent->d_name, &st, c->buf + len);
+        }
+    }
+    int ok = (len == 0 && !c->block && !c->deflate) ||
+             FtpdSend(c, data_fd, c->buf, len, FTPD_BLOCK_EOF) == 0;
+    closedir(dir);
+    FtpdDataDone(c, data_fd, ok);
+}
+
+/*
+    HASH: "213 SHA-256 0-<size-1> <hex> <name>"
+    XCRC: "250 <CRC32>"
+*/
+static void FtpdHash(ftpd_conn* c,
+                     const char* path,
+                     const char* arg,
+                     int xcrc) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        if (fd >= 0) close(fd);
+        FtpdReply(c, "550 %s: No such file.", path + 1);
+        return;
+    }
+    ftp_hash h;
+    char hex[FTP_HASH_HEX];
+    FTPHashInit(&h, xcrc ? FTP_HASH_CRC32 : c->hash);
+    int ret = FTPHashFile(&h, fd, 0, -1);
+    close(fd);
+    if (ret == -1) {
+        FtpdReply(c, "451 %s: %s.", path + 1, strerror(errno));
+        return;
+    }
+    FTPHashHex(&h, hex);
+    if (xcrc) {
+        FtpdReply(c, "250 %s", hex);
+    } else {
+        FtpdReply(c,
+                  "213 %s 0-%lld %s %s",
+                  FTPHashName(c->hash),
+                  (long long) (st.st_size ? st.st_size - 1 : 0),
+                  hex,
+                  arg);
+    }
+}
+
+/* 处理一条命令, 返回 -1 时关闭连接 */
+static int FtpdCommand(ftpd_conn* c, char* line) {
+    char* arg = strchr(line, ' ');
+    if (arg) {
+        *arg++ = '\0';
+    } else {
+        arg = line + strlen(line);
+    }
+    // LIST 的 "-al" 等选项忽略
+    if (strcasecmp(line, "LIST") == 0 || strcasecmp(line, "NLST") == 0) {
+        while (*arg == '-') {
+            while (*arg && *arg != ' ') arg++;
+            while (*arg == ' ') arg++;
+        }
+    }
+    char path[PATH_MAX];
+    FtpdPath(c, arg, path);
+    struct stat st;
+
+    if (strcasecmp(line, "USER") == 0) {
+        FtpdReply(c, "331 Please specify the password.");
+    } else if (strcasecmp(line, "PASS") == 0) {
+        FtpdReply(c, "230 Login successful.");
+    } else if (strcasecmp(line, "QUIT") == 0) {
+        FtpdReply(c, "221 Goodbye.");
+        return -1;
+    } else if (strcasecmp(line, "NOOP") == 0) {
+        FtpdReply(c, "200 NOOP ok.");
+    } else if (strcasecmp(line, "SYST") == 0) {
+        FtpdReply(c, "215 UNIX Type: L8");
+    } else if (strcasecmp(line, "TYPE") == 0) {
+        FtpdReply(c, "200 Switching to %s mode.",
+                  toupper((unsigned char) arg[0]) == 'A' ? "ASCII"
+                                                           : "Binary");
+    } else if (strcasecmp(line, "MODE") == 0) {
+        int mode = toupper((unsigned char) arg[0]);
+        if (mode == 'B' || mode == 'S' || mode == 'Z') {
+            c->block = mode == 'B';
+            c->deflate = mode == 'Z';
+            if (!c->block) FtpdDataDrop(c);
+            FtpdReply(c, "200 Mode set to %c.", mode);
+        } else {
+            FtpdReply(c, "504 Mode not supported.");
+        }
+    } else if (strcasecmp(line, "FEAT") == 0) {
+        FtpdReply(c,
+                  "211-Features:\r\n SIZE\r\n REST STREAM\r\n MODE Z\r\n"
+                  " MLST type*;size*;modify*;perm*;\r\n"
+                  " HASH %s\r\n XCRC\r\n211 End",
+                  c->hash == FTP_HASH_CRC32 ? "SHA-256;CRC32*"
+                                            : "SHA-256*;CRC32");
+    } else if (strcasecmp(line, "OPTS") == 0 &&
+               strncasecmp(arg, "MODE Z LEVEL ", 13) == 0) {
+        int level = atoi(arg + 13);
+        if (level < 0 || level > 9) {
+            FtpdReply(c, "501 Invalid level.");
+        } else {
+            c->level = level;
+            FtpdReply(c, "200 MODE Z LEVEL set to %d.", level);
+        }
+    } else if (strcasecmp(line, "OPTS") == 0 &&
+               strncasecmp(arg, "HASH", 4) == 0) {
+        const char* algo = arg + 4 + strspn(arg + 4, " ");
+        if (strcasecmp(algo, "SHA-256") == 0) {
+            c->hash = FTP_HASH_SHA256;
+        } else if (strcasecmp(algo, "CRC32") == 0) {
+            c->hash = FTP_HASH_CRC32;
+        } else if (algo[0]) {
+            FtpdReply(c, "504 Unknown algorithm.");
+            return 0;
+        }
+        FtpdReply(c, "200 %s", FTPHashName(c->hash));
+    } else if (strcasecmp(line, "PWD") == 0) {
+        FtpdReply(c, "257 \"%s\" is the current directory.", c->cwd);
+    } else if (strcasecmp(line, "CWD") == 0) {
+        if (stat(path, &st) < 0 || !S_ISDIR(st.st_mode)) {
+            FtpdReply(c, "550 Failed to change directory.");
+        } else {
+            snprintf(c->cwd, sizeof(c->cwd), "%s", path[1] ? path + 1 : "/");
+            FtpdReply(c, "250 Directory successfully changed.");
+        }
+    } else if (strcasecmp(line, "MKD") == 0) {
+        if (mkdir(path, 0755) < 0) {
+            FtpdReply(c, "550 Create directory operation failed.");
+        } else {
+            FtpdReply(c, "257 \"%s\" created.", path + 1);
+        }
+    } else if (strcasecmp(line, "RMD") == 0) {
+        FtpdReply(c, rmdir(path) < 0 ? "550 Remove directory operation failed."
+                                     : "250 Remove directory operation "
+                                       "successful.");
+    } else if (strcasecmp(line, "DELE") == 0) {
+        FtpdReply(c, unlink(path) < 0 ? "550 Delete operation failed."
+                                      : "250 Delete operation successful.");
+    } else if (strcasecmp(line, "RNFR") == 0) {
+        if (lstat(path, &st) < 0) {
+            FtpdReply(c, "550 RNFR command failed.");
+        } else {
+            snprintf(c->rnfr, sizeof(c->rnfr), "%s", path);
+            FtpdReply(c, "350 Ready for RNTO.");
+        }
+    } else if (strcasecmp(line, "RNTO") == 0) {
+        int ok = c->rnfr[0] && rename(c->rnfr, path) == 0;
+        c->rnfr[0] = '\0';
+        FtpdReply(c, ok ? "250 Rename successful." : "550 Rename failed.");
+    } else if (strcasecmp(line, "SIZE") == 0) {
+        if (stat(path, &st) < 0 || !S_ISREG(st.st_mode)) {
+            FtpdReply(c, "550 Could not get file size.");
+        } else {
+            FtpdReply(c, "213 %lld", (long long) st.st_size);
+        }
+    } else if (strcasecmp(line, "MDTM") == 0) {
+        if (stat(path, &st) < 0 || !S_ISREG(st.st_mode)) {
+            FtpdReply(c, "550 Could not get file modification time.");
+        } else {
+            char stamp[32];
+            struct tm tm;
+            gmtime_r(&st.st_mtime, &tm);
+            strftime(stamp, sizeof(stamp), "%Y%m%d%H%M%S", &tm);
+            FtpdReply(c, "213 %s", stamp);
+        }
+    } else if (strcasecmp(line, "MFMT") == 0) {
+        // MFMT YYYYMMDDhhmmss path
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+        char* name = strchr(arg, ' ');
+        if (name == NULL || strptime(arg, "%Y%m%d%H%M%S", &tm) != name) {
+            FtpdReply(c, "501 Syntax error in MFMT.");
+        } else {
+            FtpdPath(c, name + 1, path);
+            struct timespec times[2] = {{0, UTIME_OMIT}, {timegm(&tm), 0}};
+            if (utimensat(AT_FDCWD, path, times, 0) < 0) {
+                FtpdReply(c, "550 %s: %s.", path + 1, strerror(errno));
+            } else {
+                FtpdReply(c, "213 Modify=%.14s; %s", arg, name + 1);
+            }
+        }
+    } else if (strcasecmp(line, "MLST") == 0) {
+        if (lstat(path, &st) < 0) {
+            FtpdReply(c, "550 %s: No such file or directory.", path + 1);
+        } else {
+            char facts[PATH_MAX + 128];
+            int n = FtpdFactsLine(arg[0] ? arg : ".", &st, facts);
+            FtpdReply(c,
+                      "250-Listing %s\r\n %.*s\r\n250 End",
+                      arg,
+                      n - 2,
+                      facts);
+        }
+    } else if (strcasecmp(line, "REST") == 0) {
+        c->rest = atol(arg);
+        FtpdReply(c, "350 Restart position accepted (%ld).", c->rest);
+    } else if (strcasecmp(line, "PASV") == 0) {
+        FtpdPasv(c);
+    } else if (strcasecmp(line, "PORT") == 0) {
+        FtpdPort(c, arg);
+    } else if (strcasecmp(line, "RETR") == 0) {
+        FtpdRetr(c, path);
+    } else if (strcasecmp(line, "STOR") == 0) {
+        FtpdStor(c, path, 0);
+    } else if (strcasecmp(line, "APPE") == 0) {
+        FtpdStor(c, path, 1);
+    } else if (strcasecmp(line, "LIST") == 0) {
+        FtpdList(c, path, 'L');
+    } else if (strcasecmp(line, "NLST") == 0) {
+        FtpdList(c, path, 'N');
+    } else if (strcasecmp(line, "MLSD") == 0) {
+        FtpdList(c, path, 'M');
+    } else if (strcasecmp(line, "HASH") == 0) {
+        FtpdHash(c, path, arg, 0);
+    } else if (strcasecmp(line, "XCRC") == 0) {
+        FtpdHash(c, path, arg, 1);
+    } else {
+        FtpdReply(c, "502 Command not implemented.");
+    }
+    return 0;
+}
+
+static void* FtpdConnection(void* arg) {
+    ftpd_conn* c = (ftpd_conn*) arg;
+    c->buf = (char*) malloc(FTPD_BUF);
+    FtpdReply(c, "220 bench ftpd ready.");
+    int quit = 0;
+    while (!quit) {
+        ssize_t n = recv(c->ctl_fd,
+                         c->in + c->in_len,
+                         sizeof(c->in) - c->in_len - 1,
+                         0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        c->in_len += n;
+        c->in[c->in_len] = '\0';
+        // 一次可能收到多条流水线命令
+        char* line = c->in;
+        char* eol;
+        while (!quit && (eol = strstr(line, "\r\n")) != NULL) {
+            *eol = '\0';
+            quit = FtpdCommand(c, line) == -1;
+            line = eol + 2;
+        }
+        c->in_len -= line - c->in;
+        memmove(c->in, line, c->in_len);
+        if (c->in_len == sizeof(c->in) - 1) break;  // 命令过长
+    }
+    if (c->pasv_fd >= 0) close(c->pasv_fd);
+    FtpdDataDrop(c);
+    close(c->ctl_fd);
+    free(c->buf);
+    free(c);
+    return NULL;
+}
+
+int FtpdListen(int port, int* bound) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    int opt = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 ||
+        listen(fd, 512) < 0 ||
+        getsockname(fd, (struct sockaddr*) &addr, &len) < 0) {
+        close(fd);
+        return -1;
+    }
+    if (bound) *bound = ntohs(addr.sin_port);
+    return fd;
+}
+
+static int ftpd_nodelay = 1;
+
+void FtpdSetNodelay(int on) {
+    ftpd_nodelay = on;
+}
+
+void FtpdServe(int lfd, const char* root) {
+    signal(SIGPIPE, SIG_IGN);
+    if (chdir(root) < 0) {
+        perror(root);
+        exit(EXIT_FAILURE);
+    }
+    while (1) {
+        int fd = accept(lfd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            perror("accept");
+            exit(EXIT_FAILURE);
+        }
+        // 响应很短, 关闭 Nagle 避免与客户端的延迟 ACK 互相等待
+        int opt = 1;
+        if (ftpd_nodelay) {
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+        }
+        ftpd_conn* c = (ftpd_conn*) calloc(1, sizeof(ftpd_conn));
+        c->ctl_fd = fd;
+        c->pasv_fd = -1;
+        c->data_fd = -1;
+        c->level = Z_DEFAULT_COMPRESSION;
+        c->hash = FTP_HASH_SHA256;
+        strcpy(c->cwd, "/");
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, FtpdConnection, c) != 0) {
+            close(fd);
+            free(c);
+            continue;
+        }
+        pthread_detach(tid);
+    }
+}
+
+#ifndef FTPD_NO_MAIN
+int main(int argc, char* argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "n")) != -1) {
+        if (opt != 'n') {
+            fprintf(stderr, "usage: %s [-n] [port] [root]\n", argv[0]);
+            return 1;
+        }
+        FtpdSetNodelay(0);
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+    int port = argc > 1 ? atoi(argv[1]) : 2121;
+    const char* root = argc > 2 ? argv[2] : ".";
+    int lfd = FtpdListen(port, &port);
+    if (lfd < 0) {
+        perror("listen");
+        return 1;
+    }
+    printf("ftpd listening on 127.0.0.1:%d, root %s\n", port, root);
+    fflush(stdout);
+    FtpdServe(lfd, root);
+    return 0;
+}
+#endif
@@ -0,0 +1,17 @@
+/*
+    基准测试用的本机 FTP 服务器
+    只实现客户端用到的命令, 每个控制连接一个线程, 不做权限检查, 不要暴露到网络
+*/
+#ifndef BENCH_FTPD_H_
+#define BENCH_FTPD_H_
+
+/* 以 root 为根目录在已监听的 lfd 上提供服务, 不返回 */
+void FtpdServe(int lfd, const char* root);
+
+/* on 为 0 时控制连接保留 Nagle (不设置 TCP_NODELAY), 需在 FtpdServe 之前调用 */
+void FtpdSetNodelay(int on);
+
+/* 监听 127.0.0.1:port, port 为 0 时由内核分配, 返回套接字, *bound 为实际端口 */
+int FtpdListen(int port, int* bound);
+
+#endif  // BENCH_FTPD_H_
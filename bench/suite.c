@@ -0,0 +1,433 @@
+/*
+    本机回环基准测试
+    在子进程中启动 bench/ftpd.c 的服务器, 用 libftpclient 按不同文件大小, 数据缓冲区,
+    文件数和并发数执行 FTPGet/FTPPut/FTPList, 每项输出:
+    吞吐量 MB/s, 单次操作延迟 p50/p99, 每 MB 的读写系统调用次数 (/proc/self/io),
+    客户端进程 CPU 时间 (user + sys); 服务器在另一个进程, 不计入
+    限速的项 (*-rate*) 检查传输时间与限速计算的时间相差不超过 5%, 超出时该项失败,
+    包括单个传输和 pget/pput 各分段共享令牌桶的合计速率
+
+    -c/-d 在客户端和服务器之间插入 bench/wanproxy.c 的代理, 分别设置控制连接和数据连接的
+    延迟, 抖动, 带宽和丢包停顿, 用于比较流水线, 并行分段和连接池在高 RTT 链路上的效果
+
+    -n 服务器控制连接保留 Nagle, 检查流水线发送的命令不会等待延迟 ACK (约 40ms)
+
+    make bench && ./bench/suite [-c 控制链路] [-d 数据链路] [-n] [-t 临时目录] [名称过滤]
+    ./bench/suite -c delay=25 -d delay=25,bw=20480,loss=0.01 get-1M
+*/
+#define _XOPEN_SOURCE 700
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fcntl.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "../ftpclient.h"
+#include "ftpd.h"
+#include "wanproxy.h"
+
+#define BENCH_GET 1
+#define BENCH_PUT 2
+#define BENCH_LIST 3
+#define BENCH_PGET 4
+#define BENCH_PPUT 5
+#define BENCH_LIST_ENTRIES 1000
+#define BENCH_MAX_THREADS 64
+#define BENCH_RATE_TOLERANCE 0.05
+
+typedef struct bench_case {
+    const char* name;
+    int op;
+    long file_size;  // LIST 时为目录中的文件数
+    int nops;        // 操作次数, GET/PUT 时即文件数
+    int buf_kb;      // data_buf_size
+    int nthreads;    // 并发会话数
+    int zero_copy;   // 0 时使用 read/write, 数据缓冲区大小才有影响
+    int mode;        // 'B' 块模式, 数据连接在文件之间保留; 'Z' 压缩模式
+    int rate_kb;     // 限速 KB/s, 0 不限速
+    int segments;    // PGET/PPUT 的分段数
+} bench_case;
+
+static const bench_case cases[] = {
+        {"get-4K", BENCH_GET, 4 << 10, 500, 256, 1, 1},
+        {"get-1M", BENCH_GET, 1 << 20, 100, 256, 1, 1},
+        {"get-64M", BENCH_GET, 64 << 20, 4, 256, 1, 1},
+        {"get-16M-rw-buf4K", BENCH_GET, 16 << 20, 8, 4, 1, 0},
+        {"get-16M-rw-buf64K", BENCH_GET, 16 << 20, 8, 64, 1, 0},
+        {"get-16M-rw-buf1M", BENCH_GET, 16 << 20, 8, 1024, 1, 0},
+        {"get-1M-c4", BENCH_GET, 1 << 20, 256, 256, 4, 1},
+        {"get-1M-c16", BENCH_GET, 1 << 20, 256, 256, 16, 1},
+        {"put-4K", BENCH_PUT, 4 << 10, 500, 256, 1, 1},
+        {"put-1M", BENCH_PUT, 1 << 20, 100, 256, 1, 1},
+        {"put-64M", BENCH_PUT, 64 << 20, 4, 256, 1, 1},
+        {"put-1M-c8", BENCH_PUT, 1 << 20, 256, 256, 8, 1},
+        {"get-4K-modeb", BENCH_GET, 4 << 10, 500, 256, 1, 1, 'B'},
+        {"put-4K-modeb", BENCH_PUT, 4 << 10, 500, 256, 1, 1, 'B'},
+        {"get-64M-modeb", BENCH_GET, 64 << 20, 4, 256, 1, 1, 'B'},
+        {"get-16M-modez", BENCH_GET, 16 << 20, 8, 256, 1, 1, 'Z'},
+        {"put-16M-modez", BENCH_PUT, 16 << 20, 8, 256, 1, 1, 'Z'},
+        {"get-4M-rate2M", BENCH_GET, 4 << 20, 1, 256, 1, 1, 0, 2048},
+        {"put-4M-rate2M", BENCH_PUT, 4 << 20, 1, 256, 1, 1, 0, 2048},
+        {"pget-4M-n4-rate2M", BENCH_PGET, 4 << 20, 1, 256, 1, 1, 0, 2048, 4},
+        {"pput-4M-n4-rate2M", BENCH_PPUT, 4 << 20, 1, 256, 1, 1, 0, 2048, 4},
+        {"list-1000", BENCH_LIST, BENCH_LIST_ENTRIES, 50, 256, 1, 1},
+        {"list-1000-c8", BENCH_LIST, BENCH_LIST_ENTRIES, 200, 256, 8, 1},
+};
+
+/* 一项测试的运行状态, 各线程共享 */
+typedef struct bench_run {
+    const bench_case* c;
+    int index;
+    int port;
+    atomic_int next;    // 下一个操作序号
+    atomic_int failed;
+    double* latency;    // 每次操作耗时 (秒)
+} bench_run;
+
+static double Now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double CpuSeconds(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+           ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+/* /proc/self/io 中读写系统调用次数之和 */
+static long IoSyscalls(void) {
+    FILE* fp = fopen("/proc/self/io", "r");
+    char line[128];
+    long n, total = 0;
+    while (fp && fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "syscr: %ld", &n) == 1 ||
+            sscanf(line, "syscw: %ld", &n) == 1) {
+            total += n;
+        }
+    }
+    if (fp) fclose(fp);
+    return total;
+}
+
+static int WriteFile(const char* path, long size, const char* pattern) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    while (size > 0) {
+        long n = size > (1 << 20) ? (1 << 20) : size;
+        if (write(fd, pattern, n) != n) {
+            close(fd);
+            return -1;
+        }
+        size -= n;
+    }
+    close(fd);
+    return 0;
+}
+
+static int RemoveEntry(const char* path,
+                       const struct stat* st,
+                       int flag,
+                       struct FTW* ftw) {
+    return remove(path);
+}
+
+static void RemoveTree(const char* path) {
+    nftw(path, RemoveEntry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+static int CompareDouble(const void* a, const void* b) {
+    double x = *(const double*) a, y = *(const double*) b;
+    return x < y ? -1 : x > y;
+}
+
+static void* Worker(void* arg) {
+    bench_run* run = (bench_run*) arg;
+    const bench_case* c = run->c;
+    ftp_session s;
+    FTPSessionInit(&s);
+    s.verbose = 0;
+    char dir[64];
+    snprintf(dir, sizeof(dir), "/c%d", run->index);
+    if (FTPOpen(&s, "127.0.0.1", run->port) == -1 ||
+        FTPLogin(&s, "bench", "bench") == -1 || FTPBinary(&s) == -1 ||
+        FTPCd(&s, dir) == -1) {
+        atomic_fetch_add(&run->failed, 1);
+        return NULL;
+    }
+    FTPSetDataBuffer(&s, c->buf_kb << 10);
+    s.zero_copy = c->zero_copy;
+    if (c->rate_kb) FTPSetRateLimit(&s, c->rate_kb);
+    if (c->mode && FTPMode(&s, c->mode) == -1) {
+        atomic_fetch_add(&run->failed, 1);
+        FTPQuit(&s);
+        return NULL;
+    }
+
+    int i;
+    while ((i = atomic_fetch_add(&run->next, 1)) < c->nops) {
+        char remote[64], local[64];
+        snprintf(remote, sizeof(remote), "f%d", i);
+        snprintf(local, sizeof(local), "c%d_f%d", run->index, i);
+        double start = Now();
+        int ret = 0;
+        if (c->op == BENCH_GET) {
+            ret = FTPGet(&s, remote, local);
+        } else if (c->op == BENCH_PUT) {
+            ret = FTPPut(&s, local, remote);
+        } else if (c->op == BENCH_PGET) {
+            ret = FTPPget(&s, remote, c->segments);
+        } else if (c->op == BENCH_PPUT) {
+            ret = FTPPput(&s, local, c->segments);
+        } else {
+            ret = FTPList(&s);
+        }
+        run->latency[i] = Now() - start;
+        if (ret == -1) atomic_fetch_add(&run->failed, 1);
+    }
+    FTPQuit(&s);
+    return NULL;
+}
+
+/* 准备数据: GET/LIST 在服务器目录生成文件, PUT 在客户端目录生成文件 */
+static int Prepare(const bench_case* c,
+                   int index,
+                   const char* srv_root,
+                   const char* pattern) {
+    char path[PATH_MAX + 64];
+    snprintf(path, sizeof(path), "%s/c%d", srv_root, index);
+    if (mkdir(path, 0755) < 0) return -1;
+    int n = c->op == BENCH_LIST ? c->file_size : c->nops;
+    long size = c->op == BENCH_LIST ? 0 : c->file_size;
+    int i;
+    for (i = 0; i < n; i++) {
+        if (c->op == BENCH_PUT || c->op == BENCH_PPUT) {
+            snprintf(path, sizeof(path), "c%d_f%d", index, i);
+        } else {
+            snprintf(path, sizeof(path), "%s/c%d/f%d", srv_root, index, i);
+        }
+        if (WriteFile(path, size, pattern) == -1) return -1;
+    }
+    return 0;
+}
+
+static void Cleanup(const bench_case* c, int index, const char* srv_root) {
+    char path[PATH_MAX + 64];
+    snprintf(path, sizeof(path), "%s/c%d", srv_root, index);
+    RemoveTree(path);
+    int i;
+    for (i = 0; c->op != BENCH_LIST && i < c->nops; i++) {
+        snprintf(path, sizeof(path), "c%d_f%d", index, i);
+        unlink(path);
+        snprintf(path, sizeof(path), "f%d", i);  // pget 下载到远程文件名
+        unlink(path);
+    }
+}
+
+static int RunCase(FILE* out,
+                   const bench_case* c,
+                   int index,
+                   int port,
+                   const char* srv_root,
+                   const char* pattern) {
+    if (Prepare(c, index, srv_root, pattern) == -1) {
+        fprintf(out, "%-18s prepare failed.\n", c->name);
+        return -1;
+    }
+    bench_run run;
+    run.c = c;
+    run.index = index;
+    run.port = port;
+    atomic_init(&run.next, 0);
+    atomic_init(&run.failed, 0);
+    run.latency = (double*) calloc(c->nops, sizeof(double));
+
+    pthread_t tids[BENCH_MAX_THREADS];
+    int nthreads = c->nthreads < BENCH_MAX_THREADS ? c->nthreads
+                                                   : BENCH_MAX_THREADS;
+    long syscalls = IoSyscalls();
+    double cpu = CpuSeconds();
+    double start = Now();
+    int i;
+    for (i = 0; i < nthreads; i++) {
+        pthread_create(&tids[i], NULL, Worker, &run);
+    }
+    for (i = 0; i < nthreads; i++) pthread_join(tids[i], NULL);
+    double secs = Now() - start;
+    cpu = CpuSeconds() - cpu;
+    syscalls = IoSyscalls() - syscalls;
+
+    qsort(run.latency, c->nops, sizeof(double), CompareDouble);
+    double p50 = run.latency[(c->nops - 1) * 50 / 100];
+    double p99 = run.latency[(c->nops - 1) * 99 / 100];
+    double mb = c->op == BENCH_LIST ? 0 : (double) c->file_size * c->nops /
+                                                  (1 << 20);
+    if (mb > 0) {
+        fprintf(out,
+                "%-18s %6d %4d %9.1f %9.1f %9.1f %9.3f %9.3f %9.1f %8.3f",
+                c->name,
+                c->nops,
+                nthreads,
+                mb,
+                mb / secs,
+                c->nops / secs,
+                p50 * 1e3,
+                p99 * 1e3,
+                syscalls / mb,
+                cpu);
+    } else {
+        fprintf(out,
+                "%-18s %6d %4d %9s %9s %9.1f %9.3f %9.3f %9s %8.3f",
+                c->name,
+                c->nops,
+                nthreads,
+                "-",
+                "-",
+                c->nops / secs,
+                p50 * 1e3,
+                p99 * 1e3,
+                "-",
+                cpu);
+    }
+    int failed = atomic_load(&run.failed);
+    if (failed) fprintf(out, "  %d failed", failed);
+    // 限速时每次操作应耗时 (大小 - 令牌桶容量) / 速率, 桶开始时是满的
+    if (c->rate_kb && !failed) {
+        double busy = 0;
+        for (i = 0; i < c->nops; i++) busy += run.latency[i];
+        double expect = c->nops * ((double) c->file_size / (c->rate_kb << 10) -
+                                   FTP_RATE_SLICE_MS / 1e3);
+        double dev = busy / expect - 1;
+        fprintf(out, "  rate %+.1f%%", dev * 100);
+        if (dev > BENCH_RATE_TOLERANCE || dev < -BENCH_RATE_TOLERANCE) {
+            fprintf(out, " out of range");
+            failed = 1;
+        }
+    }
+    fprintf(out, "\n");
+    fflush(out);
+    free(run.latency);
+    Cleanup(c, index, srv_root);
+    return failed ? -1 : 0;
+}
+
+int main(int argc, char* argv[]) {
+    const char* tmp_dir = "/tmp";
+    static wan_link ctl, data;
+    int wan = 0;
+    WanParseLink("", &ctl);
+    WanParseLink("", &data);
+    int opt;
+    while ((opt = getopt(argc, argv, "c:d:nt:")) != -1) {
+        if (opt == 't') {
+            tmp_dir = optarg;
+        } else if (opt == 'n') {
+            FtpdSetNodelay(0);
+        } else if ((opt == 'c' && WanParseLink(optarg, &ctl) == 0) ||
+                   (opt == 'd' && WanParseLink(optarg, &data) == 0)) {
+            wan = 1;
+        } else {
+            fprintf(stderr,
+                    "usage: %s [-c link] [-d link] [-n] [-t dir] [filter]\n"
+                    "link: delay=MS,jitter=MS,bw=KB/s,loss=P,stall=MS\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    const char* filter = optind < argc ? argv[optind] : "";
+    char tmp[PATH_MAX - 64];
+    snprintf(tmp, sizeof(tmp), "%s/ftpbench.XXXXXX", tmp_dir);
+    if (mkdtemp(tmp) == NULL) {
+        perror(tmp);
+        return 1;
+    }
+    char srv_root[PATH_MAX], cli_root[PATH_MAX];
+    snprintf(srv_root, sizeof(srv_root), "%s/srv", tmp);
+    snprintf(cli_root, sizeof(cli_root), "%s/cli", tmp);
+    if (mkdir(srv_root, 0755) < 0 || mkdir(cli_root, 0755) < 0 ||
+        chdir(cli_root) < 0) {
+        perror(tmp);
+        return 1;
+    }
+
+    int port;
+    int lfd = FtpdListen(0, &port);
+    if (lfd < 0) {
+        perror("listen");
+        return 1;
+    }
+    pid_t pid = fork();
+    if (pid == 0) FtpdServe(lfd, srv_root);
+    close(lfd);
+
+    // 客户端改为连接代理
+    pid_t proxy_pid = -1;
+    if (wan) {
+        int server_port = port;
+        lfd = FtpdListen(0, &port);
+        if (lfd < 0) {
+            perror("listen");
+            kill(pid, SIGTERM);
+            return 1;
+        }
+        proxy_pid = fork();
+        if (proxy_pid == 0) {
+            WanProxyServe(lfd, "127.0.0.1", server_port, &ctl, &data);
+        }
+        close(lfd);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    // 库函数的输出写到 stdout, 测试期间丢弃, 结果写到原来的 stdout
+    FILE* out = fdopen(dup(STDOUT_FILENO), "w");
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+    close(null_fd);
+
+    char* pattern = (char*) malloc(1 << 20);
+    int i;
+    for (i = 0; i < (1 << 20); i++) pattern[i] = (char) (i * 131 + (i >> 9));
+
+    fprintf(out,
+            "%-18s %6s %4s %9s %9s %9s %9s %9s %9s %8s\n",
+            "case",
+            "ops",
+            "conc",
+            "MB",
+            "MB/s",
+            "ops/s",
+            "p50_ms",
+            "p99_ms",
+            "sys/MB",
+            "cpu_s");
+    int nfailed = 0;
+    for (i = 0; i < (int) (sizeof(cases) / sizeof(cases[0])); i++) {
+        if (strstr(cases[i].name, filter) == NULL) continue;
+        if (RunCase(out, &cases[i], i, port, srv_root, pattern) == -1) {
+            nfailed++;
+        }
+    }
+
+    if (proxy_pid > 0) {
+        kill(proxy_pid, SIGTERM);
+        waitpid(proxy_pid, NULL, 0);
+    }
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    if (chdir("/") == 0) RemoveTree(tmp);
+    free(pattern);
+    fclose(out);
+    return nfailed ? 1 : 0;
+}
@@ -0,0 +1,528 @@
+/*
+    广域网模拟代理
+    每个连接的每个方向一个读线程和一个写线程:
+    读线程收到一块数据后按 延迟 + 抖动 + 带宽排队 + 随机停顿 计算发出时刻, 放入队列,
+    写线程到时刻后发出; 发出时刻单调递增, 数据不会乱序
+    控制连接按行转发, 服务器的 "227 ..." 和客户端的 "PORT ..." 改写为代理的地址,
+    随后的数据连接由代理接受并转发到真实地址, 使用数据链路参数
+
+    make bench && ./bench/wanproxy -l 2200 -u 127.0.0.1:2121 -c delay=50 -d delay=50,bw=10240
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+
+#include "wanproxy.h"
+
+#define WAN_CHUNK (64 << 10)
+#define WAN_LINE 4096
+#define WAN_QUEUE_MAX (64 << 20)   // 每个方向最多排队的字节数
+#define WAN_ACCEPT_TIMEOUT 30000   // 等待数据连接 (毫秒)
+
+typedef struct wan_chunk {
+    struct wan_chunk* next;
+    double release;  // 发出时刻 (CLOCK_MONOTONIC 秒)
+    int len;
+    char data[];
+} wan_chunk;
+
+typedef struct wan_conn wan_conn;
+
+/* 一个方向 */
+typedef struct wan_pipe {
+    wan_conn* conn;
+    int src, dst;
+    int from_server;      // 服务器到客户端方向
+    pthread_mutex_t mu;
+    pthread_cond_t cond;
+    wan_chunk* head;
+    wan_chunk* tail;
+    long queued;
+    int eof;
+    int broken;           // 写失败, 读线程停止
+    double last;          // 上一块的发出时刻
+    double busy;          // 带宽排队到的时刻
+    unsigned seed;
+    char line[WAN_LINE];  // 控制连接未完整的行
+    int line_len;
+} wan_pipe;
+
+/* 一对连接: fds[0] 客户端一侧, fds[1] 服务器一侧 */
+struct wan_conn {
+    int fds[2];
+    int control;
+    const wan_link* link;
+    wan_pipe pipes[2];  // [0] 客户端 -> 服务器, [1] 服务器 -> 客户端
+    atomic_int refs;
+};
+
+/* 等待一个数据连接 */
+typedef struct wan_data {
+    int lfd;
+    int from_server;            // PORT 模式, 服务器主动连接代理
+    struct sockaddr_in target;  // 接受后连接的真实地址
+} wan_data;
+
+static const char* upstream_ip;
+static int upstream_port;
+static const wan_link* ctl_link;
+static const wan_link* data_link;
+
+static double Now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void SleepUntil(double t) {
+    struct timespec ts;
+    ts.tv_sec = (time_t) t;
+    ts.tv_nsec = (long) ((t - ts.tv_sec) * 1e9);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+           EINTR) {
+        continue;
+    }
+}
+
+int WanParseLink(const char* spec, wan_link* link) {
+    memset(link, 0, sizeof(*link));
+    link->stall_ms = 200;
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s", spec);
+    char* save = NULL;
+    char* kv;
+    for (kv = strtok_r(buf, ",", &save); kv != NULL;
+         kv = strtok_r(NULL, ",", &save)) {
+        char* val = strchr(kv, '=');
+        if (val == NULL) return -1;
+        *val++ = '\0';
+        if (strcmp(kv, "delay") == 0) {
+            link->delay_ms = atoi(val);
+        } else if (strcmp(kv, "jitter") == 0) {
+            link->jitter_ms = atoi(val);
+        } else if (strcmp(kv, "bw") == 0) {
+            link->bw = atol(val) * 1024;
+        } else if (strcmp(kv, "loss") == 0) {
+            link->loss = atof(val);
+        } else if (strcmp(kv, "stall") == 0) {
+            link->stall_ms = atoi(val);
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void WanConnRelease(wan_conn* c) {
+    if (atomic_fetch_sub(&c->refs, 1) != 1) return;
+    int i;
+    for (i = 0; i < 2; i++) {
+        wan_pipe* p = &c->pipes[i];
+        while (p->head) {
+            wan_chunk* next = p->head->next;
+            free(p->head);
+            p->head = next;
+        }
+        pthread_mutex_destroy(&p->mu);
+        pthread_cond_destroy(&p->cond);
+        close(c->fds[i]);
+    }
+    free(c);
+}
+
+/* 计算发出时刻并入队, 队列满时等待, 写端已断开返回 -1 */
+static int WanEnqueue(wan_pipe* p, const char* data, int len) {
+    const wan_link* link = p->conn->link;
+    double now = Now();
+    double t = now;
+    if (link->bw > 0) {
+        // 串行化: 前一块发完才开始发这一块
+        p->busy = (p->busy > now ? p->busy : now) + (double) len / link->bw;
+        t = p->busy;
+    }
+    t += link->delay_ms / 1e3;
+    if (link->jitter_ms > 0) {
+        t += (rand_r(&p->seed) % (link->jitter_ms * 1000)) / 1e6;
+    }
+    if (link->loss > 0 && rand_r(&p->seed) < link->loss * RAND_MAX) {
+        t += link->stall_ms / 1e3;
+    }
+    if (t < p->last) t = p->last;
+    p->last = t;
+
+    wan_chunk* chunk = (wan_chunk*) malloc(sizeof(wan_chunk) + len);
+    chunk->next = NULL;
+    chunk->release = t;
+    chunk->len = len;
+    memcpy(chunk->data, data, len);
+
+    pthread_mutex_lock(&p->mu);
+    while (p->queued > WAN_QUEUE_MAX && !p->broken) {
+        pthread_cond_wait(&p->cond, &p->mu);
+    }
+    if (p->broken) {
+        pthread_mutex_unlock(&p->mu);
+        free(chunk);
+        return -1;
+    }
+    if (p->tail) {
+        p->tail->next = chunk;
+    } else {
+        p->head = chunk;
+    }
+    p->tail = chunk;
+    p->queued += len;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->mu);
+    return 0;
+}
+
+static void* WanDataAccept(void* arg);
+
+/* 新建监听套接字, 地址与 fd 的本端地址相同, 端口由内核分配 */
+static int WanListen(int fd, struct sockaddr_in* addr) {
+    socklen_t len = sizeof(*addr);
+    if (getsockname(fd, (struct sockaddr*) addr, &len) < 0) return -1;
+    addr->sin_port = 0;
+    int lfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (lfd < 0) return -1;
+    if (bind(lfd, (struct sockaddr*) addr, sizeof(*addr)) < 0 ||
+        listen(lfd, 16) < 0 ||
+        getsockname(lfd, (struct sockaddr*) addr, &len) < 0) {
+        close(lfd);
+        return -1;
+    }
+    return lfd;
+}
+
+/*
+    改写 "227 Entering Passive Mode (h1,h2,h3,h4,p1,p2)" 或 "PORT h1,h2,h3,h4,p1,p2"
+    代理在本端地址上监听并等待数据连接, 返回改写后的行长度, 不需改写返回 -1
+*/
+static int WanRewrite(wan_pipe* p, const char* line, int len, char* out) {
+    int pasv = p->from_server && len > 4 && strncmp(line, "227 ", 4) == 0;
+    int port = !p->from_server && len > 5 && strncasecmp(line, "PORT ", 5) == 0;
+    if (!pasv && !port) return -1;
+
+    int h[4], p1, p2;
+    const char* args = pasv ? strchr(line, '(') : line + 5;
+    if (args == NULL) return -1;
+    if (pasv) args++;
+    if (sscanf(args,
+               "%d,%d,%d,%d,%d,%d",
+               &h[0],
+               &h[1],
+               &h[2],
+               &h[3],
+               &p1,
+               &p2) != 6) {
+        return -1;
+    }
+    wan_data* d = (wan_data*) calloc(1, sizeof(wan_data));
+    d->from_server = port;
+    d->target.sin_family = AF_INET;
+    d->target.sin_port = htons(p1 * 256 + p2);
+    char ip[INET_ADDRSTRLEN];
+    snprintf(ip, sizeof(ip), "%d.%d.%d.%d", h[0], h[1], h[2], h[3]);
+    // 服务器给出 0.0.0.0 时使用控制连接的地址
+    if (pasv && strcmp(ip, "0.0.0.0") == 0) {
+        snprintf(ip, sizeof(ip), "%s", upstream_ip);
+    }
+    inet_pton(AF_INET, ip, &d->target.sin_addr);
+
+    // PASV 时客户端连接代理, 监听客户端一侧地址; PORT 时服务器连接代理
+    struct sockaddr_in addr;
+    d->lfd = WanListen(p->conn->fds[pasv ? 0 : 1], &addr);
+    pthread_t tid;
+    if (d->lfd < 0 || pthread_create(&tid, NULL, WanDataAccept, d) != 0) {
+        if (d->lfd >= 0) close(d->lfd);
+        free(d);
+        return -1;
+    }
+    pthread_detach(tid);
+
+    unsigned char* a = (unsigned char*) &addr.sin_addr;
+    int lport = ntohs(addr.sin_port);
+    if (pasv) {
+        return sprintf(out,
+                       "227 Entering Passive Mode (%d,%d,%d,%d,%d,%d).\r\n",
+                       a[0],
+                       a[1],
+                       a[2],
+                       a[3],
+                       lport >> 8,
+                       lport & 0xff);
+    }
+    return sprintf(out,
+                   "PORT %d,%d,%d,%d,%d,%d\r\n",
+                   a[0],
+                   a[1],
+                   a[2],
+                   a[3],
+                   lport >> 8,
+                   lport & 0xff);
+}
+
+/* 控制连接按行处理, 不完整的行留到下次 */
+static int WanControl(wan_pipe* p, const char* data, int len, char* out) {
+    int out_len = 0;
+    int i;
+    for (i = 0; i < len; i++) {
+        p->line[p->line_len++] = data[i];
+        if (data[i] != '\n' && p->line_len < WAN_LINE) continue;
+        int n = WanRewrite(p, p->line, p->line_len, out + out_len);
+        if (n < 0) {
+            memcpy(out + out_len, p->line, p->line_len);
+            n = p->line_len;
+        }
+        out_len += n;
+        p->line_len = 0;
+    }
+    return out_len;
+}
+
+static void* WanReader(void* arg) {
+    wan_pipe* p = (wan_pipe*) arg;
+    const wan_link* link = p->conn->link;
+    // 限速时每块不超过 10ms 的数据量, 使带宽排队足够平滑
+    int chunk = WAN_CHUNK;
+    if (link->bw > 0 && link->bw / 100 < chunk) {
+        chunk = link->bw / 100 > 512 ? link->bw / 100 : 512;
+    }
+    char* buf = (char*) malloc(WAN_CHUNK);
+    char* out = (char*) malloc(WAN_CHUNK * 2);
+    while (1) {
+        ssize_t n = recv(p->src, buf, p->conn->control ? WAN_LINE : chunk, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        if (p->conn->control) {
+            n = WanControl(p, buf, n, out);
+            if (n > 0 && WanEnqueue(p, out, n) == -1) break;
+        } else if (WanEnqueue(p, buf, n) == -1) {
+            break;
+        }
+    }
+    pthread_mutex_lock(&p->mu);
+    p->eof = 1;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->mu);
+    free(buf);
+    free(out);
+    WanConnRelease(p->conn);
+    return NULL;
+}
+
+static void* WanWriter(void* arg) {
+    wan_pipe* p = (wan_pipe*) arg;
+    while (1) {
+        pthread_mutex_lock(&p->mu);
+        while (p->head == NULL && !p->eof) pthread_cond_wait(&p->cond, &p->mu);
+        wan_chunk* chunk = p->head;
+        if (chunk) {
+            p->head = chunk->next;
+            if (p->head == NULL) p->tail = NULL;
+            p->queued -= chunk->len;
+            pthread_cond_broadcast(&p->cond);
+        }
+        pthread_mutex_unlock(&p->mu);
+        if (chunk == NULL) break;
+
+        SleepUntil(chunk->release);
+        int off = 0;
+        while (off < chunk->len) {
+            ssize_t n = send(p->dst,
+                             chunk->data + off,
+                             chunk->len - off,
+                             MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            off += n;
+        }
+        int done = off == chunk->len;
+        free(chunk);
+        if (!done) {
+            // 对端已关闭, 停止读线程
+            pthread_mutex_lock(&p->mu);
+            p->broken = 1;
+            pthread_cond_broadcast(&p->cond);
+            pthread_mutex_unlock(&p->mu);
+            shutdown(p->src, SHUT_RDWR);
+            break;
+        }
+    }
+    shutdown(p->dst, SHUT_WR);
+    WanConnRelease(p->conn);
+    return NULL;
+}
+
+/* 转发 client_fd 与 server_fd 之间的数据 */
+static void WanConnStart(int client_fd,
+                         int server_fd,
+                         int control,
+                         const wan_link* link) {
+    int opt = 1;
+    setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    setsockopt(server_fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    wan_conn* c = (wan_conn*) calloc(1, sizeof(wan_conn));
+    c->fds[0] = client_fd;
+    c->fds[1] = server_fd;
+    c->control = control;
+    c->link = link;
+    atomic_init(&c->refs, 4);
+    int i;
+    for (i = 0; i < 2; i++) {
+        wan_pipe* p = &c->pipes[i];
+        p->conn = c;
+        p->src = c->fds[i];
+        p->dst = c->fds[1 - i];
+        p->from_server = i;
+        p->seed = (unsigned) time(NULL) ^ (unsigned) (client_fd * 2 + i);
+        pthread_mutex_init(&p->mu, NULL);
+        pthread_cond_init(&p->cond, NULL);
+    }
+    for (i = 0; i < 4; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid,
+                           NULL,
+                           i < 2 ? WanReader : WanWriter,
+                           &c->pipes[i % 2]) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(tid);
+    }
+}
+
+static int WanConnectTo(const struct sockaddr_in* addr) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (const struct sockaddr*) addr, sizeof(*addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+    PASV 只接受一个数据连接
+    PORT 时客户端之后的传输都复用同一个地址, 持续接受服务器的连接, 空闲超时后退出
+*/
+static void* WanDataAccept(void* arg) {
+    wan_data* d = (wan_data*) arg;
+    struct pollfd pfd = {d->lfd, POLLIN, 0};
+    do {
+        if (poll(&pfd, 1, WAN_ACCEPT_TIMEOUT) != 1) break;
+        int fd = accept(d->lfd, NULL, NULL);
+        if (fd < 0) continue;
+        int peer = WanConnectTo(&d->target);
+        if (peer < 0) {
+            close(fd);
+        } else if (d->from_server) {
+            WanConnStart(peer, fd, 0, data_link);
+        } else {
+            WanConnStart(fd, peer, 0, data_link);
+        }
+    } while (d->from_server);
+    close(d->lfd);
+    free(d);
+    return NULL;
+}
+
+void WanProxyServe(int lfd,
+                   const char* ip,
+                   int port,
+                   const wan_link* ctl,
+                   const wan_link* data) {
+    signal(SIGPIPE, SIG_IGN);
+    upstream_ip = ip;
+    upstream_port = port;
+    ctl_link = ctl;
+    data_link = data;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(upstream_port);
+    inet_pton(AF_INET, upstream_ip, &addr.sin_addr);
+    while (1) {
+        int fd = accept(lfd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            perror("accept");
+            exit(EXIT_FAILURE);
+        }
+        int server_fd = WanConnectTo(&addr);
+        if (server_fd < 0) {
+            close(fd);
+            continue;
+        }
+        WanConnStart(fd, server_fd, 1, ctl_link);
+    }
+}
+
+#ifndef WANPROXY_NO_MAIN
+int main(int argc, char* argv[]) {
+    int port = 2200;
+    char ip[INET_ADDRSTRLEN] = "127.0.0.1";
+    int up_port = 2121;
+    static wan_link ctl, data;
+    WanParseLink("", &ctl);
+    WanParseLink("", &data);
+    int opt;
+    while ((opt = getopt(argc, argv, "l:u:c:d:")) != -1) {
+        switch (opt) {
+        case 'l':
+            port = atoi(optarg);
+            break;
+        case 'u':
+            if (sscanf(optarg, "%15[^:]:%d", ip, &up_port) != 2) goto usage;
+            break;
+        case 'c':
+            if (WanParseLink(optarg, &ctl) == -1) goto usage;
+            break;
+        case 'd':
+            if (WanParseLink(optarg, &data) == -1) goto usage;
+            break;
+        default:
+            goto usage;
+        }
+    }
+
+    int lfd = socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(lfd, (struct sockaddr*) &addr, sizeof(addr)) < 0 ||
+        listen(lfd, 512) < 0) {
+        perror("listen");
+        return 1;
+    }
+    printf("wanproxy 127.0.0.1:%d -> %s:%d\n", port, ip, up_port);
+    fflush(stdout);
+    WanProxyServe(lfd, ip, up_port, &ctl, &data);
+    return 0;
+
+usage:
+    fprintf(stderr,
+            "usage: %s [-l port] [-u ip:port] [-c link] [-d link]\n"
+            "link: delay=MS,jitter=MS,bw=KB/s,loss=P,stall=MS\n",
+            argv[0]);
+    return 1;
+}
+#endif
@@ -0,0 +1,28 @@
+/*
+    广域网模拟代理
+    位于客户端和 FTP 服务器之间, 对控制连接和数据连接分别注入延迟, 抖动, 带宽限制和丢包停顿
+    改写 227 (PASV) 响应和 PORT 命令, 数据连接也经过代理
+*/
+#ifndef BENCH_WANPROXY_H_
+#define BENCH_WANPROXY_H_
+
+/* 单向链路参数, 两个方向各自独立生效 */
+typedef struct wan_link {
+    int delay_ms;   // 单向延迟, RTT 约为两倍
+    int jitter_ms;  // 每块数据额外随机延迟 [0, jitter_ms), 不会乱序
+    long bw;        // 带宽上限 byte/s, <=0 不限
+    double loss;    // 每块数据发生停顿的概率, 模拟丢包重传
+    int stall_ms;   // 停顿时长, 默认 200ms (Linux 最小 RTO)
+} wan_link;
+
+/* 解析 "delay=50,jitter=5,bw=1024,loss=0.01,stall=200", bw 单位 KB/s */
+int WanParseLink(const char* spec, wan_link* link);
+
+/* 在已监听的 lfd 上接受客户端, 转发到 upstream_ip:upstream_port, 不返回 */
+void WanProxyServe(int lfd,
+                   const char* upstream_ip,
+                   int upstream_port,
+                   const wan_link* ctl,
+                   const wan_link* data);
+
+#endif  // BENCH_WANPROXY_H_
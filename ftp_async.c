@@ -0,0 +1,476 @@
+/*
+    epoll 异步传输引擎
+    单线程驱动多个控制连接和数据连接, 每个任务是一个状态机:
+    连接 -> 220 -> USER/PASS -> TYPE I -> PASV -> 数据连接 + RETR/STOR
+    -> 150 -> 传输 -> 226 -> QUIT
+    所有套接字非阻塞, 控制连接响应由 FTPPollReply 增量解析
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "ftpclient.h"
+#include "log.h"
+
+#define ENGINE_EVENTS 64
+
+/* 任务状态, 除 JOB_CONNECT 外均为等待对应命令的响应 */
+enum {
+    JOB_QUEUED,
+    JOB_CONNECT,   // 控制连接 connect 进行中
+    JOB_BANNER,    // 220
+    JOB_USER,      // 331 / 230
+    JOB_PASS,      // 230
+    JOB_TYPE,      // 200
+    JOB_PASV,      // 227
+    JOB_OPEN,      // RETR/STOR 的 150
+    JOB_TRANSFER,  // 数据传输和 226
+    JOB_QUIT,      // 221
+    JOB_DONE
+};
+
+struct ftp_job {
+    ftp_session* s;  // 控制连接, 响应缓冲区; 任务启动时分配, 结束时释放
+    char server_ip[INET_ADDRSTRLEN];
+    int port;
+    char* username;
+    char* password;
+    int direction;  // FTP_ENGINE_GET / FTP_ENGINE_PUT
+    char* remote;
+    char* local;
+    int state;
+    int file_fd;
+    int data_fd;
+    off_t offset;     // 上传时 sendfile 的文件偏移
+    long size;        // 上传文件大小
+    long bytes;       // 已传输字节数
+    int data_done;    // 数据连接已结束
+    int reply_done;   // 已收到 226
+    int ok;
+    ftp_job_done done;
+    void* arg;
+};
+
+struct ftp_engine {
+    int epfd;
+    int max_active;  // 同时进行的任务数上限
+    int nactive;
+    int next;        // 下一个待启动的任务
+    int njobs, cap;
+    struct ftp_job* jobs;
+    int nfailed;
+    char* buf;       // 所有下载任务共享的接收缓冲区 (单线程)
+    int buf_size;
+};
+
+/* epoll 事件中区分任务和连接: 下标 * 2 + 是否数据连接 */
+static void EngineWatch(ftp_engine* e,
+                        int op,
+                        int fd,
+                        int id,
+                        int data,
+                        unsigned events) {
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.u64 = (uint64_t) id * 2 + data;
+    if (epoll_ctl(e->epfd, op, fd, &ev) < 0) LOGE("epoll_ctl error.\n");
+}
+
+/* 非阻塞 connect, 返回套接字, 结果在可写时由 SO_ERROR 得到 */
+static int EngineConnect(const char* ip, int port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        LOGE("socket failed.\n");
+        return -1;
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, ip, &addr.sin_addr);
+    if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 &&
+        errno != EINPROGRESS) {
+        LOGE("connect failed.\n");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* 发送一条命令, 控制连接命令很短, 发不完视为出错 */
+static int EngineCommand(struct ftp_job* job,
+                         const char* cmd,
+                         const char* arg) {
+    ftp_session* s = job->s;
+    if (arg) {
+        snprintf(s->send_buf, sizeof(s->send_buf), "%s %s\r\n", cmd, arg);
+    } else {
+        snprintf(s->send_buf, sizeof(s->send_buf), "%s\r\n", cmd);
+    }
+    size_t len = strlen(s->send_buf);
+    if (send(s->ctl_fd, s->send_buf, len, MSG_NOSIGNAL) != (ssize_t) len) {
+        LOGE("send %s error.\n", cmd);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+    任务结束, 关闭所有连接并释放会话
+    空出的并发名额由 FTPEngineRun 主循环调用 EngineStart 补上
+*/
+static void EngineFinish(ftp_engine* e, int id, int ok) {
+    struct ftp_job* job = &e->jobs[id];
+    if (job->state == JOB_DONE) return;
+    if (job->s) {
+        if (job->s->ctl_fd >= 0) close(job->s->ctl_fd);
+        free(job->s);
+        job->s = NULL;
+    }
+    if (job->data_fd >= 0) close(job->data_fd);
+    if (job->file_fd >= 0) close(job->file_fd);
+    job->data_fd = job->file_fd = -1;
+    job->state = JOB_DONE;
+    job->ok = ok;
+    if (!ok) e->nfailed++;
+    e->nactive--;
+    if (job->done) job->done(id, ok, job->bytes, job->arg);
+}
+
+/* 数据传输和 226 都完成后退出登录 */
+static void EngineTransferDone(ftp_engine* e, int id) {
+    struct ftp_job* job = &e->jobs[id];
+    if (!job->data_done || !job->reply_done) return;
+    job->ok = 1;
+    job->state = JOB_QUIT;
+    if (EngineCommand(job, "QUIT", NULL) == -1) EngineFinish(e, id, 1);
+}
+
+/*
+    启动排队的任务直到达到并发上限
+    立即失败的任务在循环内继续补位, 不递归
+*/
+static void EngineStart(ftp_engine* e) {
+    while (e->nactive < e->max_active && e->next < e->njobs) {
+        int id = e->next++;
+        struct ftp_job* job = &e->jobs[id];
+        e->nactive++;
+
+        job->s = (ftp_session*) malloc(sizeof(ftp_session));
+        if (job->s == NULL) {
+            LOGE("malloc error.\n");
+            EngineFinish(e, id, 0);
+            continue;
+        }
+        FTPSessionInit(job->s);
+        job->s->verbose = 0;
+        job->s->port = job->port;
+        memcpy(job->s->server_ip, job->server_ip, sizeof(job->server_ip));
+        snprintf(job->s->username,
+                 sizeof(job->s->username),
+                 "%s",
+                 job->username);
+        snprintf(job->s->password,
+                 sizeof(job->s->password),
+                 "%s",
+                 job->password);
+
+        if (job->direction == FTP_ENGINE_PUT) {
+            struct stat st;
+            job->file_fd = open(job->local, O_RDONLY);
+            if (job->file_fd < 0 || fstat(job->file_fd, &st) < 0) {
+                printf("%s No such file or directory.\n", job->local);
+                EngineFinish(e, id, 0);
+                continue;
+            }
+            job->size = st.st_size;
+        }
+        job->s->ctl_fd = EngineConnect(job->server_ip, job->port);
+        if (job->s->ctl_fd < 0) {
+            EngineFinish(e, id, 0);
+            continue;
+        }
+        job->state = JOB_CONNECT;
+        EngineWatch(e, EPOLL_CTL_ADD, job->s->ctl_fd, id, 0, EPOLLOUT);
+    }
+}
+
+/* 处理一条控制连接响应, 返回 -1 表示任务失败 */
+static int EngineReply(ftp_engine* e, int id) {
+    struct ftp_job* job = &e->jobs[id];
+    ftp_session* s = job->s;
+    const ftp_reply* r = &s->reply;
+    int get = job->direction == FTP_ENGINE_GET;
+
+    switch (job->state) {
+    case JOB_BANNER:
+        if (r->code != 220) break;
+        job->state = JOB_USER;
+        return EngineCommand(job, "USER", s->username);
+    case JOB_USER:
+        if (r->code == 230) {
+            job->state = JOB_TYPE;
+            return EngineCommand(job, "TYPE", "I");
+        }
+        if (r->code != 331) break;
+        job->state = JOB_PASS;
+        return EngineCommand(job, "PASS", s->password);
+    case JOB_PASS:
+        if (r->code != 230) break;
+        job->state = JOB_TYPE;
+        return EngineCommand(job, "TYPE", "I");
+    case JOB_TYPE:
+        if (FTPCheckResponse(r)) break;
+        job->state = JOB_PASV;
+        return EngineCommand(job, "PASV", NULL);
+    case JOB_PASV:
+        if (FTPPasvReply(s, r) == -1) return -1;
+        // 数据连接 connect 与 RETR/STOR 同时进行, 150 之后再开始传输
+        job->data_fd = EngineConnect(s->server_ip, s->data_port);
+        if (job->data_fd < 0) return -1;
+        EngineWatch(e, EPOLL_CTL_ADD, job->data_fd, id, 1, 0);
+        job->state = JOB_OPEN;
+        return EngineCommand(job, get ? "RETR" : "STOR", job->remote);
+    case JOB_OPEN:
+        if (r->code != 150 && r->code != 125) break;
+        if (get) {
+            job->file_fd =
+                    open(job->local, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+            if (job->file_fd < 0) {
+                LOGE("open %s error.\n", job->local);
+                return -1;
+            }
+        }
+        job->state = JOB_TRANSFER;
+        EngineWatch(e,
+                    EPOLL_CTL_MOD,
+                    job->data_fd,
+                    id,
+                    1,
+                    get ? EPOLLIN : EPOLLOUT);
+        return 0;
+    case JOB_TRANSFER:
+        if (FTPCheckResponse(r)) break;
+        job->reply_done = 1;
+        EngineTransferDone(e, id);
+        return 0;
+    case JOB_QUIT:
+        EngineFinish(e, id, job->ok);
+        return 0;
+    }
+    printf("<< %s %s failed. %.*s",
+           get ? "GET" : "PUT",
+           job->remote,
+           r->len,
+           r->text);
+    return -1;
+}
+
+/* 控制连接可读/可写 */
+static void EngineControl(ftp_engine* e, int id) {
+    struct ftp_job* job = &e->jobs[id];
+    if (job->state == JOB_CONNECT) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(job->s->ctl_fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err) {
+            errno = err;
+            LOGE("connect %s:%d failed.\n", job->server_ip, job->port);
+            EngineFinish(e, id, 0);
+            return;
+        }
+        job->state = JOB_BANNER;
+        EngineWatch(e, EPOLL_CTL_MOD, job->s->ctl_fd, id, 0, EPOLLIN);
+        return;
+    }
+
+    // 一次可能读到多条响应, 逐条处理
+    while (job->state != JOB_DONE) {
+        int ret = FTPPollReply(job->s);
+        if (ret == 0) return;
+        if (ret == -1) {
+            // QUIT 之后服务器关闭连接是正常的
+            EngineFinish(e, id, job->state == JOB_QUIT && job->ok);
+            return;
+        }
+        if (EngineReply(e, id) == -1) EngineFinish(e, id, 0);
+    }
+}
+
+/* 数据连接可读/可写 */
+static void EngineData(ftp_engine* e, int id, unsigned events) {
+    struct ftp_job* job = &e->jobs[id];
+    if (job->state != JOB_TRANSFER) {
+        // 150 之前数据连接出错
+        if (events & (EPOLLERR | EPOLLHUP)) EngineFinish(e, id, 0);
+        return;
+    }
+
+    ssize_t n;
+    if (job->direction == FTP_ENGINE_GET) {
+        n = read(job->data_fd, e->buf, e->buf_size);
+        if (n > 0) {
+            ssize_t off = 0;
+            while (off < n) {
+                ssize_t nw = write(job->file_fd, e->buf + off, n - off);
+                if (nw <= 0) {
+                    LOGE("write %s error.\n", job->local);
+                    EngineFinish(e, id, 0);
+                    return;
+                }
+                off += nw;
+            }
+            job->bytes += n;
+            return;
+        }
+    } else {
+        long left = job->size - job->offset;
+        n = left > 0 ? sendfile(job->data_fd,
+                                job->file_fd,
+                                &job->offset,
+                                left > e->buf_size ? e->buf_size : left)
+                     : 0;
+        if (n > 0) {
+            job->bytes += n;
+            if (job->offset < job->size) return;
+            n = 0;  // 文件已发送完
+        }
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return;
+    }
+    if (n < 0) {
+        LOGE("%s %s data error.\n",
+             job->direction == FTP_ENGINE_GET ? "GET" : "PUT",
+             job->remote);
+        EngineFinish(e, id, 0);
+        return;
+    }
+    // 数据传输结束, 关闭数据连接 (上传时即通知服务器文件结束)
+    close(job->data_fd);
+    job->data_fd = -1;
+    job->data_done = 1;
+    EngineTransferDone(e, id);
+}
+
+/*
+    创建引擎, 最多同时进行 max_active 个任务 (每个任务一个控制连接)
+    失败返回 NULL
+*/
+ftp_engine* FTPEngineCreate(int max_active) {
+    ftp_engine* e = (ftp_engine*) calloc(1, sizeof(ftp_engine));
+    if (e == NULL) {
+        LOGE("calloc error.\n");
+        return NULL;
+    }
+    e->epfd = epoll_create1(EPOLL_CLOEXEC);
+    e->buf_size = FTP_DATA_BUFF_SIZE;
+    e->buf = (char*) malloc(e->buf_size);
+    if (e->epfd < 0 || e->buf == NULL) {
+        LOGE("epoll_create error.\n");
+        FTPEngineDestroy(e);
+        return NULL;
+    }
+    e->max_active = max_active > 0 ? max_active : FTP_ENGINE_MAX_ACTIVE;
+    return e;
+}
+
+/*
+    添加任务, 服务器地址和登录信息取自已登录的 login
+    返回任务编号, 失败返回 -1; 需在 FTPEngineRun 之前调用
+    done 非空时任务结束后回调
+*/
+int FTPEngineAdd(ftp_engine* e,
+                 const ftp_session* login,
+                 int direction,
+                 const char* remote,
+                 const char* local,
+                 ftp_job_done done,
+                 void* arg) {
+    if (e->njobs == e->cap) {
+        int cap = e->cap ? e->cap * 2 : 16;
+        struct ftp_job* jobs =
+                (struct ftp_job*) realloc(e->jobs, cap * sizeof(*jobs));
+        if (jobs == NULL) {
+            LOGE("realloc error.\n");
+            return -1;
+        }
+        e->jobs = jobs;
+        e->cap = cap;
+    }
+    struct ftp_job* job = &e->jobs[e->njobs];
+    memset(job, 0, sizeof(*job));
+    job->port = login->port;
+    memcpy(job->server_ip, login->server_ip, sizeof(job->server_ip));
+    job->username = strdup(login->username);
+    job->password = strdup(login->password);
+    job->direction = direction;
+    job->remote = strdup(remote);
+    job->local = strdup(local && *local ? local : remote);
+    job->state = JOB_QUEUED;
+    job->file_fd = job->data_fd = -1;
+    job->done = done;
+    job->arg = arg;
+    return e->njobs++;
+}
+
+/*
+    运行所有任务直到结束
+    返回失败的任务数
+*/
+int FTPEngineRun(ftp_engine* e) {
+    struct epoll_event events[ENGINE_EVENTS];
+    EngineStart(e);
+    while (e->nactive > 0) {
+        int n = epoll_wait(e->epfd, events, ENGINE_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            LOGE("epoll_wait error.\n");
+            break;
+        }
+        int i;
+        for (i = 0; i < n; i++) {
+            int id = events[i].data.u64 / 2;
+            if (e->jobs[id].state == JOB_DONE) continue;
+            if (events[i].data.u64 % 2) {
+                EngineData(e, id, events[i].events);
+            } else {
+                EngineControl(e, id);
+            }
+        }
+        EngineStart(e);
+    }
+    return e->nfailed;
+}
+
+/* 关闭未完成的任务并释放引擎 */
+void FTPEngineDestroy(ftp_engine* e) {
+    int i;
+    for (i = 0; i < e->njobs; i++) {
+        struct ftp_job* job = &e->jobs[i];
+        if (job->s) {
+            if (job->s->ctl_fd >= 0) close(job->s->ctl_fd);
+            free(job->s);
+        }
+        if (job->data_fd >= 0) close(job->data_fd);
+        if (job->file_fd >= 0) close(job->file_fd);
+        free(job->remote);
+        free(job->local);
+        free(job->username);
+        free(job->password);
+    }
+    free(e->jobs);
+    free(e->buf);
+    if (e->epfd >= 0) close(e->epfd);
+    free(e);
+}
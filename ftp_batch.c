@@ -0,0 +1,368 @@
+/*
+    批量传输 (mget / mput)
+    通配符只用于最后一级: 本地用 fnmatch 匹配目录项, 远程匹配 MLSD (或 LIST) 列表
+    文件按大小从小到大排列, 多个控制连接依次取下一个文件, 小文件不会排在大文件之后
+    工作连接尽量使用块模式, 数据连接在文件之间保留, 每个文件只需一个 STOR/RETR;
+    服务器不支持时预先打开下一条被动模式数据连接
+    远程大小来自一次目录列表, 传输前不再逐个发送 SIZE
+    目标已存在且大小相同时跳过 (开启校验时由工作连接比较摘要),
+    大小不同时先删除, 避免被当作未完成的文件续传
+*/
+#define _GNU_SOURCE  // stpcpy()
+#include <dirent.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include "ftpclient.h"
+#include "log.h"
+
+/* 一个文件, path 为匹配到的路径, name 指向其中最后一级 */
+typedef struct ftp_batch_file {
+    long size;   // mget 为远程大小, mput 为本地大小
+    int exists;  // 目标已存在 (大小不同)
+    int check;   // 目标大小相同, 开启了校验, 需要比较摘要
+    const char* name;
+    char path[];
+} ftp_batch_file;
+
+typedef struct ftp_batch_list {
+    ftp_batch_file** files;
+    int n, cap;
+} ftp_batch_list;
+
+typedef struct ftp_batch {
+    int put;
+    int verify;  // 大小相同时比较摘要
+    ftp_batch_list files;
+    ftp_batch_list remote;  // mput: 远程当前目录中匹配的文件, 按名字排序
+    atomic_int next;  // 下一个待传输的文件
+    atomic_int transferred;
+    atomic_int skipped;
+    atomic_int failed;
+    atomic_long bytes;
+} ftp_batch;
+
+typedef struct ftp_batch_worker {
+    pthread_t tid;
+    ftp_batch* b;
+    ftp_session* s;
+} ftp_batch_worker;
+
+static void FTPBatchAdd(ftp_batch_list* l,
+                        const char* dir,
+                        const char* name,
+                        long size) {
+    if (l->n == l->cap) {
+        int cap = l->cap ? l->cap * 2 : 64;
+        ftp_batch_file** files = (ftp_batch_file**) realloc(
+                l->files, cap * sizeof(ftp_batch_file*));
+        if (files == NULL) {
+            LOGE("realloc error.\n");
+            return;
+        }
+        l->files = files;
+        l->cap = cap;
+    }
+    ftp_batch_file* f = (ftp_batch_file*) malloc(sizeof(ftp_batch_file) +
+                                                 strlen(dir) + strlen(name) +
+                                                 2);
+    if (f == NULL) {
+        LOGE("malloc error.\n");
+        return;
+    }
+    f->size = size;
+    f->exists = 0;
+    f->check = 0;
+    char* p = f->path;
+    if (dir[0]) {
+        p = stpcpy(p, dir);
+        if (p[-1] != '/') *p++ = '/';
+    }
+    f->name = p;
+    strcpy(p, name);
+    l->files[l->n++] = f;
+}
+
+static void FTPBatchFree(ftp_batch_list* l) {
+    while (l->n > 0) free(l->files[--l->n]);
+    free(l->files);
+    l->files = NULL;
+}
+
+static int FTPBatchCmp(const void* a, const void* b) {
+    const ftp_batch_file* fa = *(const ftp_batch_file* const*) a;
+    const ftp_batch_file* fb = *(const ftp_batch_file* const*) b;
+    return fa->size < fb->size ? -1 : fa->size > fb->size;
+}
+
+static int FTPBatchNameCmp(const void* a, const void* b) {
+    const ftp_batch_file* fa = *(const ftp_batch_file* const*) a;
+    const ftp_batch_file* fb = *(const ftp_batch_file* const*) b;
+    return strcmp(fa->name, fb->name);
+}
+
+/* 远程列表中匹配的普通文件 */
+typedef struct ftp_batch_match {
+    ftp_batch_list* l;
+    const char* dir;
+    const char* pattern;
+} ftp_batch_match;
+
+static void FTPBatchRemoteEntries(const ftp_entry* entries, int n, void* arg) {
+    ftp_batch_match* match = (ftp_batch_match*) arg;
+    int i;
+    for (i = 0; i < n; i++) {
+        if (entries[i].type == FTP_ENTRY_FILE &&
+            fnmatch(match->pattern, entries[i].name, 0) == 0) {
+            FTPBatchAdd(match->l, match->dir, entries[i].name, entries[i].size);
+        }
+    }
+}
+
+/* 本地目录中匹配的普通文件 */
+static int FTPBatchLocal(ftp_batch_list* l,
+                         const char* dir,
+                         const char* pattern) {
+    DIR* d = opendir(dir[0] ? dir : ".");
+    if (d == NULL) {
+        printf("%s No such file or directory.\n", dir);
+        return -1;
+    }
+    struct dirent* ent;
+    while ((ent = readdir(d)) != NULL) {
+        if (fnmatch(pattern, ent->d_name, FNM_PERIOD) != 0) continue;
+        char path[PATH_MAX];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", dir[0] ? dir : ".", ent->d_name);
+        if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+            FTPBatchAdd(l, dir, ent->d_name, st.st_size);
+        }
+    }
+    closedir(d);
+    return 0;
+}
+
+/*
+    目标为当前目录中的同名文件, 已存在且大小相同时不需要传输
+    开启校验时大小相同仍交给工作连接, 比较摘要后决定
+    mput 的远程大小取自传输前的列表, 不在列表中即不存在
+*/
+static int FTPBatchSkip(const ftp_batch* b, ftp_batch_file* f) {
+    long size = -1;
+    if (b->put) {
+        ftp_batch_file** found = (ftp_batch_file**) bsearch(&f,
+                                                            b->remote.files,
+                                                            b->remote.n,
+                                                            sizeof(f),
+                                                            FTPBatchNameCmp);
+        if (found) size = (*found)->size;
+    } else {
+        struct stat st;
+        if (stat(f->name, &st) == 0) size = st.st_size;
+    }
+    if (size == f->size && !b->verify) return 1;
+    f->check = size == f->size;
+    f->exists = size != -1 && !f->check;
+    return 0;
+}
+
+static void FTPBatchFile(ftp_batch_worker* w, const ftp_batch_file* f) {
+    ftp_batch* b = w->b;
+    ftp_session* s = w->s;
+    int ret;
+    int exists = f->exists;
+    if (f->check) {
+        const char* local = b->put ? f->path : f->name;
+        const char* remote = b->put ? f->name : f->path;
+        if (!FTPVerifyDiffers(s, local, remote)) {
+            atomic_fetch_add(&b->skipped, 1);
+            return;
+        }
+        printf("%s differs from the server, transferring again.\n", local);
+        exists = 1;
+    }
+    if (b->put) {
+        if (exists) FTPDele(s, f->name);
+        ret = FTPPut(s, f->path, f->name);
+    } else {
+        if (exists) unlink(f->name);
+        ret = FTPGet(s, f->path, f->name);
+    }
+    if (ret == -1) {
+        atomic_fetch_add(&b->failed, 1);
+        return;
+    }
+    atomic_fetch_add(&b->transferred, 1);
+    atomic_fetch_add(&b->bytes, s->stats.bytes);
+}
+
+/*
+    工作连接改为块模式, 服务器不支持时改为预先打开数据连接
+    直接发送 MODE B, 不支持时不为每个连接打印失败信息
+*/
+static void FTPBatchMode(ftp_session* s) {
+    if (s->block_mode || s->deflate) return;
+    sprintf(s->send_buf, "MODE B\r\n");
+    FTPCommand(s);
+    if (FTPCheckResponse(&s->reply) == 0) {
+        s->block_mode = 1;
+    } else {
+        FTPSetPrefetch(s, 1);
+    }
+}
+
+static void* FTPBatchWorker(void* arg) {
+    ftp_batch_worker* w = (ftp_batch_worker*) arg;
+    ftp_batch* b = w->b;
+    FTPBatchMode(w->s);
+    int i;
+    while ((i = atomic_fetch_add(&b->next, 1)) < b->files.n) {
+        FTPBatchFile(w, b->files.files[i]);
+    }
+    return NULL;
+}
+
+/*
+    pattern 拆分为目录和最后一级, 匹配的文件加入 b
+    通配符只能出现在最后一级, mput 同时列出远程当前目录
+*/
+static int FTPBatchMatch(ftp_session* s, ftp_batch* b, const char* pattern) {
+    char dir[BUFF_SIZE];
+    const char* base = strrchr(pattern, '/');
+    if (base) {
+        int len = base == pattern ? 1 : base - pattern;
+        if (len >= (int) sizeof(dir)) return -1;
+        memcpy(dir, pattern, len);
+        dir[len] = '\0';
+        base++;
+    } else {
+        dir[0] = '\0';
+        base = pattern;
+    }
+    if (strpbrk(dir, "*?[")) {
+        printf("<< %s %s failed. Wildcards only in the last component.\n",
+               b->put ? "MPUT" : "MGET",
+               pattern);
+        return -1;
+    }
+    if (!b->put) {
+        ftp_batch_match match = {&b->files, dir, base};
+        return FTPListEntries(s, dir, FTPBatchRemoteEntries, &match);
+    }
+    if (FTPBatchLocal(&b->files, dir, base) == -1) return -1;
+    if (b->files.n == 0) return 0;
+    ftp_batch_match match = {&b->remote, "", base};
+    int ret = FTPListEntries(s, "", FTPBatchRemoteEntries, &match);
+    qsort(b->remote.files,
+          b->remote.n,
+          sizeof(ftp_batch_file*),
+          FTPBatchNameCmp);
+    return ret;
+}
+
+static int FTPBatchRun(ftp_session* s, const char* pattern, int put) {
+    ftp_batch b;
+    memset(&b, 0, sizeof(b));
+    b.put = put;
+    b.verify = s->verify;
+    int ret = FTPBatchMatch(s, &b, pattern);
+    if (ret == 0 && b.files.n == 0) {
+        printf("<< %s %s failed. No match.\n", put ? "MPUT" : "MGET", pattern);
+        ret = -1;
+    }
+    char cwd[BUFF_SIZE];
+    if (ret == 0) ret = FTPGetCwd(s, cwd, sizeof(cwd));
+    if (ret == -1) {
+        FTPBatchFree(&b.files);
+        FTPBatchFree(&b.remote);
+        return -1;
+    }
+    qsort(b.files.files, b.files.n, sizeof(ftp_batch_file*), FTPBatchCmp);
+    // 不需要传输的文件不交给工作连接, 其余保持大小顺序
+    int nfiles = b.files.n;
+    int i, npending = 0;
+    for (i = 0; i < nfiles; i++) {
+        ftp_batch_file* f = b.files.files[i];
+        if (FTPBatchSkip(&b, f)) {
+            free(f);
+            b.skipped++;
+        } else {
+            b.files.files[npending++] = f;
+        }
+    }
+    b.files.n = npending;
+    FTPBatchFree(&b.remote);
+
+    int nworkers = s->pool ? FTPPoolSize(s->pool) : FTP_BATCH_SESSIONS;
+    if (nworkers > b.files.n) nworkers = b.files.n;
+    ftp_batch_worker workers[FTP_POOL_MAX];
+    ftp_rate local_rate;
+    ftp_rate* rate = FTPSessionRate(s, &local_rate);
+    int nstarted = 0;
+    for (i = 0; i < nworkers; i++) {
+        workers[i].b = &b;
+        workers[i].s = FTPWorkerLogin(s, cwd, rate);
+        if (workers[i].s == NULL) continue;
+        if (pthread_create(
+                    &workers[i].tid, NULL, FTPBatchWorker, &workers[i])) {
+            LOGE("pthread_create error.\n");
+            FTPWorkerLogout(s, workers[i].s);
+            workers[i].s = NULL;
+            continue;
+        }
+        nstarted++;
+    }
+    for (i = 0; i < nworkers; i++) {
+        if (workers[i].s == NULL) continue;
+        pthread_join(workers[i].tid, NULL);
+        FTPWorkerLogout(s, workers[i].s);
+    }
+    FTPBatchFree(&b.files);
+    if (nstarted == 0 && nworkers > 0) {
+        printf("<< %s %s failed. No session.\n", put ? "MPUT" : "MGET", pattern);
+        return -1;
+    }
+
+    s->stats.bytes = atomic_load(&b.bytes);
+    int failed = atomic_load(&b.failed);
+    printf("<< %s %s ok. %d files: %d transferred (%ld bytes), %d skipped, "
+           "%d failed, %d sessions.\n",
+           put ? "MPUT" : "MGET",
+           pattern,
+           nfiles,
+           atomic_load(&b.transferred),
+           s->stats.bytes,
+           atomic_load(&b.skipped),
+           failed,
+           nstarted);
+    return failed ? -1 : 0;
+}
+
+/*
+    下载远程 pattern (如 "*.log", "logs/2024*.gz") 匹配的文件到本地当前目录
+    本地已有同样大小的文件时跳过, 开启校验时摘要也需相同
+*/
+int FTPMget(ftp_session* s, const char* pattern) {
+    FTPStatsBegin(s, "MGET", pattern, 0);
+    int ret = FTPBatchRun(s, pattern, 0);
+    FTPStatsEnd(s, ret, s->reply.code);
+    return ret;
+}
+
+/*
+    上传本地 pattern 匹配的文件到远程当前目录
+    远程已有同样大小的文件时跳过, 开启校验时摘要也需相同
+*/
+int FTPMput(ftp_session* s, const char* pattern) {
+    FTPStatsBegin(s, "MPUT", pattern, 0);
+    int ret = FTPBatchRun(s, pattern, 1);
+    FTPStatsEnd(s, ret, s->reply.code);
+    return ret;
+}
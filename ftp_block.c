@@ -0,0 +1,153 @@
+/*
+    块模式 (MODE B, RFC 959 3.4.2)
+    每块为 3 字节头 (描述符, 16 位大端字节数) 和数据, 文件以带 EOF 标志的块结束
+    文件结束不需要关闭数据连接, 服务器以 250 响应时连接保留给下一次传输
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <sys/uio.h>
+
+#include "ftpclient.h"
+#include "log.h"
+
+#define FTP_BLOCK_EOR 0x80      // 记录结束
+#define FTP_BLOCK_EOF 0x40      // 文件结束
+#define FTP_BLOCK_RESTART 0x10  // 数据为重启标记, 不是文件内容
+#define FTP_BLOCK_MAX 65535
+
+/* 写完 iov 中的全部数据, 失败返回 -1 */
+static int FTPWritevAll(int fd, struct iovec* iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (n < 0) return -1;
+        while (iovcnt > 0 && (size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char*) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/*
+    src_fd (文件) 按块发送到 data_fd, 最后发送一个空的 EOF 块
+    返回文件字节数, 数据连接出错返回 -1, 此时连接不能再用于下一次传输
+*/
+long FTPBlockSend(ftp_session* s, int data_fd, int src_fd) {
+    int chunk = s->data_buf_size < FTP_BLOCK_MAX ? s->data_buf_size
+                                                  : FTP_BLOCK_MAX;
+    char* trans_buf = (char*) malloc(chunk);
+    if (trans_buf == NULL) {
+        LOGE("malloc error.\n");
+        return -1;
+    }
+    ftp_rate local_rate;
+    ftp_rate* rate = FTPSessionRate(s, &local_rate);
+    ftp_stats* st = &s->stats;
+    long total_trans_bytes = 0;
+    unsigned char header[3];
+    struct iovec iov[2];
+    ssize_t nread;
+    double t = FTPNow();
+    while ((nread = read(src_fd, trans_buf, FTPRateChunk(rate, chunk))) > 0) {
+        t = FTPStatsIo(st, 0, t);
+        FTPHashUpdate(&s->hash, trans_buf, nread);
+        header[0] = 0;
+        header[1] = nread >> 8;
+        header[2] = nread & 0xff;
+        iov[0].iov_base = header;
+        iov[0].iov_len = 3;
+        iov[1].iov_base = trans_buf;
+        iov[1].iov_len = nread;
+        if (FTPWritevAll(data_fd, iov, 2) < 0) {
+            LOGE("block write error.\n");
+            free(trans_buf);
+            return -1;
+        }
+        FTPStatsIo(st, 1, t);
+        total_trans_bytes += nread;
+        st->rate_wait += FTPRateConsume(rate, nread);
+        t = FTPNow();
+    }
+    FTPStatsIo(st, 0, t);
+    free(trans_buf);
+
+    header[0] = FTP_BLOCK_EOF;
+    header[1] = header[2] = 0;
+    iov[0].iov_base = header;
+    iov[0].iov_len = 3;
+    if (nread < 0 || FTPWritevAll(data_fd, iov, 1) < 0) {
+        LOGE("block send error.\n");
+        return -1;
+    }
+    return total_trans_bytes;
+}
+
+/*
+    从 data_fd 接收块直到 EOF 块, 数据写入 dest_fd
+    块头可能跨越两次 read, 一次 read 也可能包含多个块
+    返回文件字节数, EOF 之前连接关闭返回 -1
+*/
+long FTPBlockRecv(ftp_session* s, int dest_fd, int data_fd) {
+    char* trans_buf = (char*) malloc(s->data_buf_size);
+    if (trans_buf == NULL) {
+        LOGE("malloc error.\n");
+        return -1;
+    }
+    ftp_rate local_rate;
+    ftp_rate* rate = FTPSessionRate(s, &local_rate);
+    ftp_stats* st = &s->stats;
+    int dest_net = FTPStatsIsNet(dest_fd);
+    long total_trans_bytes = 0;
+    unsigned char header[3];
+    int header_len = 0;  // 已收到的块头字节数
+    long remain = 0;     // 当前块未收到的数据
+    int desc = 0;
+    int done = 0;
+    double t = FTPNow();
+    while (!done) {
+        ssize_t nread = read(data_fd,
+                             trans_buf,
+                             FTPRateChunk(rate, s->data_buf_size));
+        t = FTPStatsIo(st, 1, t);
+        if (nread <= 0) {
+            LOGE("block connection closed before EOF.\n");
+            break;
+        }
+        char* p = trans_buf;
+        char* end = trans_buf + nread;
+        while (p < end && !done) {
+            if (remain == 0) {
+                header[header_len++] = *p++;
+                if (header_len < 3) continue;
+                header_len = 0;
+                desc = header[0];
+                remain = header[1] << 8 | header[2];
+                done = remain == 0 && (desc & FTP_BLOCK_EOF);
+                continue;
+            }
+            long len = end - p < remain ? end - p : remain;
+            if (!(desc & FTP_BLOCK_RESTART)) {
+                FTPHashUpdate(&s->hash, p, len);
+                if (write(dest_fd, p, len) < 0) {
+                    LOGE("write error.\n");
+                }
+                total_trans_bytes += len;
+            }
+            p += len;
+            remain -= len;
+            done = remain == 0 && (desc & FTP_BLOCK_EOF);
+        }
+        t = FTPStatsIo(st, dest_net, t);
+        st->rate_wait += FTPRateConsume(rate, nread);
+        t = FTPNow();
+    }
+    free(trans_buf);
+    return done ? total_trans_bytes : -1;
+}
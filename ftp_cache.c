@@ -0,0 +1,318 @@
+/*
+    远程元数据缓存
+    以规范化的绝对路径为键, 记录类型, 大小等, 超过有效期 (ttl) 的项不使用
+    每次写入分配递增的序号 gen, 目录记录 reset: 序号小于 reset 的子项已失效,
+    listed 为 1 时 (完整列出过或刚创建) 失效或不在缓存中的子项即为不存在
+    查找时从根目录逐级向下检查, 不存在或不是目录的祖先使整个子树不存在,
+    删除, 重命名目录和重新列出目录只修改一项, 不需要遍历子树
+*/
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ftpclient.h"
+#include "log.h"
+
+typedef struct ftp_cache_node {
+    struct ftp_cache_node* next;
+    unsigned hash;
+    double expires;
+    long gen;
+    long reset;   // 序号小于 reset 的子项失效
+    int listed;   // 失效或不在缓存中的子项不存在
+    int exists;   // 1 存在, 0 不存在, -1 未知 (阻止由父目录推断)
+    ftp_entry e;  // e.name 不使用
+    int len;
+    char path[];
+} ftp_cache_node;
+
+struct ftp_cache {
+    pthread_mutex_t lock;
+    double ttl;
+    long gen;
+    long cleared;  // 最近一次全部清空时的序号
+    int count;
+    ftp_cache_node* buckets[FTP_CACHE_BUCKETS];
+};
+
+static unsigned FTPCacheHash(const char* path, int len) {
+    unsigned h = 2166136261u;  // FNV-1a
+    int i;
+    for (i = 0; i < len; i++) h = (h ^ (unsigned char) path[i]) * 16777619u;
+    return h;
+}
+
+static void FTPCacheClear(ftp_cache* c) {
+    int i;
+    for (i = 0; i < FTP_CACHE_BUCKETS; i++) {
+        while (c->buckets[i]) {
+            ftp_cache_node* n = c->buckets[i];
+            c->buckets[i] = n->next;
+            free(n);
+        }
+    }
+    c->count = 0;
+    c->cleared = c->gen;
+}
+
+/* 未过期的项, 过期项顺便删除 */
+static ftp_cache_node* FTPCacheFind(ftp_cache* c,
+                                    const char* path,
+                                    int len,
+                                    double now) {
+    unsigned h = FTPCacheHash(path, len);
+    ftp_cache_node** pn = &c->buckets[h % FTP_CACHE_BUCKETS];
+    while (*pn) {
+        ftp_cache_node* n = *pn;
+        if (n->expires <= now) {
+            *pn = n->next;
+            free(n);
+            c->count--;
+            continue;
+        }
+        if (n->hash == h && n->len == len && memcmp(n->path, path, len) == 0) {
+            return n;
+        }
+        pn = &n->next;
+    }
+    return NULL;
+}
+
+/* 删除过期项, 仍然太多时全部清空 */
+static void FTPCachePurge(ftp_cache* c, double now) {
+    int i;
+    for (i = 0; i < FTP_CACHE_BUCKETS; i++) {
+        ftp_cache_node** pn = &c->buckets[i];
+        while (*pn) {
+            ftp_cache_node* n = *pn;
+            if (n->expires <= now) {
+                *pn = n->next;
+                free(n);
+                c->count--;
+            } else {
+                pn = &n->next;
+            }
+        }
+    }
+    if (c->count >= FTP_CACHE_MAX) FTPCacheClear(c);
+}
+
+/* 查找或新建一项, 分配新的序号 */
+static ftp_cache_node* FTPCacheNode(ftp_cache* c, const char* path, double now) {
+    int len = strlen(path);
+    ftp_cache_node* n = FTPCacheFind(c, path, len, now);
+    if (n == NULL) {
+        if (c->count >= FTP_CACHE_MAX) FTPCachePurge(c, now);
+        n = (ftp_cache_node*) malloc(sizeof(ftp_cache_node) + len + 1);
+        if (n == NULL) {
+            LOGE("malloc error.\n");
+            return NULL;
+        }
+        memset(n, 0, sizeof(*n));
+        n->hash = FTPCacheHash(path, len);
+        n->len = len;
+        memcpy(n->path, path, len + 1);
+        n->next = c->buckets[n->hash % FTP_CACHE_BUCKETS];
+        c->buckets[n->hash % FTP_CACHE_BUCKETS] = n;
+        c->count++;
+    }
+    n->gen = ++c->gen;
+    n->expires = now + c->ttl;
+    return n;
+}
+
+/*
+    设置缓存有效期 (秒), ttl <= 0 时关闭并释放缓存
+    由创建缓存的会话调用, 共享缓存的分段和 mirror 连接不调用
+*/
+void FTPSetCache(ftp_session* s, double ttl) {
+    if (ttl <= 0) {
+        if (s->cache) {
+            FTPCacheClear(s->cache);
+            pthread_mutex_destroy(&s->cache->lock);
+            free(s->cache);
+            s->cache = NULL;
+        }
+        return;
+    }
+    if (s->cache == NULL) {
+        s->cache = (ftp_cache*) calloc(1, sizeof(ftp_cache));
+        if (s->cache == NULL) {
+            LOGE("calloc error.\n");
+            return;
+        }
+        pthread_mutex_init(&s->cache->lock, NULL);
+    }
+    s->cache->ttl = ttl;
+}
+
+/*
+    path 转换为规范化的绝对路径: 处理 "." 和 "..", 去掉重复和末尾的 '/'
+    相对路径需要当前目录 (由登录和 CWD 记录), 未知时返回 -1, 不发送命令
+*/
+int FTPCachePath(ftp_session* s, const char* path, char* out, int size) {
+    if (path[0] != '/' && s->cwd[0] == '\0') return -1;
+    int len = 0;
+    int pass;
+    // 第一遍为当前目录, 第二遍为 path
+    for (pass = path[0] == '/'; pass < 2; pass++) {
+        const char* p = pass ? path : s->cwd;
+        while (*p) {
+            while (*p == '/') p++;
+            int n = strcspn(p, "/");
+            if (n == 0 || (n == 1 && p[0] == '.')) {
+                // 空或 "."
+            } else if (n == 2 && p[0] == '.' && p[1] == '.') {
+                while (len > 0 && out[--len] != '/') continue;
+            } else {
+                if (len + 1 + n >= size) return -1;
+                out[len] = '/';
+                memcpy(out + len + 1, p, n);
+                len += 1 + n;
+            }
+            p += n;
+        }
+    }
+    if (len == 0) out[len++] = '/';
+    out[len] = '\0';
+    return 0;
+}
+
+/*
+    查找 path (已规范化), 返回 1 存在 (写入 e), 0 不存在, -1 未知
+    从根目录逐级检查每个前缀
+*/
+static int FTPCacheFindPath(ftp_cache* c, const char* path, ftp_entry* e) {
+    double now = FTPNow();
+    const ftp_cache_node* parent = NULL;  // 上一级的有效项
+    int len = 0;
+    int end = strlen(path);
+    while (1) {
+        // 前缀 [0, len), 根目录为 "/"
+        int plen = len ? len : 1;
+        ftp_cache_node* n = FTPCacheFind(c, path, plen, now);
+        if (n && parent && n->gen < parent->reset) n = NULL;
+        if (n == NULL || n->exists == -1) {
+            if (n == NULL && parent && parent->listed) return 0;
+            if (len == end || (len == 0 && end == 1)) return -1;
+            parent = n;
+        } else if (len == end || (len == 0 && end == 1)) {
+            if (n->exists && e) *e = n->e;
+            return n->exists;
+        } else if (!n->exists || n->e.type != FTP_ENTRY_DIR) {
+            return 0;
+        } else {
+            parent = n;
+        }
+        len += 1 + strcspn(path + len + 1, "/");
+    }
+}
+
+/* path 的缓存, 返回 1 存在 (写入 e), 0 不存在, -1 未知或未启用缓存 */
+int FTPCacheLookup(ftp_session* s, const char* path, ftp_entry* e) {
+    char abs[BUFF_SIZE];
+    if (s->cache == NULL || FTPCachePath(s, path, abs, sizeof(abs)) == -1) {
+        return -1;
+    }
+    pthread_mutex_lock(&s->cache->lock);
+    int ret = FTPCacheFindPath(s->cache, abs, e);
+    pthread_mutex_unlock(&s->cache->lock);
+    if (ret == 1 && e) e->name = NULL;
+    return ret;
+}
+
+/*
+    修改过的 path 无法解析 (当前目录未知) 时不知道哪一项失效, 全部清空
+    返回 0 表示 abs 可用
+*/
+static int FTPCacheResolve(ftp_session* s, const char* path, char* abs) {
+    if (s->cache == NULL) return -1;
+    if (FTPCachePath(s, path, abs, BUFF_SIZE) == -1) {
+        pthread_mutex_lock(&s->cache->lock);
+        FTPCacheClear(s->cache);
+        pthread_mutex_unlock(&s->cache->lock);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+    记录 path 的信息, e 为 NULL 表示不存在 (删除成功)
+    目录再次写入为目录时保留 reset 和 listed
+*/
+void FTPCacheStore(ftp_session* s, const char* path, const ftp_entry* e) {
+    char abs[BUFF_SIZE];
+    if (FTPCacheResolve(s, path, abs) == -1) return;
+    pthread_mutex_lock(&s->cache->lock);
+    ftp_cache_node* n = FTPCacheNode(s->cache, abs, FTPNow());
+    if (n) {
+        int same_dir = n->exists == 1 && n->e.type == FTP_ENTRY_DIR && e &&
+                       e->type == FTP_ENTRY_DIR;
+        if (!same_dir) {
+            // 子树中已缓存的项不再有效
+            n->reset = n->gen;
+            n->listed = 0;
+        }
+        n->exists = e != NULL;
+        if (e) n->e = *e;
+    }
+    pthread_mutex_unlock(&s->cache->lock);
+}
+
+/* path 变为未知, 如 ASCII 模式上传后大小不确定 */
+void FTPCacheForget(ftp_session* s, const char* path) {
+    char abs[BUFF_SIZE];
+    if (FTPCacheResolve(s, path, abs) == -1) return;
+    pthread_mutex_lock(&s->cache->lock);
+    ftp_cache_node* n = FTPCacheNode(s->cache, abs, FTPNow());
+    if (n) {
+        n->exists = -1;
+        n->reset = n->gen;
+        n->listed = 0;
+    }
+    pthread_mutex_unlock(&s->cache->lock);
+}
+
+/* 重命名成功: from 不存在, to 为 from 原来的信息, 子树未知 */
+void FTPCacheRename(ftp_session* s, const char* from, const char* to) {
+    ftp_entry e;
+    int known = FTPCacheLookup(s, from, &e) == 1;
+    FTPCacheStore(s, from, NULL);
+    FTPCacheForget(s, to);  // to 原有的子树失效
+    if (known) FTPCacheStore(s, to, &e);
+}
+
+/* 列出目录前取得序号, 列表中的项都在此之后写入 */
+long FTPCacheMark(ftp_session* s) {
+    if (s->cache == NULL) return 0;
+    pthread_mutex_lock(&s->cache->lock);
+    long mark = ++s->cache->gen;
+    pthread_mutex_unlock(&s->cache->lock);
+    return mark;
+}
+
+/*
+    目录 dir 已完整列出 (或刚刚创建), 序号小于 mark 的子项不存在
+    有效期从 start (列表开始时刻) 算起, 不晚于列表中任何一项过期
+*/
+void FTPCacheListed(ftp_session* s, const char* dir, long mark, double start) {
+    char abs[BUFF_SIZE];
+    if (s->cache == NULL || FTPCachePath(s, dir, abs, sizeof(abs)) == -1) {
+        return;
+    }
+    pthread_mutex_lock(&s->cache->lock);
+    ftp_cache_node* n;
+    // 列表期间缓存被清空, 子项不完整
+    if (s->cache->cleared < mark &&
+        (n = FTPCacheNode(s->cache, abs, FTPNow())) != NULL) {
+        n->exists = 1;
+        n->e.type = FTP_ENTRY_DIR;
+        n->e.size = -1;
+        n->e.modify = -1;
+        n->reset = mark;
+        n->listed = 1;
+        n->expires = start + s->cache->ttl;
+    }
+    pthread_mutex_unlock(&s->cache->lock);
+}
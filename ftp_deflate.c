@@ -0,0 +1,152 @@
+/*
+    压缩模式 (MODE Z)
+    数据连接上为一个 zlib 格式的 deflate 流, 与流模式一样以关闭连接结束
+    REST 偏移为未压缩文件中的偏移, 断点续传时从本地文件当前位置开始压缩, 或把解压结果追加到当前位置
+    限速和网络时间按数据连接上压缩后的字节计算
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include "ftpclient.h"
+#include "log.h"
+
+/* 按限速写完 len 字节压缩数据, 失败返回 -1 */
+static int FTPDeflateWrite(ftp_session* s,
+                           ftp_rate* rate,
+                           int data_fd,
+                           const unsigned char* buf,
+                           long len) {
+    ftp_stats* st = &s->stats;
+    while (len > 0) {
+        double t = FTPNow();
+        ssize_t n = write(data_fd, buf, FTPRateChunk(rate, len));
+        FTPStatsIo(st, 1, t);
+        if (n < 0) return -1;
+        buf += n;
+        len -= n;
+        st->wire_bytes += n;
+        st->rate_wait += FTPRateConsume(rate, n);
+    }
+    return 0;
+}
+
+/*
+    从 src_fd (文件) 当前位置读取, 以 s->deflate_level 压缩后发送到 data_fd
+    返回读取的未压缩字节数, 出错返回 -1
+*/
+long FTPDeflateSend(ftp_session* s, int data_fd, int src_fd) {
+    int size = s->data_buf_size;
+    unsigned char* in = (unsigned char*) malloc(size);
+    unsigned char* out = (unsigned char*) malloc(size);
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (in == NULL || out == NULL ||
+        deflateInit(&zs, s->deflate_level) != Z_OK) {
+        LOGE("deflate init error.\n");
+        free(in);
+        free(out);
+        return -1;
+    }
+    ftp_rate local_rate;
+    ftp_rate* rate = FTPSessionRate(s, &local_rate);
+    ftp_stats* st = &s->stats;
+    long total_trans_bytes = 0;
+    int flush = Z_NO_FLUSH;
+    int err = 0;
+    while (!err && flush != Z_FINISH) {
+        double t = FTPNow();
+        ssize_t nread = read(src_fd, in, size);
+        FTPStatsIo(st, 0, t);
+        if (nread < 0) {
+            LOGE("read error.\n");
+            err = 1;
+            break;
+        }
+        if (nread == 0) flush = Z_FINISH;
+        FTPHashUpdate(&s->hash, in, nread);
+        total_trans_bytes += nread;
+        zs.next_in = in;
+        zs.avail_in = nread;
+        // 输出缓冲区写满说明还有压缩数据
+        do {
+            zs.next_out = out;
+            zs.avail_out = size;
+            deflate(&zs, flush);
+            long have = size - zs.avail_out;
+            if (FTPDeflateWrite(s, rate, data_fd, out, have) == -1) {
+                LOGE("write error.\n");
+                err = 1;
+                break;
+            }
+        } while (zs.avail_out == 0);
+    }
+    deflateEnd(&zs);
+    free(in);
+    free(out);
+    return err ? -1 : total_trans_bytes;
+}
+
+/*
+    从 data_fd 接收 deflate 流, 解压后写入 dest_fd
+    返回解压后的字节数, 流不完整或格式错误返回 -1
+*/
+long FTPInflateRecv(ftp_session* s, int dest_fd, int data_fd) {
+    int size = s->data_buf_size;
+    unsigned char* in = (unsigned char*) malloc(size);
+    unsigned char* out = (unsigned char*) malloc(size);
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (in == NULL || out == NULL || inflateInit(&zs) != Z_OK) {
+        LOGE("inflate init error.\n");
+        free(in);
+        free(out);
+        return -1;
+    }
+    ftp_rate local_rate;
+    ftp_rate* rate = FTPSessionRate(s, &local_rate);
+    ftp_stats* st = &s->stats;
+    int dest_net = FTPStatsIsNet(dest_fd);
+    long total_trans_bytes = 0;
+    int ret = Z_OK;
+    ssize_t nread;
+    double t = FTPNow();
+    while (ret != Z_STREAM_END &&
+           (nread = read(data_fd, in, FTPRateChunk(rate, size))) > 0) {
+        t = FTPStatsIo(st, 1, t);
+        st->wire_bytes += nread;
+        zs.next_in = in;
+        zs.avail_in = nread;
+        do {
+            zs.next_out = out;
+            zs.avail_out = size;
+            ret = inflate(&zs, Z_NO_FLUSH);
+            if (ret == Z_NEED_DICT || ret == Z_DATA_ERROR ||
+                ret == Z_MEM_ERROR) {
+                LOGW("inflate error: %s.\n", zs.msg ? zs.msg : "");
+                break;
+            }
+            long have = size - zs.avail_out;
+            FTPHashUpdate(&s->hash, out, have);
+            if (have > 0 && write(dest_fd, out, have) < 0) {
+                LOGE("write error.\n");
+            }
+            total_trans_bytes += have;
+        } while (zs.avail_out == 0 && ret != Z_STREAM_END);
+        if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) break;
+        t = FTPStatsIo(st, dest_net, t);
+        st->rate_wait += FTPRateConsume(rate, nread);
+        t = FTPNow();
+    }
+    inflateEnd(&zs);
+    free(in);
+    free(out);
+    if (ret != Z_STREAM_END) {
+        LOGW("deflate stream incomplete.\n");
+        return -1;
+    }
+    return total_trans_bytes;
+}
@@ -0,0 +1,252 @@
+/*
+    传输校验用的流式摘要
+    CRC32 与 XCRC 和 HASH CRC32 相同 (zlib 多项式), SHA-256 与 HASH SHA-256 相同
+    数据在传输循环中读入缓冲区后即计算, 不需要再读一遍文件
+    CPU 支持 SHA 扩展指令 (SHA-NI) 时 SHA-256 使用硬件指令, 否则为软件实现
+    只依赖 zlib, bench/ftpd 也用它响应 HASH/XCRC
+*/
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FTP_HASH_X86 1
+#endif
+
+#include "ftpclient.h"
+
+static const uint32_t FTPSha256K[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+        0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+        0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+        0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+        0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+        0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+        0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+        0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+        0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+/* 软件实现, 处理 nblocks 个 64 字节块 */
+static void FTPSha256Soft(uint32_t state[8],
+                          const unsigned char* data,
+                          size_t nblocks) {
+    uint32_t w[64];
+    while (nblocks--) {
+        int i;
+        for (i = 0; i < 16; i++) {
+            const unsigned char* p = data + i * 4;
+            w[i] = (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 |
+                   (uint32_t) p[2] << 8 | p[3];
+        }
+        for (i = 16; i < 64; i++) {
+            uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^
+                          (w[i - 15] >> 3);
+            uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^
+                          (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (i = 0; i < 64; i++) {
+            uint32_t t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) +
+                          ((e & f) ^ (~e & g)) + FTPSha256K[i] + w[i];
+            uint32_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) +
+                          ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+        data += 64;
+    }
+}
+
+#ifdef FTP_HASH_X86
+/*
+    SHA-NI 实现, 每条 sha256rnds2 完成两轮
+    状态按指令要求重排为 ABEF/CDGH 两个寄存器
+    消息调度: W[j] = msg2(msg1(W[j-4], W[j-3]) + W[j-2..j-1] 拼接, W[j-1])
+*/
+__attribute__((target("sha,sse4.1"))) static void FTPSha256Ni(
+        uint32_t state[8],
+        const unsigned char* data,
+        size_t nblocks) {
+    const __m128i mask =
+            _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i tmp = _mm_loadu_si128((const __m128i*) &state[0]);
+    __m128i state1 = _mm_loadu_si128((const __m128i*) &state[4]);
+    tmp = _mm_shuffle_epi32(tmp, 0xb1);                // CDAB
+    state1 = _mm_shuffle_epi32(state1, 0x1b);          // EFGH
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);  // ABEF
+    state1 = _mm_blend_epi16(state1, tmp, 0xf0);       // CDGH
+
+    while (nblocks--) {
+        __m128i abef = state0;
+        __m128i cdgh = state1;
+        __m128i w[4];
+        int j;
+#pragma GCC unroll 16
+        for (j = 0; j < 16; j++) {
+            __m128i m;
+            if (j < 4) {
+                m = _mm_loadu_si128((const __m128i*) (data + j * 16));
+                m = _mm_shuffle_epi8(m, mask);
+            } else {
+                m = _mm_sha256msg1_epu32(w[j & 3], w[(j - 3) & 3]);
+                m = _mm_add_epi32(
+                        m, _mm_alignr_epi8(w[(j - 1) & 3], w[(j - 2) & 3], 4));
+                m = _mm_sha256msg2_epu32(m, w[(j - 1) & 3]);
+            }
+            w[j & 3] = m;
+            __m128i msg = _mm_add_epi32(
+                    m, _mm_loadu_si128((const __m128i*) &FTPSha256K[j * 4]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            msg = _mm_shuffle_epi32(msg, 0x0e);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+        }
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+        data += 64;
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1b);        // FEBA
+    state1 = _mm_shuffle_epi32(state1, 0xb1);     // DCHG
+    state0 = _mm_blend_epi16(tmp, state1, 0xf0);  // DCBA
+    state1 = _mm_alignr_epi8(state1, tmp, 8);     // HGFE
+    _mm_storeu_si128((__m128i*) &state[0], state0);
+    _mm_storeu_si128((__m128i*) &state[4], state1);
+}
+#endif
+
+typedef void (*ftp_sha256_blocks)(uint32_t*, const unsigned char*, size_t);
+
+static ftp_sha256_blocks sha256_blocks = FTPSha256Soft;
+static pthread_once_t sha256_once = PTHREAD_ONCE_INIT;
+
+static void FTPSha256Select(void) {
+#ifdef FTP_HASH_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1")) {
+        sha256_blocks = FTPSha256Ni;
+    }
+#endif
+}
+
+/* 第一次使用时按 CPU 选择实现 */
+static ftp_sha256_blocks FTPSha256Blocks(void) {
+    pthread_once(&sha256_once, FTPSha256Select);
+    return sha256_blocks;
+}
+
+/* algo 是否有硬件加速: CRC32 由 zlib 计算, 始终视为足够快 */
+int FTPHashAccelerated(int algo) {
+    if (algo == FTP_HASH_CRC32) return 1;
+    return algo == FTP_HASH_SHA256 && FTPSha256Blocks() != FTPSha256Soft;
+}
+
+/* HASH 命令和 FEAT 中的算法名 */
+const char* FTPHashName(int algo) {
+    return algo == FTP_HASH_CRC32 ? "CRC32" : "SHA-256";
+}
+
+void FTPHashInit(ftp_hash* h, int algo) {
+    static const uint32_t init[8] = {0x6a09e667,
+                                     0xbb67ae85,
+                                     0x3c6ef372,
+                                     0xa54ff53a,
+                                     0x510e527f,
+                                     0x9b05688c,
+                                     0x1f83d9ab,
+                                     0x5be0cd19};
+    h->algo = algo;
+    h->crc = crc32(0L, Z_NULL, 0);
+    memcpy(h->state, init, sizeof(init));
+    h->len = 0;
+}
+
+/* algo 为 0 时不做任何事, 传输循环可以无条件调用 */
+void FTPHashUpdate(ftp_hash* h, const void* data, size_t len) {
+    const unsigned char* p = (const unsigned char*) data;
+    if (h->algo == FTP_HASH_CRC32) {
+        h->crc = crc32_z(h->crc, p, len);
+        return;
+    }
+    if (h->algo != FTP_HASH_SHA256 || len == 0) return;
+    // 先补满上次剩下的不完整块, 整块直接计算, 剩余部分留到下次
+    size_t used = h->len % 64;
+    h->len += len;
+    if (used) {
+        size_t n = 64 - used < len ? 64 - used : len;
+        memcpy(h->block + used, p, n);
+        p += n;
+        len -= n;
+        if (used + n < 64) return;
+        FTPSha256Blocks()(h->state, h->block, 1);
+    }
+    if (len >= 64) {
+        FTPSha256Blocks()(h->state, p, len / 64);
+        p += len / 64 * 64;
+        len %= 64;
+    }
+    memcpy(h->block, p, len);
+}
+
+/* 结束计算, 写入小写十六进制摘要 (至少 FTP_HASH_HEX 字节) */
+void FTPHashHex(ftp_hash* h, char* hex) {
+    if (h->algo == FTP_HASH_CRC32) {
+        sprintf(hex, "%08x", (unsigned) h->crc);
+        return;
+    }
+    // 补位: 0x80, 0 直到余 56 字节, 64 位大端消息比特数
+    unsigned char pad[72];
+    uint64_t bits = h->len * 8;
+    size_t used = h->len % 64;
+    size_t npad = used < 56 ? 56 - used : 120 - used;
+    memset(pad, 0, sizeof(pad));
+    pad[0] = 0x80;
+    int i;
+    for (i = 0; i < 8; i++) pad[npad + i] = bits >> (56 - i * 8);
+    FTPHashUpdate(h, pad, npad + 8);
+    for (i = 0; i < 8; i++) sprintf(hex + i * 8, "%08x", h->state[i]);
+}
+
+/*
+    读取 fd 中 [offset, offset + length) 加入摘要, length < 0 时读到文件末尾
+    用于续传前已有的部分和大小相同时的比较, 不改变文件偏移
+    读取出错或文件不足 length 字节返回 -1
+*/
+int FTPHashFile(ftp_hash* h, int fd, long offset, long length) {
+    char buf[64 << 10];
+    while (length != 0) {
+        size_t n = length > 0 && length < (long) sizeof(buf) ? length
+                                                              : sizeof(buf);
+        ssize_t nread = pread(fd, buf, n, offset);
+        if (nread < 0) return -1;
+        if (nread == 0) return length > 0 ? -1 : 0;
+        FTPHashUpdate(h, buf, nread);
+        offset += nread;
+        if (length > 0) length -= nread;
+    }
+    return 0;
+}
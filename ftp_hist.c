@@ -0,0 +1,194 @@
+/*
+    命令延迟直方图
+    按命令 (CWD, SIZE, PASV, RETR ...) 以及 CONNECT, LOGIN, DATA 分别记录延迟
+    HDR 风格的对数线性分桶: 每个 2 的幂区间分 16 个子桶, 相对误差不超过 1/16
+    所有会话 (包括连接池和分段传输线程) 共享, 只使用原子操作, 不加锁
+*/
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "ftpclient.h"
+
+#define FTP_HIST_SUB_BITS 4
+#define FTP_HIST_SUB (1 << FTP_HIST_SUB_BITS)
+#define FTP_HIST_BUCKETS (FTP_HIST_SUB * 36)  // 微秒, 超出范围的计入最后一个桶
+#define FTP_HIST_VERBS 32
+
+typedef struct ftp_hist {
+    _Atomic uint64_t verb;  // 命令名, 最多 8 个字符, 0 表示空闲
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum;  // 微秒
+    _Atomic uint64_t min;  // 最小值 + 1, 0 表示尚未记录
+    _Atomic uint64_t max;
+    _Atomic uint32_t buckets[FTP_HIST_BUCKETS];
+} ftp_hist;
+
+static ftp_hist hists[FTP_HIST_VERBS];
+
+/* 命令名到 8 字节整数, 遇到空格, '\r', '\n' 结束, 可以直接传入命令行 */
+static uint64_t FTPHistKey(const char* verb) {
+    uint64_t key = 0;
+    int i;
+    for (i = 0; i < 8 && verb[i] && !strchr(" \r\n", verb[i]); i++) {
+        key |= (uint64_t)(unsigned char) verb[i] << (8 * i);
+    }
+    return key;
+}
+
+/* 微秒数到桶下标: 小于 16 直接对应, 之后每个 2 的幂区间 16 个桶 */
+static int FTPHistBucket(uint64_t us) {
+    if (us < FTP_HIST_SUB) return (int) us;
+    int exp = 63 - __builtin_clzll(us);
+    int sub = (int) (us >> (exp - FTP_HIST_SUB_BITS)) & (FTP_HIST_SUB - 1);
+    int index = (exp - FTP_HIST_SUB_BITS + 1) * FTP_HIST_SUB + sub;
+    return index < FTP_HIST_BUCKETS ? index : FTP_HIST_BUCKETS - 1;
+}
+
+/* 桶的上界 (微秒) */
+static uint64_t FTPHistValue(int index) {
+    if (index < FTP_HIST_SUB) return index;
+    int exp = index / FTP_HIST_SUB + FTP_HIST_SUB_BITS - 1;
+    uint64_t sub = index % FTP_HIST_SUB;
+    return ((FTP_HIST_SUB + sub + 1) << (exp - FTP_HIST_SUB_BITS)) - 1;
+}
+
+/* 查找命令对应的直方图, 不存在时占用一个空闲项, 已满返回 NULL */
+static ftp_hist* FTPHistFind(uint64_t key) {
+    int i;
+    for (i = 0; i < FTP_HIST_VERBS; i++) {
+        uint64_t cur = atomic_load_explicit(&hists[i].verb,
+                                            memory_order_acquire);
+        if (cur == key) return &hists[i];
+        if (cur == 0) {
+            if (atomic_compare_exchange_strong(&hists[i].verb, &cur, key)) {
+                return &hists[i];
+            }
+            // 其他线程抢先占用, 可能是同一个命令
+            if (cur == key) return &hists[i];
+        }
+    }
+    return NULL;
+}
+
+/* 记录一次延迟, verb 可以是命令名或完整的命令行 */
+void FTPHistRecord(const char* verb, double seconds) {
+    uint64_t key = FTPHistKey(verb);
+    if (key == 0) return;
+    ftp_hist* h = FTPHistFind(key);
+    if (h == NULL) return;
+
+    uint64_t us = seconds > 0 ? (uint64_t)(seconds * 1e6) : 0;
+    atomic_fetch_add_explicit(&h->buckets[FTPHistBucket(us)],
+                              1,
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum, us, memory_order_relaxed);
+    uint64_t cur = atomic_load_explicit(&h->min, memory_order_relaxed);
+    while ((cur == 0 || us + 1 < cur) &&
+           !atomic_compare_exchange_weak(&h->min, &cur, us + 1)) {
+    }
+    cur = atomic_load_explicit(&h->max, memory_order_relaxed);
+    while (us > cur && !atomic_compare_exchange_weak(&h->max, &cur, us)) {
+    }
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_release);
+}
+
+/* 百分位数 (微秒), 返回所在桶的上界, 不超过最大值 */
+static uint64_t FTPHistPercentile(const uint32_t* buckets,
+                                  uint64_t count,
+                                  uint64_t max,
+                                  double p) {
+    uint64_t rank = (uint64_t)(count * p / 100 + 0.5);
+    if (rank == 0) rank = 1;
+    uint64_t seen = 0;
+    int i;
+    for (i = 0; i < FTP_HIST_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen >= rank) {
+            uint64_t v = FTPHistValue(i);
+            return v < max ? v : max;
+        }
+    }
+    return max;
+}
+
+/* 输出所有命令的延迟分布, 单位毫秒 */
+void FTPHistDump(FILE* fp) {
+    static uint32_t buckets[FTP_HIST_BUCKETS];
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    // 复制桶时允许其他线程继续记录, 只需避免两次输出同时使用 buckets
+    pthread_mutex_lock(&lock);
+    fprintf(fp,
+            "%-8s %8s %10s %10s %10s %10s %10s %10s\n",
+            "verb",
+            "count",
+            "min",
+            "mean",
+            "p50",
+            "p90",
+            "p99",
+            "max");
+    int i, j;
+    for (i = 0; i < FTP_HIST_VERBS; i++) {
+        ftp_hist* h = &hists[i];
+        uint64_t key = atomic_load_explicit(&h->verb, memory_order_acquire);
+        if (key == 0) break;
+        uint64_t count = atomic_load_explicit(&h->count, memory_order_acquire);
+        if (count == 0) continue;
+
+        char verb[9] = {0};
+        for (j = 0; j < 8; j++) verb[j] = (char) (key >> (8 * j));
+        uint64_t total = 0;
+        for (j = 0; j < FTP_HIST_BUCKETS; j++) {
+            buckets[j] = atomic_load_explicit(&h->buckets[j],
+                                              memory_order_relaxed);
+            total += buckets[j];
+        }
+        uint64_t max = atomic_load(&h->max);
+        fprintf(fp,
+                "%-8s %8llu %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f\n",
+                verb,
+                (unsigned long long) count,
+                (atomic_load(&h->min) - 1) / 1e3,
+                (double) atomic_load(&h->sum) / count / 1e3,
+                FTPHistPercentile(buckets, total, max, 50) / 1e3,
+                FTPHistPercentile(buckets, total, max, 90) / 1e3,
+                FTPHistPercentile(buckets, total, max, 99) / 1e3,
+                max / 1e3);
+    }
+    fflush(fp);
+    pthread_mutex_unlock(&lock);
+}
+
+static sigset_t hist_signals;
+
+static void* FTPHistSignalThread(void* arg) {
+    (void) arg;
+    int signo;
+    while (sigwait(&hist_signals, &signo) == 0) {
+        FTPHistDump(stderr);
+    }
+    return NULL;
+}
+
+/*
+    收到 signo 时输出直方图到 stderr
+    由专门的线程 sigwait 处理, 不在信号处理函数中调用 stdio
+    必须在创建其他线程之前调用, 新线程继承屏蔽的信号
+*/
+int FTPHistSignal(int signo) {
+    sigemptyset(&hist_signals);
+    sigaddset(&hist_signals, signo);
+    if (pthread_sigmask(SIG_BLOCK, &hist_signals, NULL) != 0) return -1;
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, FTPHistSignalThread, NULL) != 0) {
+        pthread_sigmask(SIG_UNBLOCK, &hist_signals, NULL);
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
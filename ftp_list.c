@@ -0,0 +1,435 @@
+/*
+    目录列表解析
+    MLSD (RFC 3659) 每行为 "fact=value;...; name", 服务器不支持时回退到 LIST,
+    解析 Unix "ls -l" 和 Windows (IIS) 两种格式
+    数据边接收边解析, 记录 (ftp_entry) 从 arena 头部, 名字从尾部分配, 不为每项
+    malloc; arena 写满时把这一批交给回调后复用, 百万项的目录也只占用一个 arena
+*/
+#define _GNU_SOURCE  // memmem()
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "ftpclient.h"
+#include "log.h"
+
+#define FTP_LIST_READ (64 << 10)
+
+typedef struct ftp_list_parser {
+    int mlsd;
+    char* arena;     // [0, n 条记录) 为 ftp_entry, [names, FTP_LIST_ARENA) 为名字
+    int n;
+    size_t names;
+    char line[FTP_LIST_LINE];  // 跨越两次 read 的行
+    int line_len;
+    int skip;        // 行过长, 丢弃到下一个换行符
+    long count;      // 已解析的项数
+    ftp_entry_cb fn;
+    void* arg;
+    ftp_session* s;
+    int cache;            // 列表中的项写入元数据缓存
+    char dir[BUFF_SIZE];  // 列出目录的绝对路径
+    char buf[FTP_LIST_READ];
+} ftp_list_parser;
+
+/* 当前一批写入缓存并交给回调, arena 清空 */
+static void FTPListFlush(ftp_list_parser* p) {
+    const ftp_entry* entries = (const ftp_entry*) p->arena;
+    int i;
+    for (i = 0; p->cache && i < p->n; i++) {
+        char path[BUFF_SIZE];
+        if (snprintf(path,
+                     sizeof(path),
+                     "%s/%s",
+                     strcmp(p->dir, "/") ? p->dir : "",
+                     entries[i].name) < (int) sizeof(path)) {
+            FTPCacheStore(p->s, path, &entries[i]);
+        }
+    }
+    if (p->n > 0) p->fn(entries, p->n, p->arg);
+    p->n = 0;
+    p->names = FTP_LIST_ARENA;
+}
+
+/* 加入一项, 名字复制到 arena 尾部 */
+static void FTPListAdd(ftp_list_parser* p,
+                       const ftp_entry* e,
+                       const char* name,
+                       int len) {
+    if ((len == 1 && name[0] == '.') ||
+        (len == 2 && name[0] == '.' && name[1] == '.')) {
+        return;
+    }
+    if ((p->n + 1) * sizeof(ftp_entry) + len + 1 > p->names) FTPListFlush(p);
+    p->names -= len + 1;
+    char* copy = p->arena + p->names;
+    memcpy(copy, name, len);
+    copy[len] = '\0';
+    ftp_entry* entry = (ftp_entry*) p->arena + p->n++;
+    *entry = *e;
+    entry->name = copy;
+    p->count++;
+}
+
+/* n 位十进制数 */
+static int FTPListNum(const char* s, int n) {
+    int v = 0;
+    while (n-- > 0) v = v * 10 + (*s++ - '0');
+    return v;
+}
+
+/* "YYYYMMDDHHMMSS[.sss]" (UTC), 格式错误返回 -1 */
+static time_t FTPListTime(const char* v, int len) {
+    int i;
+    if (len < 14) return -1;
+    for (i = 0; i < 14; i++) {
+        if (v[i] < '0' || v[i] > '9') return -1;
+    }
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_year = FTPListNum(v, 4) - 1900;
+    tm.tm_mon = FTPListNum(v + 4, 2) - 1;
+    tm.tm_mday = FTPListNum(v + 6, 2);
+    tm.tm_hour = FTPListNum(v + 8, 2);
+    tm.tm_min = FTPListNum(v + 10, 2);
+    tm.tm_sec = FTPListNum(v + 12, 2);
+    return timegm(&tm);
+}
+
+#define FTP_FACT(key) \
+    (klen == (int) sizeof(key) - 1 && strncasecmp(fact, key, klen) == 0)
+
+/*
+    MLSD/MLST 的一行 "type=file;size=1024;modify=20200101000000;perm=r; name"
+    返回 0, 当前目录或上级目录 (cdir/pdir) 返回 1, 格式错误返回 -1
+*/
+static int FTPListFacts(const char* line,
+                        int len,
+                        ftp_entry* e,
+                        const char** name,
+                        int* name_len) {
+    const char* sp = memchr(line, ' ', len);
+    if (sp == NULL) return -1;
+    *name = sp + 1;
+    *name_len = line + len - sp - 1;
+    e->type = FTP_ENTRY_OTHER;
+    e->size = -1;
+    e->modify = -1;
+    e->perm = 0;
+    int ret = 0;
+    const char* fact = line;
+    while (fact < sp) {
+        const char* semi = memchr(fact, ';', sp - fact);
+        if (semi == NULL) semi = sp;
+        const char* eq = memchr(fact, '=', semi - fact);
+        if (eq) {
+            int klen = eq - fact;
+            const char* v = eq + 1;
+            int vlen = semi - v;
+            if (FTP_FACT("type")) {
+                if (vlen == 4 && strncasecmp(v, "file", 4) == 0) {
+                    e->type = FTP_ENTRY_FILE;
+                } else if (vlen == 3 && strncasecmp(v, "dir", 3) == 0) {
+                    e->type = FTP_ENTRY_DIR;
+                } else if (vlen == 4 && (strncasecmp(v, "cdir", 4) == 0 ||
+                                         strncasecmp(v, "pdir", 4) == 0)) {
+                    e->type = FTP_ENTRY_DIR;
+                    ret = 1;
+                } else if (vlen >= 10 &&
+                           strncasecmp(v, "OS.unix=sl", 10) == 0) {
+                    e->type = FTP_ENTRY_LINK;  // slink 或 symlink
+                } else if (vlen >= 10 &&
+                           strncasecmp(v, "OS.unix=sy", 10) == 0) {
+                    e->type = FTP_ENTRY_LINK;
+                }
+            } else if (FTP_FACT("size") || FTP_FACT("sizd")) {
+                e->size = atol(v);  // 以 ';' 结束
+            } else if (FTP_FACT("modify")) {
+                e->modify = FTPListTime(v, vlen);
+            } else if (FTP_FACT("perm")) {
+                int i;
+                for (i = 0; i < vlen; i++) {
+                    char c = v[i] | 0x20;
+                    if (c >= 'a' && c <= 'z') e->perm |= FTP_PERM(c);
+                }
+            }
+        }
+        fact = semi + 1;
+    }
+    return ret;
+}
+
+/*
+    LIST 的一行
+    -rw-r--r-- 1 owner group 1234 Jan  1 12:00 name (group 可能省略)
+    01-01-20  12:00PM       <DIR>          name
+    权限按属主的权限位推测, 格式错误返回 -1
+*/
+static int FTPListLs(const char* line,
+                     int len,
+                     ftp_entry* e,
+                     const char** name,
+                     int* name_len) {
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    const char* tok[9];
+    int tok_len[9];
+    int ntok = 0;
+    const char* p = line;
+    const char* end = line + len;
+    while (ntok < 9) {
+        while (p < end && *p == ' ') p++;
+        if (p == end) break;
+        tok[ntok] = p;
+        while (p < end && *p != ' ') p++;
+        tok_len[ntok] = p - tok[ntok];
+        ntok++;
+    }
+    e->modify = -1;
+    e->perm = 0;
+
+    if (line[0] >= '0' && line[0] <= '9') {
+        if (ntok < 4) return -1;
+        int dir = tok_len[2] == 5 && strncmp(tok[2], "<DIR>", 5) == 0;
+        e->type = dir ? FTP_ENTRY_DIR : FTP_ENTRY_FILE;
+        e->size = dir ? -1 : atol(tok[2]);
+        *name = tok[3];
+        *name_len = end - tok[3];
+        return 0;
+    }
+    if (ntok < 1 || tok_len[0] < 10) return -1;
+    // 月份之前为大小, 之后为日, 时间或年, 文件名 (可能包含空格)
+    int i, j;
+    for (i = 3; i + 3 < ntok; i++) {
+        if (tok_len[i] != 3) continue;
+        for (j = 0; j < 12; j++) {
+            if (strncasecmp(tok[i], months + j * 3, 3) == 0) break;
+        }
+        if (j < 12) break;
+    }
+    if (i + 3 >= ntok) return -1;
+    e->size = atol(tok[i - 1]);
+    *name = tok[i + 3];
+    *name_len = end - tok[i + 3];
+
+    const char* mode = tok[0];
+    switch (mode[0]) {
+    case '-':
+        e->type = FTP_ENTRY_FILE;
+        if (mode[1] == 'r') e->perm |= FTP_PERM('r');
+        if (mode[2] == 'w') e->perm |= FTP_PERM('w') | FTP_PERM('a');
+        break;
+    case 'd':
+        e->type = FTP_ENTRY_DIR;
+        if (mode[1] == 'r') e->perm |= FTP_PERM('l');
+        if (mode[2] == 'w') e->perm |= FTP_PERM('c') | FTP_PERM('m');
+        if (mode[3] == 'x') e->perm |= FTP_PERM('e');
+        break;
+    case 'l': {
+        // "name -> target"
+        e->type = FTP_ENTRY_LINK;
+        const char* arrow = memmem(*name, *name_len, " -> ", 4);
+        if (arrow) *name_len = arrow - *name;
+        break;
+    }
+    default:
+        e->type = FTP_ENTRY_OTHER;
+    }
+    return 0;
+}
+
+/* 解析一整行 (不含 '\n') */
+static void FTPListLine(ftp_list_parser* p, const char* line, int len) {
+    if (len > 0 && line[len - 1] == '\r') len--;
+    if (len == 0) return;
+    ftp_entry e;
+    const char* name;
+    int name_len;
+    int ret = p->mlsd ? FTPListFacts(line, len, &e, &name, &name_len)
+                      : FTPListLs(line, len, &e, &name, &name_len);
+    if (ret == 0 && name_len > 0) FTPListAdd(p, &e, name, name_len);
+}
+
+/* 解析收到的一段数据, 行可能跨越多段 */
+static void FTPListFeed(ftp_list_parser* p, const char* buf, long len) {
+    const char* end = buf + len;
+    while (buf < end) {
+        const char* eol = memchr(buf, '\n', end - buf);
+        const char* stop = eol ? eol : end;
+        if (p->skip) {
+            p->skip = eol == NULL;
+        } else if (p->line_len == 0 && eol) {
+            // 整行都在这一段中, 直接解析
+            FTPListLine(p, buf, stop - buf);
+        } else if (p->line_len + (stop - buf) > FTP_LIST_LINE) {
+            LOGW("list line too long, skipped.\n");
+            p->line_len = 0;
+            p->skip = eol == NULL;
+        } else {
+            memcpy(p->line + p->line_len, buf, stop - buf);
+            p->line_len += stop - buf;
+            if (eol) {
+                FTPListLine(p, p->line, p->line_len);
+                p->line_len = 0;
+            }
+        }
+        buf = eol ? eol + 1 : end;
+    }
+}
+
+/* 读取 fd 直到 EOF, 边读边解析, st 非空时记录网络时间 */
+static long FTPListRead(ftp_list_parser* p, int fd, ftp_stats* st) {
+    long total = 0;
+    ssize_t n;
+    double t = FTPNow();
+    while ((n = read(fd, p->buf, sizeof(p->buf))) > 0) {
+        if (st) t = FTPStatsIo(st, 1, t);
+        FTPListFeed(p, p->buf, n);
+        total += n;
+        t = FTPNow();
+    }
+    if (st) FTPStatsIo(st, 1, t);
+    return n < 0 ? -1 : total;
+}
+
+typedef struct ftp_list_decode {
+    ftp_session* s;
+    int data_fd;
+    int pipe_fd;
+    long ret;
+} ftp_list_decode;
+
+/* 块模式或压缩模式的列表解码后写入管道 */
+static void* FTPListDecode(void* arg) {
+    ftp_list_decode* d = (ftp_list_decode*) arg;
+    d->ret = d->s->block_mode ? FTPBlockRecv(d->s, d->pipe_fd, d->data_fd)
+                              : FTPInflateRecv(d->s, d->pipe_fd, d->data_fd);
+    close(d->pipe_fd);
+    return NULL;
+}
+
+/*
+    流模式直接解析数据连接
+    块模式和压缩模式由另一个线程解码到管道, 本线程从管道读取并解析,
+    解码和解析都只使用固定大小的缓冲区
+*/
+static long FTPListRecv(ftp_session* s, int data_fd, void* arg) {
+    ftp_list_parser* p = (ftp_list_parser*) arg;
+    if (!s->block_mode && !s->deflate) {
+        return FTPListRead(p, data_fd, &s->stats);
+    }
+    int fds[2];
+    if (pipe(fds) < 0) {
+        LOGE("pipe error.\n");
+        return -1;
+    }
+    ftp_list_decode d = {s, data_fd, fds[1], -1};
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, FTPListDecode, &d)) {
+        LOGE("pthread_create error.\n");
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    FTPListRead(p, fds[0], NULL);
+    close(fds[0]);
+    pthread_join(tid, NULL);
+    return d.ret;
+}
+
+/*
+    列出目录, dirname 为空时列出当前目录
+    优先使用 MLSD (FEAT 中有 MLST), 否则使用 LIST
+    解析出的项按批交给 fn, 不包括 "." 和 ".."
+*/
+int FTPListEntries(ftp_session* s,
+                   const char* dirname,
+                   ftp_entry_cb fn,
+                   void* arg) {
+    if (s->mlsd == 0) s->mlsd = FTPFeat(s, "MLST") == 1 ? 1 : -1;
+
+    ftp_list_parser* p = (ftp_list_parser*) malloc(sizeof(ftp_list_parser));
+    char* arena = (char*) malloc(FTP_LIST_ARENA);
+    if (p == NULL || arena == NULL) {
+        LOGE("malloc error.\n");
+        free(p);
+        free(arena);
+        return -1;
+    }
+    p->mlsd = s->mlsd == 1;
+    p->arena = arena;
+    p->n = 0;
+    p->names = FTP_LIST_ARENA;
+    p->line_len = 0;
+    p->skip = 0;
+    p->count = 0;
+    p->fn = fn;
+    p->arg = arg;
+    p->s = s;
+    // 当前目录未知时相对路径的列表不写入缓存
+    p->cache = s->cache && FTPCachePath(s,
+                                        dirname[0] ? dirname : ".",
+                                        p->dir,
+                                        sizeof(p->dir)) == 0;
+    long mark = FTPCacheMark(s);
+    double start = FTPNow();
+
+    char cmd[BUFF_SIZE];
+    snprintf(cmd,
+             sizeof(cmd),
+             "%s%s%.*s",
+             p->mlsd ? "MLSD" : "LIST -al",
+             dirname[0] ? " " : "",
+             BUFF_SIZE - 16,
+             dirname);
+    FTPStatsBegin(s, p->mlsd ? "MLSD" : "LIST", dirname, 0);
+    int ret = FTPListCommand(s, cmd, FTPListRecv, p);
+    // 最后一行可能没有换行符
+    if (p->line_len > 0 && !p->skip) FTPListLine(p, p->line, p->line_len);
+    FTPListFlush(p);
+    // 完整列出后, 缓存中不在列表里的子项即为不存在
+    if (ret == 0 && p->cache) FTPCacheListed(s, p->dir, mark, start);
+    FTPStatsEnd(s, ret, s->reply.code);
+
+    free(arena);
+    free(p);
+    return ret;
+}
+
+/*
+    命令 "MLST path"
+    响应 "250-Listing path\r\n facts name\r\n250 End"
+    结果写入 e, 名字复制到 name
+*/
+int FTPMlst(ftp_session* s,
+            const char* path,
+            ftp_entry* e,
+            char* name,
+            int size) {
+    sprintf(s->send_buf, "MLST %s\r\n", path);
+    FTPCommand(s);
+    if (FTPCheckResponse(&s->reply)) {
+        printf("<< MLST %s failed. %.*s", path, s->reply.len, s->reply.text);
+        return -1;
+    }
+    // 第二行以空格开头
+    const char* end = s->reply.text + s->reply.len;
+    const char* line = memchr(s->reply.text, '\n', s->reply.len);
+    if (line == NULL || ++line == end) return -1;
+    if (*line == ' ') line++;
+    const char* eol = memchr(line, '\n', end - line);
+    if (eol == NULL) return -1;
+    if (eol > line && eol[-1] == '\r') eol--;
+
+    const char* n;
+    int len;
+    if (FTPListFacts(line, eol - line, e, &n, &len) == -1) return -1;
+    if (len >= size) len = size - 1;
+    memcpy(name, n, len);
+    name[len] = '\0';
+    e->name = name;
+    FTPCacheStore(s, path, e);
+    return 0;
+}
@@ -0,0 +1,506 @@
+/*
+    异步日志
+    每个线程第一次写日志时获得一个单生产者单消费者的环形缓冲区, 写入不加锁,
+    不做系统调用, 最后一次 release 存储发布
+    常见格式 (整数, 浮点, 指针, %s, %.*s) 只保存格式串指针和原始参数,
+    %s 参数可能指向调用者的栈, 拷贝到消息缓冲区; 正文由后台线程格式化
+    其他格式 (%n, %ls, long double 等) 或参数过多时在调用线程 vsnprintf
+    后台线程轮询所有缓冲区, 加上时间, 级别, 位置和 strerror 后写到输出
+    线程退出后缓冲区留给之后的新线程复用, 分段传输反复创建线程也不会增长
+*/
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+
+#define FTP_LOG_SLOTS 128  // 每个线程缓冲的消息数, 必须为 2 的幂
+#define FTP_LOG_MSG 240
+#define FTP_LOG_ARGS 8      // 延迟格式化时最多保存的参数个数
+#define FTP_LOG_SPEC 48     // 转换说明替换 * 后的最大长度
+#define FTP_LOG_IDLE_MS 100  // 后台线程空闲时最长轮询间隔
+
+typedef union ftp_log_arg {
+    long long i;  // 有符号整数, %c 和 * 宽度/精度
+    unsigned long long u;
+    double f;
+    const void* p;
+    int str;  // %s: 字符串在 msg 中的偏移
+} ftp_log_arg;
+
+typedef struct ftp_log_slot {
+    int level;
+    int line;
+    int err;
+    const char* file;  // __FILE__ 和 __func__ 为静态字符串, 只保存指针
+    const char* func;
+    const char* format;  // 非空时延迟格式化, msg 存放 %s 参数的拷贝
+    struct timespec time;
+    ftp_log_arg args[FTP_LOG_ARGS];
+    char msg[FTP_LOG_MSG];  // format 为空时为格式化好的正文
+} ftp_log_slot;
+
+/* 一个转换说明, 如 "%-8.*s" */
+typedef struct ftp_log_spec {
+    const char* end;  // 转换字符之后
+    int width_star;   // 宽度为 *
+    int prec_star;    // 精度为 *
+    int prec;         // 精度数字, 无精度或为 * 时 -1
+    char length;      // 长度修饰: 0, 'H' (hh), 'h', 'l', 'L' (ll), 'z', 'j', 't'
+    char conv;
+} ftp_log_spec;
+
+typedef struct ftp_log_ring {
+    _Atomic unsigned head;  // 后台线程读取位置
+    _Atomic unsigned tail;  // 所属线程写入位置
+    atomic_int owned;       // 是否有线程在使用
+    struct ftp_log_ring* next;  // 加入链表后不再改变
+    ftp_log_slot slots[FTP_LOG_SLOTS];
+} ftp_log_ring;
+
+static _Atomic(ftp_log_ring*) log_rings;
+static atomic_int log_level = FTP_LOG_LEVEL;
+static atomic_long log_dropped;
+static ftp_log_sink log_sink;
+static void* log_sink_arg;
+// 消费者之间互斥 (后台线程和 FTPLogFlush), 写日志的线程不加锁
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static pthread_key_t log_key;
+static __thread ftp_log_ring* log_ring;
+
+static void FTPLogStderr(const char* line, int len, void* arg) {
+    (void) arg;
+    if (write(STDERR_FILENO, line, len) != len) {
+        // 输出失败时丢弃
+    }
+}
+
+/*
+    解析 p ('%' 之后) 处的转换说明
+    后台线程不支持的格式返回 -1, 由调用线程格式化
+*/
+static int FTPLogParse(const char* p, ftp_log_spec* spec) {
+    const char* start = p;
+    memset(spec, 0, sizeof(*spec));
+    spec->prec = -1;
+    while (*p && strchr("-+ #0'", *p)) p++;
+    if (*p == '*') {
+        spec->width_star = 1;
+        p++;
+    } else {
+        while (*p >= '0' && *p <= '9') p++;
+    }
+    if (*p == '.') {
+        p++;
+        if (*p == '*') {
+            spec->prec_star = 1;
+            p++;
+        } else {
+            spec->prec = 0;
+            while (*p >= '0' && *p <= '9') {
+                spec->prec = spec->prec * 10 + *p++ - '0';
+            }
+        }
+    }
+    if (p[0] == 'h' || p[0] == 'l') {
+        spec->length = p[1] == p[0] ? (p[0] == 'h' ? 'H' : 'L') : p[0];
+        p += p[1] == p[0] ? 2 : 1;
+    } else if (*p == 'z' || *p == 'j' || *p == 't') {
+        spec->length = *p++;
+    }
+    spec->conv = *p;
+    if (*p == '\0' || !strchr("diuxXocpsfFeEgGaA", *p)) return -1;
+    // %lc/%ls 为宽字符
+    if (spec->length && strchr("cps", spec->conv)) return -1;
+    if (spec->length && strchr("fFeEgGaA", spec->conv) &&
+        spec->length != 'l') {
+        return -1;
+    }
+    spec->end = p + 1;
+    // 两个 * 各替换为最多 11 个字符后仍能放入 FTP_LOG_SPEC
+    return spec->end - start > 16 ? -1 : 0;
+}
+
+/* 按长度修饰读取一个整数参数 */
+static long long FTPLogSigned(va_list* ap, char length) {
+    switch (length) {
+    case 'l':
+        return va_arg(*ap, long);
+    case 'L':
+        return va_arg(*ap, long long);
+    case 'z':
+        return va_arg(*ap, ssize_t);
+    case 'j':
+        return va_arg(*ap, intmax_t);
+    case 't':
+        return va_arg(*ap, ptrdiff_t);
+    default:  // char 和 short 按 int 传递
+        return va_arg(*ap, int);
+    }
+}
+
+static unsigned long long FTPLogUnsigned(va_list* ap, char length) {
+    switch (length) {
+    case 'l':
+        return va_arg(*ap, unsigned long);
+    case 'L':
+        return va_arg(*ap, unsigned long long);
+    case 'z':
+        return va_arg(*ap, size_t);
+    case 'j':
+        return va_arg(*ap, uintmax_t);
+    case 't':
+        return va_arg(*ap, ptrdiff_t);
+    default:
+        return va_arg(*ap, unsigned);
+    }
+}
+
+/*
+    在调用线程保存 format 的参数到 slot
+    字符串拷贝到 slot->msg, 超出长度时截断; 不支持的格式返回 -1
+*/
+static int FTPLogCapture(ftp_log_slot* slot, const char* format, va_list* ap) {
+    int nargs = 0, used = 0;
+    const char* p;
+    for (p = strchr(format, '%'); p; p = strchr(p, '%')) {
+        if (p[1] == '%') {
+            p += 2;
+            continue;
+        }
+        ftp_log_spec spec;
+        if (FTPLogParse(p + 1, &spec) == -1) return -1;
+        if (nargs + spec.width_star + spec.prec_star + 1 > FTP_LOG_ARGS) {
+            return -1;
+        }
+        if (spec.width_star) slot->args[nargs++].i = va_arg(*ap, int);
+        int prec = spec.prec;
+        if (spec.prec_star) prec = slot->args[nargs++].i = va_arg(*ap, int);
+
+        ftp_log_arg* arg = &slot->args[nargs++];
+        switch (spec.conv) {
+        case 'd':
+        case 'i':
+            arg->i = FTPLogSigned(ap, spec.length);
+            break;
+        case 'c':
+            arg->i = va_arg(*ap, int);
+            break;
+        case 'p':
+            arg->p = va_arg(*ap, void*);
+            break;
+        case 's': {
+            const char* s = va_arg(*ap, const char*);
+            if (s == NULL) s = "(null)";
+            // %.*s 的参数不一定以 '\0' 结尾, 最多读取 prec 个字节
+            int left = (int) sizeof(slot->msg) - 1 - used;
+            int n = strnlen(s, prec >= 0 && prec < left ? prec : left);
+            memcpy(slot->msg + used, s, n);
+            slot->msg[used + n] = '\0';
+            arg->str = used;
+            used += n;
+            if (used < (int) sizeof(slot->msg) - 1) used++;
+            break;
+        }
+        default:
+            if (strchr("uxXo", spec.conv)) {
+                arg->u = FTPLogUnsigned(ap, spec.length);
+            } else {
+                arg->f = va_arg(*ap, double);
+            }
+        }
+        p = spec.end;
+    }
+    return 0;
+}
+
+/* 在后台线程按 slot 保存的参数格式化正文, 返回写入 buf 的长度 */
+static int FTPLogFormat(const ftp_log_slot* slot, char* buf, int size) {
+    int len = 0, nargs = 0;
+    const char* p = slot->format;
+    while (*p && len < size - 1) {
+        if (*p != '%') {
+            buf[len++] = *p++;
+            continue;
+        }
+        if (p[1] == '%') {
+            buf[len++] = '%';
+            p += 2;
+            continue;
+        }
+        ftp_log_spec spec;
+        FTPLogParse(p + 1, &spec);
+        // 复制转换说明, * 替换为保存的宽度和精度
+        char fmt[FTP_LOG_SPEC];
+        int n = 0;
+        const char* q;
+        for (q = p; q < spec.end; q++) {
+            if (*q != '*') {
+                fmt[n++] = *q;
+                continue;
+            }
+            int v = slot->args[nargs++].i;
+            if (q[-1] == '.' && v < 0) {
+                n--;  // 负数精度视为没有精度
+            } else {
+                n += snprintf(fmt + n, sizeof(fmt) - n, "%d", v);
+            }
+        }
+        fmt[n] = '\0';
+
+        const ftp_log_arg* arg = &slot->args[nargs++];
+        char* out = buf + len;
+        int left = size - len;
+        switch (spec.conv) {
+        case 'd':
+        case 'i':
+        case 'c':
+            // 按调用者的长度修饰还原类型
+            switch (spec.length) {
+            case 'l':
+                n = snprintf(out, left, fmt, (long) arg->i);
+                break;
+            case 'L':
+                n = snprintf(out, left, fmt, arg->i);
+                break;
+            case 'z':
+                n = snprintf(out, left, fmt, (ssize_t) arg->i);
+                break;
+            case 'j':
+                n = snprintf(out, left, fmt, (intmax_t) arg->i);
+                break;
+            case 't':
+                n = snprintf(out, left, fmt, (ptrdiff_t) arg->i);
+                break;
+            default:
+                n = snprintf(out, left, fmt, (int) arg->i);
+            }
+            break;
+        case 'p':
+            n = snprintf(out, left, fmt, arg->p);
+            break;
+        case 's':
+            n = snprintf(out, left, fmt, slot->msg + arg->str);
+            break;
+        default:
+            if (!strchr("uxXo", spec.conv)) {
+                n = snprintf(out, left, fmt, arg->f);
+                break;
+            }
+            switch (spec.length) {
+            case 'l':
+                n = snprintf(out, left, fmt, (unsigned long) arg->u);
+                break;
+            case 'L':
+                n = snprintf(out, left, fmt, arg->u);
+                break;
+            case 'z':
+                n = snprintf(out, left, fmt, (size_t) arg->u);
+                break;
+            case 'j':
+                n = snprintf(out, left, fmt, (uintmax_t) arg->u);
+                break;
+            case 't':
+                n = snprintf(out, left, fmt, (ptrdiff_t) arg->u);
+                break;
+            default:
+                n = snprintf(out, left, fmt, (unsigned) arg->u);
+            }
+        }
+        if (n < 0) n = 0;
+        len += n < left ? n : left - 1;
+        p = spec.end;
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+/* 格式化并输出 r 中已写入的消息, 返回条数, 调用者持有 log_lock */
+static int FTPLogDrain(ftp_log_ring* r) {
+    static const char levels[] = "DIWE";
+    unsigned head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    int n = 0;
+    for (; head != tail; head++, n++) {
+        ftp_log_slot* slot = &r->slots[head & (FTP_LOG_SLOTS - 1)];
+        struct tm tm;
+        localtime_r(&slot->time.tv_sec, &tm);
+        char line[FTP_LOG_MSG + 512];
+        int len = snprintf(line,
+                           sizeof(line),
+                           "%c %02d:%02d:%02d.%06ld [file: %s / func: %s / "
+                           "Line: %d] ",
+                           levels[slot->level],
+                           tm.tm_hour,
+                           tm.tm_min,
+                           tm.tm_sec,
+                           slot->time.tv_nsec / 1000,
+                           slot->file,
+                           slot->func,
+                           slot->line);
+        if (slot->level == FTP_LOG_ERROR) {
+            len += snprintf(line + len,
+                            sizeof(line) - len,
+                            "<error %s> ",
+                            strerror(slot->err));
+        }
+        if (slot->format) {
+            len += FTPLogFormat(slot, line + len, sizeof(line) - len);
+        } else {
+            len += snprintf(line + len, sizeof(line) - len, "%s", slot->msg);
+        }
+        if (len >= (int) sizeof(line)) len = sizeof(line) - 1;
+        // 消息不以换行结尾时补上
+        if (line[len - 1] != '\n' && len < (int) sizeof(line) - 1) {
+            line[len++] = '\n';
+        }
+        (log_sink ? log_sink : FTPLogStderr)(line, len, log_sink_arg);
+    }
+    atomic_store_explicit(&r->head, head, memory_order_release);
+    return n;
+}
+
+static int FTPLogDrainAll(void) {
+    int n = 0;
+    ftp_log_ring* r;
+    for (r = atomic_load(&log_rings); r; r = r->next) n += FTPLogDrain(r);
+
+    long dropped = atomic_exchange(&log_dropped, 0);
+    if (dropped > 0) {
+        char line[64];
+        int len = snprintf(line,
+                           sizeof(line),
+                           "W %ld log messages dropped\n",
+                           dropped);
+        (log_sink ? log_sink : FTPLogStderr)(line, len, log_sink_arg);
+    }
+    return n;
+}
+
+/* 输出所有已写入的日志, 进程退出时自动调用 */
+void FTPLogFlush(void) {
+    pthread_mutex_lock(&log_lock);
+    FTPLogDrainAll();
+    pthread_mutex_unlock(&log_lock);
+}
+
+static void* FTPLogThread(void* arg) {
+    (void) arg;
+    int idle_ms = 1;
+    while (1) {
+        pthread_mutex_lock(&log_lock);
+        int n = FTPLogDrainAll();
+        pthread_mutex_unlock(&log_lock);
+
+        // 有日志时 1ms 轮询, 空闲时逐渐放慢
+        idle_ms = n > 0 ? 1 : idle_ms * 2;
+        if (idle_ms > FTP_LOG_IDLE_MS) idle_ms = FTP_LOG_IDLE_MS;
+        struct timespec ts = {0, idle_ms * 1000000L};
+        nanosleep(&ts, NULL);
+    }
+    return NULL;
+}
+
+/* 线程退出, 缓冲区中未输出的消息仍由后台线程输出 */
+static void FTPLogRelease(void* ring) {
+    atomic_store_explicit(&((ftp_log_ring*) ring)->owned,
+                          0,
+                          memory_order_release);
+}
+
+static void FTPLogStart(void) {
+    pthread_key_create(&log_key, FTPLogRelease);
+    atexit(FTPLogFlush);
+
+    // 后台线程屏蔽所有信号, 不影响主线程的信号处理
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, FTPLogThread, NULL) == 0) {
+        pthread_detach(tid);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/* 当前线程的缓冲区, 优先复用已退出线程的缓冲区 */
+static ftp_log_ring* FTPLogRing(void) {
+    if (log_ring) return log_ring;
+    pthread_once(&log_once, FTPLogStart);
+
+    ftp_log_ring* r;
+    for (r = atomic_load(&log_rings); r; r = r->next) {
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&r->owned, &expected, 1)) break;
+    }
+    if (r == NULL) {
+        r = calloc(1, sizeof(ftp_log_ring));
+        if (r == NULL) return NULL;
+        atomic_init(&r->owned, 1);
+        r->next = atomic_load(&log_rings);
+        while (!atomic_compare_exchange_weak(&log_rings, &r->next, r)) {
+        }
+    }
+    log_ring = r;
+    pthread_setspecific(log_key, r);
+    return r;
+}
+
+void FTPLogWrite(int level,
+                 const char* file,
+                 const char* func,
+                 int line,
+                 int err,
+                 const char* format,
+                 ...) {
+    if (level < atomic_load_explicit(&log_level, memory_order_relaxed)) return;
+    ftp_log_ring* r = FTPLogRing();
+    if (r == NULL) return;
+
+    unsigned tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&r->head, memory_order_acquire);
+    if (tail - head == FTP_LOG_SLOTS) {
+        // 不阻塞调用者
+        atomic_fetch_add_explicit(&log_dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    ftp_log_slot* slot = &r->slots[tail & (FTP_LOG_SLOTS - 1)];
+    slot->level = level;
+    slot->file = file;
+    slot->func = func;
+    slot->line = line;
+    slot->err = err;
+    clock_gettime(CLOCK_REALTIME, &slot->time);
+    // format 为字符串常量, 只保存指针; 不支持的格式在这里格式化
+    va_list ap, copy;
+    va_start(ap, format);
+    va_copy(copy, ap);
+    slot->format = format;
+    if (FTPLogCapture(slot, format, &ap) == -1) {
+        slot->format = NULL;
+        vsnprintf(slot->msg, sizeof(slot->msg), format, copy);
+    }
+    va_end(copy);
+    va_end(ap);
+    atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+}
+
+/* 运行时调整级别, 低于编译时 FTP_LOG_LEVEL 的调用已被去掉, 不受影响 */
+void FTPLogSetLevel(int level) {
+    atomic_store(&log_level, level);
+}
+
+/* 设置日志输出, NULL 恢复为 stderr */
+void FTPLogSetSink(ftp_log_sink sink, void* arg) {
+    pthread_mutex_lock(&log_lock);
+    log_sink = sink;
+    log_sink_arg = arg;
+    pthread_mutex_unlock(&log_lock);
+}
@@ -0,0 +1,504 @@
+/*
+    目录同步 (mirror / reverse-mirror)
+    多个工作线程各自使用一个控制连接, 任务为一个目录 (列出并生成子任务)
+    或一个文件 (比较并传输)
+    每个线程有自己的双端队列: 新任务压入队尾, 自己从队尾取 (深度优先),
+    空闲时从其他线程的队头窃取 (靠近根的大任务), 一个很深的子树不会拖住其他线程
+*/
+#define _GNU_SOURCE  // stpcpy()
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "ftpclient.h"
+#include "log.h"
+
+#define FTP_MIRROR_IDLE_MS 10  // 没有可窃取的任务时最长等待间隔
+
+/* 一个目录或文件, path 为相对于同步根目录的路径, 根目录为 "" */
+typedef struct ftp_mirror_task {
+    int dir;
+    long remote_size;     // 远程列表中的大小, -1 为远程不存在
+    time_t remote_mtime;  // MLSD 的修改时间, -1 为未知
+    char path[];
+} ftp_mirror_task;
+
+/* 任务双端队列, [top, bottom) 有效 */
+typedef struct ftp_mirror_deque {
+    pthread_mutex_t lock;
+    ftp_mirror_task** tasks;
+    int top, bottom, cap;
+} ftp_mirror_deque;
+
+typedef struct ftp_mirror {
+    const char* remote;  // 远程根目录
+    const char* local;   // 本地根目录
+    int flags;
+    int nworkers;
+    ftp_mirror_deque* deques;
+    atomic_long pending;  // 已加入但未完成的任务
+    atomic_int transferred;
+    atomic_int skipped;
+    atomic_int failed;
+    atomic_long bytes;
+} ftp_mirror;
+
+typedef struct ftp_mirror_worker {
+    pthread_t tid;
+    ftp_mirror* m;
+    int id;
+    ftp_session* s;
+} ftp_mirror_worker;
+
+static ftp_mirror_task* FTPMirrorTask(const char* parent,
+                                      const char* name,
+                                      int dir,
+                                      const ftp_entry* remote) {
+    size_t len = strlen(parent) + strlen(name) + 2;
+    // 不支持 LIST 路径参数的服务器总是列出当前目录, 会无限递归
+    if (len > PATH_MAX - NAME_MAX) {
+        LOGW("path too long: %s/%s.\n", parent, name);
+        return NULL;
+    }
+    ftp_mirror_task* t = (ftp_mirror_task*) malloc(sizeof(*t) + len);
+    if (t == NULL) {
+        LOGE("malloc error.\n");
+        return NULL;
+    }
+    t->dir = dir;
+    // 目录在列表中可能没有大小
+    t->remote_size = remote ? (remote->size < 0 ? 0 : remote->size) : -1;
+    t->remote_mtime = remote ? remote->modify : -1;
+    char* p = t->path;
+    if (parent[0]) p = stpcpy(stpcpy(p, parent), "/");
+    strcpy(p, name);
+    return t;
+}
+
+/* 根目录与相对路径拼接 */
+static void FTPMirrorJoin(char* out, const char* root, const char* path) {
+    if (path[0] == '\0') {
+        snprintf(out, PATH_MAX, "%s", root);
+    } else if (root[0] == '\0' || strcmp(root, ".") == 0) {
+        snprintf(out, PATH_MAX, "%s", path);
+    } else {
+        snprintf(out, PATH_MAX, "%s/%s", root, path);
+    }
+}
+
+/* 压入 id 号线程的队尾 */
+static void FTPMirrorPush(ftp_mirror* m, int id, ftp_mirror_task* t) {
+    ftp_mirror_deque* d = &m->deques[id];
+    atomic_fetch_add(&m->pending, 1);
+    pthread_mutex_lock(&d->lock);
+    if (d->bottom == d->cap) {
+        if (d->top > 0) {
+            // 队头已被窃取的空间移到前面
+            memmove(d->tasks,
+                    d->tasks + d->top,
+                    (d->bottom - d->top) * sizeof(ftp_mirror_task*));
+            d->bottom -= d->top;
+            d->top = 0;
+        } else {
+            int cap = d->cap ? d->cap * 2 : 64;
+            ftp_mirror_task** tasks = (ftp_mirror_task**) realloc(
+                    d->tasks, cap * sizeof(ftp_mirror_task*));
+            if (tasks == NULL) {
+                pthread_mutex_unlock(&d->lock);
+                LOGE("realloc error.\n");
+                free(t);
+                atomic_fetch_add(&m->failed, 1);
+                atomic_fetch_sub(&m->pending, 1);
+                return;
+            }
+            d->tasks = tasks;
+            d->cap = cap;
+        }
+    }
+    d->tasks[d->bottom++] = t;
+    pthread_mutex_unlock(&d->lock);
+}
+
+/* 先从自己的队尾取, 再从其他线程的队头窃取 */
+static ftp_mirror_task* FTPMirrorTake(ftp_mirror* m, int id) {
+    ftp_mirror_task* t = NULL;
+    ftp_mirror_deque* d = &m->deques[id];
+    pthread_mutex_lock(&d->lock);
+    if (d->bottom > d->top) t = d->tasks[--d->bottom];
+    pthread_mutex_unlock(&d->lock);
+
+    int i;
+    for (i = 1; t == NULL && i < m->nworkers; i++) {
+        d = &m->deques[(id + i) % m->nworkers];
+        pthread_mutex_lock(&d->lock);
+        if (d->bottom > d->top) t = d->tasks[d->top++];
+        pthread_mutex_unlock(&d->lock);
+    }
+    return t;
+}
+
+/* 命令 "MFMT YYYYMMDDhhmmss path", 服务器不支持时忽略 */
+static void FTPMirrorMfmt(ftp_session* s, const char* path, time_t mtime) {
+    struct tm tm;
+    gmtime_r(&mtime, &tm);
+    char stamp[32];
+    strftime(stamp, sizeof(stamp), "%Y%m%d%H%M%S", &tm);
+    if (strlen(path) > BUFF_SIZE - 64) return;
+    sprintf(s->send_buf, "MFMT %s %.*s\r\n", stamp, BUFF_SIZE - 64, path);
+    FTPCommand(s);
+}
+
+/*
+    比较一个文件, 需要时传输
+    大小不同时传输, FTP_MIRROR_MTIME 时大小相同也比较修改时间:
+    (远程修改时间取自 MLSD 列表, 服务器只支持 LIST 时发送 MDTM)
+    下载后本地修改时间设为远程时间, 相同即已同步; 上传时本地较新才传输
+    目标文件先删除, 避免 FTPGet/FTPPut 把它当作未完成的文件续传
+*/
+static void FTPMirrorFile(ftp_mirror_worker* w, const ftp_mirror_task* t) {
+    ftp_mirror* m = w->m;
+    ftp_session* s = w->s;
+    int reverse = m->flags & FTP_MIRROR_REVERSE;
+    char remote[PATH_MAX], local[PATH_MAX];
+    FTPMirrorJoin(remote, m->remote, t->path);
+    FTPMirrorJoin(local, m->local, t->path);
+
+    struct stat st;
+    int local_exists = stat(local, &st) == 0;
+    if (!local_exists && reverse) return;  // 列出后被删除
+    int remote_exists = t->remote_size >= 0;
+    time_t mtime = -1;
+    int changed = !local_exists || !remote_exists ||
+                  st.st_size != t->remote_size;
+    if (m->flags & FTP_MIRROR_MTIME) {
+        mtime = t->remote_mtime;
+        if (remote_exists && mtime == -1) mtime = FTPMdtm(s, remote);
+        if (!changed && mtime != -1) {
+            changed = reverse ? st.st_mtime > mtime : st.st_mtime != mtime;
+        }
+    }
+    if (!changed) {
+        atomic_fetch_add(&m->skipped, 1);
+        return;
+    }
+
+    int ret;
+    if (reverse) {
+        if (remote_exists) FTPDele(s, remote);
+        ret = FTPPut(s, local, remote);
+        if (ret == 0 && (m->flags & FTP_MIRROR_MTIME)) {
+            FTPMirrorMfmt(s, remote, st.st_mtime);
+        }
+    } else {
+        if (local_exists) unlink(local);
+        ret = FTPGet(s, remote, local);
+        if (ret == 0 && (m->flags & FTP_MIRROR_MTIME)) {
+            if (mtime == -1) mtime = FTPMdtm(s, remote);
+            struct timespec times[2] = {{0, UTIME_OMIT}, {mtime, 0}};
+            if (mtime != -1) utimensat(AT_FDCWD, local, times, 0);
+        }
+    }
+    if (ret == -1) {
+        atomic_fetch_add(&m->failed, 1);
+        return;
+    }
+    atomic_fetch_add(&m->transferred, 1);
+    atomic_fetch_add(&m->bytes, s->stats.bytes);
+}
+
+/* 下载: 远程列表中的每一项成为一个任务, 符号链接和设备文件不同步 */
+typedef struct ftp_mirror_walk {
+    ftp_mirror_worker* w;
+    const ftp_mirror_task* t;
+} ftp_mirror_walk;
+
+static void FTPMirrorRemoteEntries(const ftp_entry* entries,
+                                   int n,
+                                   void* arg) {
+    ftp_mirror_walk* walk = (ftp_mirror_walk*) arg;
+    int i;
+    for (i = 0; i < n; i++) {
+        const ftp_entry* e = &entries[i];
+        if (e->type != FTP_ENTRY_FILE && e->type != FTP_ENTRY_DIR) continue;
+        ftp_mirror_task* child = FTPMirrorTask(
+                walk->t->path, e->name, e->type == FTP_ENTRY_DIR, e);
+        if (child == NULL) {
+            atomic_fetch_add(&walk->w->m->failed, 1);
+            continue;
+        }
+        FTPMirrorPush(walk->w->m, walk->w->id, child);
+    }
+}
+
+/* 上传: 远程列表保存下来按名字排序, 再与本地目录比较 */
+typedef struct ftp_mirror_names {
+    int n, cap;
+    ftp_entry* entries;
+} ftp_mirror_names;
+
+static void FTPMirrorCollect(const ftp_entry* entries, int n, void* arg) {
+    ftp_mirror_names* names = (ftp_mirror_names*) arg;
+    int i;
+    for (i = 0; i < n; i++) {
+        if (names->n == names->cap) {
+            int cap = names->cap ? names->cap * 2 : 64;
+            ftp_entry* grown = (ftp_entry*) realloc(names->entries,
+                                                    cap * sizeof(ftp_entry));
+            if (grown == NULL) return;
+            names->entries = grown;
+            names->cap = cap;
+        }
+        // 列表的 arena 在回调返回后复用, 名字需要复制
+        ftp_entry* copy = &names->entries[names->n];
+        *copy = entries[i];
+        copy->name = strdup(entries[i].name);
+        if (copy->name == NULL) return;
+        names->n++;
+    }
+}
+
+static int FTPMirrorNameCmp(const void* a, const void* b) {
+    return strcmp(((const ftp_entry*) a)->name, ((const ftp_entry*) b)->name);
+}
+
+static void FTPMirrorLocalDir(ftp_mirror_worker* w, const ftp_mirror_task* t) {
+    ftp_mirror* m = w->m;
+    char remote[PATH_MAX], local[PATH_MAX];
+    FTPMirrorJoin(remote, m->remote, t->path);
+    FTPMirrorJoin(local, m->local, t->path);
+
+    DIR* dir = opendir(local);
+    if (dir == NULL) {
+        LOGE("opendir %s error.\n", local);
+        atomic_fetch_add(&m->failed, 1);
+        return;
+    }
+    // 父目录列表中不存在的目录刚刚创建, 不需要列出
+    ftp_mirror_names names = {0, 0, NULL};
+    if (t->remote_size >= 0 &&
+        FTPListEntries(w->s, remote, FTPMirrorCollect, &names) == -1) {
+        atomic_fetch_add(&m->failed, 1);
+        closedir(dir);
+        return;
+    }
+    qsort(names.entries, names.n, sizeof(ftp_entry), FTPMirrorNameCmp);
+
+    struct dirent* ent;
+    int i;
+    while ((ent = readdir(dir)) != NULL) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+            continue;
+        }
+        char path[PATH_MAX];
+        struct stat st;
+        FTPMirrorJoin(path, local, ent->d_name);
+        if (lstat(path, &st) < 0 ||
+            (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode))) {
+            continue;
+        }
+        ftp_entry key;
+        key.name = ent->d_name;
+        const ftp_entry* found = (const ftp_entry*) bsearch(&key,
+                                                            names.entries,
+                                                            names.n,
+                                                            sizeof(ftp_entry),
+                                                            FTPMirrorNameCmp);
+        int is_dir = S_ISDIR(st.st_mode);
+        if (is_dir && found == NULL) {
+            FTPMirrorJoin(path, remote, ent->d_name);
+            if (FTPMkdir(w->s, path) == -1) {
+                atomic_fetch_add(&m->failed, 1);
+                continue;
+            }
+        }
+        ftp_mirror_task* child =
+                FTPMirrorTask(t->path, ent->d_name, is_dir, found);
+        if (child == NULL) {
+            atomic_fetch_add(&m->failed, 1);
+            continue;
+        }
+        FTPMirrorPush(m, w->id, child);
+    }
+    closedir(dir);
+    for (i = 0; i < names.n; i++) free((char*) names.entries[i].name);
+    free(names.entries);
+}
+
+static void FTPMirrorRemoteDir(ftp_mirror_worker* w, const ftp_mirror_task* t) {
+    ftp_mirror* m = w->m;
+    char remote[PATH_MAX], local[PATH_MAX];
+    FTPMirrorJoin(remote, m->remote, t->path);
+    FTPMirrorJoin(local, m->local, t->path);
+
+    if (mkdir(local, 0755) < 0 && errno != EEXIST) {
+        LOGE("mkdir %s error.\n", local);
+        atomic_fetch_add(&m->failed, 1);
+        return;
+    }
+    ftp_mirror_walk walk = {w, t};
+    if (FTPListEntries(w->s, remote, FTPMirrorRemoteEntries, &walk) == -1) {
+        atomic_fetch_add(&m->failed, 1);
+    }
+}
+
+static void* FTPMirrorWorker(void* arg) {
+    ftp_mirror_worker* w = (ftp_mirror_worker*) arg;
+    ftp_mirror* m = w->m;
+    int idle_ms = 1;
+    while (atomic_load(&m->pending) > 0) {
+        ftp_mirror_task* t = FTPMirrorTake(m, w->id);
+        if (t == NULL) {
+            // 其他线程的目录任务可能还会产生新任务
+            struct timespec ts = {0, idle_ms * 1000000L};
+            nanosleep(&ts, NULL);
+            if (idle_ms < FTP_MIRROR_IDLE_MS) idle_ms *= 2;
+            continue;
+        }
+        idle_ms = 1;
+        if (!t->dir) {
+            FTPMirrorFile(w, t);
+        } else if (m->flags & FTP_MIRROR_REVERSE) {
+            FTPMirrorLocalDir(w, t);
+        } else {
+            FTPMirrorRemoteDir(w, t);
+        }
+        free(t);
+        atomic_fetch_sub(&m->pending, 1);
+    }
+    return NULL;
+}
+
+/* 没有工作线程能够登录时, 丢弃剩余任务 */
+static void FTPMirrorDrain(ftp_mirror* m) {
+    int i;
+    for (i = 0; i < m->nworkers; i++) {
+        ftp_mirror_deque* d = &m->deques[i];
+        while (d->bottom > d->top) free(d->tasks[--d->bottom]);
+        free(d->tasks);
+        pthread_mutex_destroy(&d->lock);
+    }
+}
+
+/*
+    命令 "mirror remote local [-t]" / "reverse-mirror local remote [-t]"
+    同步 remote 目录树到 local (FTP_MIRROR_REVERSE 时相反), 只传输有变化的文件
+    使用连接池时并发数为连接池大小, 否则登录 FTP_MIRROR_SESSIONS 个连接
+    不删除目标中多余的文件, 不同步符号链接
+*/
+static int FTPMirrorTree(ftp_session* s,
+                         const char* remote,
+                         const char* local,
+                         int flags) {
+    char cwd[BUFF_SIZE];
+    if (FTPGetCwd(s, cwd, sizeof(cwd)) == -1) return -1;
+
+    ftp_mirror m;
+    memset(&m, 0, sizeof(m));
+    m.remote = remote;
+    m.local = local;
+    m.flags = flags;
+    m.nworkers = s->pool ? FTPPoolSize(s->pool) : FTP_MIRROR_SESSIONS;
+    ftp_mirror_deque deques[FTP_POOL_MAX];
+    ftp_mirror_worker workers[FTP_POOL_MAX];
+    m.deques = deques;
+    int i;
+    for (i = 0; i < m.nworkers; i++) {
+        memset(&deques[i], 0, sizeof(deques[i]));
+        pthread_mutex_init(&deques[i].lock, NULL);
+    }
+
+    // 上传时远程根目录不存在则创建, 已存在时 MKD 失败, 忽略
+    if (flags & FTP_MIRROR_REVERSE) {
+        int verbose = s->verbose;
+        s->verbose = 0;
+        sprintf(s->send_buf, "MKD %.*s\r\n", BUFF_SIZE - 8, remote);
+        FTPCommand(s);
+        s->verbose = verbose;
+        FTPCacheForget(s, remote);
+    }
+    // 根目录视为远程已存在
+    ftp_entry top = {"", 0, -1, 0, FTP_ENTRY_DIR};
+    ftp_mirror_task* root = FTPMirrorTask("", "", 1, &top);
+    if (root == NULL) {
+        FTPMirrorDrain(&m);
+        return -1;
+    }
+    FTPMirrorPush(&m, 0, root);
+
+    ftp_rate local_rate;
+    ftp_rate* rate = FTPSessionRate(s, &local_rate);
+    int nstarted = 0;
+    for (i = 0; i < m.nworkers; i++) {
+        workers[i].m = &m;
+        workers[i].id = i;
+        workers[i].s = FTPWorkerLogin(s, cwd, rate);
+        if (workers[i].s == NULL) continue;
+        if (pthread_create(
+                    &workers[i].tid, NULL, FTPMirrorWorker, &workers[i])) {
+            LOGE("pthread_create error.\n");
+            FTPWorkerLogout(s, workers[i].s);
+            workers[i].s = NULL;
+            continue;
+        }
+        nstarted++;
+    }
+    // 登录失败的线程的队列仍可被其他线程窃取
+    for (i = 0; i < m.nworkers; i++) {
+        if (workers[i].s == NULL) continue;
+        pthread_join(workers[i].tid, NULL);
+        FTPWorkerLogout(s, workers[i].s);
+    }
+    long pending = atomic_load(&m.pending);
+    FTPMirrorDrain(&m);
+    if (nstarted == 0) {
+        printf("<< MIRROR %s failed. No session.\n", remote);
+        return -1;
+    }
+
+    s->stats.bytes = atomic_load(&m.bytes);
+    int failed = atomic_load(&m.failed) + (int) pending;
+    printf("<< MIRROR %s ok. %d transferred (%ld bytes), %d up to date, "
+           "%d failed, %d sessions.\n",
+           remote,
+           atomic_load(&m.transferred),
+           s->stats.bytes,
+           atomic_load(&m.skipped),
+           failed,
+           nstarted);
+    return failed ? -1 : 0;
+}
+
+int FTPMirror(ftp_session* s,
+              const char* remote,
+              const char* local,
+              int flags) {
+    // 未给出目标时使用源目录的最后一级名字
+    char source[PATH_MAX], target[PATH_MAX];
+    snprintf(source,
+             sizeof(source),
+             "%s",
+             (flags & FTP_MIRROR_REVERSE) ? local : remote);
+    if (strlen(flags & FTP_MIRROR_REVERSE ? remote : local) == 0) {
+        snprintf(target, sizeof(target), "%s", basename(source));
+        if (flags & FTP_MIRROR_REVERSE) {
+            remote = target;
+        } else {
+            local = target;
+        }
+    }
+    FTPStatsBegin(s, "MIRROR", flags & FTP_MIRROR_REVERSE ? local : remote, 0);
+    int ret = FTPMirrorTree(s, remote, local, flags);
+    FTPStatsEnd(s, ret, s->reply.code);
+    return ret;
+}
@@ -0,0 +1,285 @@
+/*
+    控制连接池
+    预先登录 N 个控制连接, 空闲时定期发送 NOOP 保活
+    断开 (421 或连接关闭) 的连接在归还或保活时重新登录
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <poll.h>
+#include <pthread.h>
+
+#include "ftpclient.h"
+#include "log.h"
+
+struct ftp_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;  // 有连接归还或连接池关闭
+    pthread_t keepalive_tid;
+    int stop;
+    int size;
+    ftp_session template;  // 服务器地址和登录信息
+    ftp_session* sessions[FTP_POOL_MAX];
+    int busy[FTP_POOL_MAX];
+    time_t last_used[FTP_POOL_MAX];
+};
+
+/*
+    连接是否已断开
+    空闲的控制连接上出现可读数据 (服务器主动发送 421 或关闭连接) 也视为断开
+*/
+static int FTPPoolBroken(const ftp_session* s) {
+    if (s->ctl_fd < 0 || s->reply.code == 421) return 1;
+    struct pollfd pfd = {s->ctl_fd, POLLIN, 0};
+    return poll(&pfd, 1, 0) != 0;
+}
+
+/* 关闭旧连接, 用模板重新登录, 失败时 ctl_fd 为 -1 */
+static void FTPPoolReconnect(ftp_pool* pool, ftp_session* s) {
+    if (s->ctl_fd >= 0) close(s->ctl_fd);
+    FTPSessionInit(s);
+    s->verbose = 0;
+    if (FTPOpen(s, pool->template.server_ip, pool->template.port) == -1) {
+        return;
+    }
+    if (FTPLogin(s, pool->template.username, pool->template.password) == -1) {
+        close(s->ctl_fd);
+        s->ctl_fd = -1;
+    }
+}
+
+/* 对空闲超过 FTP_POOL_KEEPALIVE 秒的连接发送 NOOP */
+static void* FTPPoolKeepalive(void* arg) {
+    ftp_pool* pool = (ftp_pool*) arg;
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += FTP_POOL_KEEPALIVE;
+        pthread_cond_timedwait(&pool->cond, &pool->lock, &deadline);
+
+        int i;
+        for (i = 0; i < pool->size && !pool->stop; i++) {
+            if (pool->busy[i] ||
+                time(NULL) - pool->last_used[i] < FTP_POOL_KEEPALIVE) {
+                continue;
+            }
+            // 保活期间占用该连接, 不持有锁
+            ftp_session* s = pool->sessions[i];
+            pool->busy[i] = 1;
+            pthread_mutex_unlock(&pool->lock);
+
+            if (s->ctl_fd >= 0) {
+                sprintf(s->send_buf, "NOOP\r\n");
+                FTPCommand(s);
+            }
+            if (FTPPoolBroken(s)) FTPPoolReconnect(pool, s);
+
+            pthread_mutex_lock(&pool->lock);
+            pool->busy[i] = 0;
+            pool->last_used[i] = time(NULL);
+            pthread_cond_broadcast(&pool->cond);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/*
+    创建 nsessions 个与 parent 相同服务器和用户的已登录连接
+    失败返回 NULL
+*/
+ftp_pool* FTPPoolCreate(const ftp_session* parent, int nsessions) {
+    if (nsessions <= 0) return NULL;
+    if (nsessions > FTP_POOL_MAX) nsessions = FTP_POOL_MAX;
+
+    ftp_pool* pool = (ftp_pool*) calloc(1, sizeof(ftp_pool));
+    if (pool == NULL) {
+        LOGE("calloc error.\n");
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    memcpy(&pool->template, parent, sizeof(ftp_session));
+    pool->template.pool = NULL;
+
+    int i;
+    for (i = 0; i < nsessions; i++) {
+        ftp_session* s = (ftp_session*) malloc(sizeof(ftp_session));
+        if (s == NULL) break;
+        s->ctl_fd = -1;
+        FTPPoolReconnect(pool, s);
+        if (s->ctl_fd < 0) {
+            free(s);
+            break;
+        }
+        pool->sessions[i] = s;
+        pool->last_used[i] = time(NULL);
+        pool->size++;
+    }
+    if (pool->size == 0 ||
+        pthread_create(&pool->keepalive_tid, NULL, FTPPoolKeepalive, pool)) {
+        pool->keepalive_tid = 0;
+        FTPPoolDestroy(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+/*
+    取出一个空闲连接, 全部占用时阻塞等待
+    返回前替换已断开的连接, 重新登录失败返回 NULL
+*/
+ftp_session* FTPPoolAcquire(ftp_pool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        int i;
+        for (i = 0; i < pool->size; i++) {
+            if (!pool->busy[i]) break;
+        }
+        if (i < pool->size) {
+            pool->busy[i] = 1;
+            pthread_mutex_unlock(&pool->lock);
+
+            ftp_session* s = pool->sessions[i];
+            if (FTPPoolBroken(s)) FTPPoolReconnect(pool, s);
+            if (s->ctl_fd < 0) {
+                FTPPoolRelease(pool, s);
+                return NULL;
+            }
+            return s;
+        }
+        pthread_cond_wait(&pool->cond, &pool->lock);
+    }
+}
+
+/* 归还连接 */
+void FTPPoolRelease(ftp_pool* pool, ftp_session* s) {
+    pthread_mutex_lock(&pool->lock);
+    int i;
+    for (i = 0; i < pool->size; i++) {
+        if (pool->sessions[i] == s) {
+            pool->busy[i] = 0;
+            pool->last_used[i] = time(NULL);
+            break;
+        }
+    }
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+    标记连接已断开并归还
+    控制连接状态未知时 (如传输中途出错) 使用, 下次取出时重新登录
+*/
+void FTPPoolDiscard(ftp_pool* pool, ftp_session* s) {
+    if (s->ctl_fd >= 0) close(s->ctl_fd);
+    s->ctl_fd = -1;
+    FTPPoolRelease(pool, s);
+}
+
+/* 停止保活线程, 所有连接 QUIT 后释放, 需在所有连接归还后调用 */
+void FTPPoolDestroy(ftp_pool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    if (pool->keepalive_tid) pthread_join(pool->keepalive_tid, NULL);
+
+    int i;
+    for (i = 0; i < pool->size; i++) {
+        ftp_session* s = pool->sessions[i];
+        if (s->ctl_fd >= 0) {
+            sprintf(s->send_buf, "QUIT\r\n");
+            FTPCommand(s);
+            close(s->ctl_fd);
+        }
+        free(s);
+    }
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+/*
+    mirror, mget 等工作线程的控制连接
+    使用连接池或重新登录, 进入主连接的工作目录 cwd, 继承传输设置
+    所有工作线程共享令牌桶 rate, 合计速率不超过主连接的限速
+*/
+ftp_session* FTPWorkerLogin(const ftp_session* parent,
+                            const char* cwd,
+                            ftp_rate* rate) {
+    ftp_session* s;
+    char dir[BUFF_SIZE];
+    strcpy(dir, cwd);
+
+    if (parent->pool) {
+        s = FTPPoolAcquire(parent->pool);
+        if (s == NULL) return NULL;
+    } else {
+        s = (ftp_session*) malloc(sizeof(ftp_session));
+        if (s == NULL) {
+            LOGE("malloc error.\n");
+            return NULL;
+        }
+        FTPSessionInit(s);
+        s->verbose = 0;
+        if (FTPOpen(s, parent->server_ip, parent->port) == -1 ||
+            FTPLogin(s, parent->username, parent->password) == -1) {
+            if (s->ctl_fd != -1) close(s->ctl_fd);
+            free(s);
+            return NULL;
+        }
+    }
+    s->data_mode = FTP_PASV_MODE;
+    s->data_buf_size = parent->data_buf_size;
+    s->sockbuf_auto = parent->sockbuf_auto;
+    s->data_rate = parent->data_rate;
+    s->zero_copy = parent->zero_copy;
+    s->prefetch = parent->prefetch;
+    s->cache = parent->cache;
+    s->bytes_per_sec = parent->bytes_per_sec;
+    s->rate = rate;
+    if (FTPCd(s, dir) == -1 || FTPBinary(s) == -1 ||
+        (parent->block_mode && FTPMode(s, 'B') == -1) ||
+        (parent->deflate && FTPMode(s, 'Z') == -1) ||
+        (parent->verify && FTPSetVerify(s, 1) == -1)) {
+        if (parent->pool) {
+            FTPPoolDiscard(parent->pool, s);
+        } else {
+            close(s->ctl_fd);
+            free(s);
+        }
+        return NULL;
+    }
+    return s;
+}
+
+/* 工作线程退出登录, 连接池中的连接恢复为流模式并关闭校验后归还 */
+void FTPWorkerLogout(const ftp_session* parent, ftp_session* s) {
+    // 令牌桶在调用者的栈上, 归还的连接不能再引用
+    s->rate = NULL;
+    FTPSetPrefetch(s, 0);
+    FTPSetVerify(s, 0);
+    if (parent->pool) {
+        if ((s->block_mode || s->deflate) && FTPMode(s, 'S') == -1) {
+            FTPPoolDiscard(parent->pool, s);
+            return;
+        }
+        FTPPoolRelease(parent->pool, s);
+        return;
+    }
+    if (s->block_fd >= 0) close(s->block_fd);
+    sprintf(s->send_buf, "QUIT\r\n");
+    FTPCommand(s);
+    close(s->ctl_fd);
+    free(s);
+}
+
+/* 连接池大小 */
+int FTPPoolSize(const ftp_pool* pool) {
+    return pool->size;
+}
@@ -0,0 +1,113 @@
+/*
+    令牌桶限速
+    桶中剩余令牌用 "令牌耗尽时刻" tat 表示 (CLOCK_MONOTONIC 纳秒):
+    消耗 n 字节令牌即 tat 后移 n / bytes_per_sec 秒, tat 超过当前时刻即为欠账, 需休眠等待
+    空闲时按时间自动补充, 最多积累 FTP_RATE_SLICE_MS 毫秒的令牌
+    补充和消耗都是对 tat 的一次 CAS, 多个线程共享同一个桶时无需加锁
+*/
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "ftpclient.h"
+
+#define NSEC_PER_SEC 1000000000LL
+#define RATE_BURST_NS ((int64_t) FTP_RATE_SLICE_MS * 1000000)
+
+/* 进程内所有传输共享的全局限速 */
+static ftp_rate global_rate = {-1, 0};
+
+static int64_t FTPRateNow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/*
+    从桶中取出 nbytes 个令牌
+    返回令牌不足需要等待的纳秒数, 不限速返回 0
+*/
+static int64_t FTPRateTake(ftp_rate* r, long nbytes, int64_t now) {
+    long bytes_per_sec = atomic_load_explicit(&r->bytes_per_sec,
+                                              memory_order_relaxed);
+    if (bytes_per_sec <= 0) return 0;
+
+    int64_t cost = (int64_t) nbytes * NSEC_PER_SEC / bytes_per_sec;
+    long long old = atomic_load_explicit(&r->tat, memory_order_relaxed);
+    int64_t tat;
+    do {
+        // 空闲期间补充的令牌不超过桶容量
+        tat = old > now - RATE_BURST_NS ? old : now - RATE_BURST_NS;
+        tat += cost;
+    } while (!atomic_compare_exchange_weak_explicit(&r->tat,
+                                                    &old,
+                                                    tat,
+                                                    memory_order_relaxed,
+                                                    memory_order_relaxed));
+    return tat - now;
+}
+
+/* bytes_per_sec <= 0 不限速 */
+void FTPRateInit(ftp_rate* r, long bytes_per_sec) {
+    atomic_init(&r->bytes_per_sec, bytes_per_sec);
+    atomic_init(&r->tat, 0);
+}
+
+/*
+    会话一次传输使用的令牌桶
+    mirror, mget 工作连接共享主连接的桶, 否则按会话限速初始化 local
+*/
+ftp_rate* FTPSessionRate(ftp_session* s, ftp_rate* local) {
+    if (s->rate) return s->rate;
+    FTPRateInit(local, s->bytes_per_sec);
+    return local;
+}
+
+/*
+    本次最多传输的字节数
+    限速时不超过 FTP_RATE_SLICE_MS 毫秒的配额, 避免单次传输超出限速
+*/
+long FTPRateChunk(const ftp_rate* r, long max) {
+    const ftp_rate* rates[2] = {r, &global_rate};
+    int i;
+    for (i = 0; i < 2; i++) {
+        if (rates[i] == NULL) continue;
+        long bytes_per_sec = atomic_load_explicit(&rates[i]->bytes_per_sec,
+                                                  memory_order_relaxed);
+        if (bytes_per_sec <= 0) continue;
+        long slice = bytes_per_sec / (1000 / FTP_RATE_SLICE_MS);
+        if (slice < 1) slice = 1;
+        if (slice < max) max = slice;
+    }
+    return max;
+}
+
+/*
+    传输了 nbytes 字节后调用
+    同时扣除本次传输 (r, 可为 NULL) 和全局限速的令牌, 令牌不足时休眠到补足为止
+    返回休眠的秒数
+*/
+double FTPRateConsume(ftp_rate* r, long nbytes) {
+    int64_t now = FTPRateNow();
+    int64_t wait = FTPRateTake(&global_rate, nbytes, now);
+    if (r != NULL) {
+        int64_t local_wait = FTPRateTake(r, nbytes, now);
+        if (local_wait > wait) wait = local_wait;
+    }
+    if (wait <= 0) return 0;
+
+    struct timespec ts = {wait / NSEC_PER_SEC, wait % NSEC_PER_SEC};
+    // 被信号打断时继续休眠剩余时间
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR) continue;
+    return (double) wait / NSEC_PER_SEC;
+}
+
+/*
+    命令 "setlimit %d -g"
+    进程内所有会话的传输总速率上限, <=0 不限速 单位 KB/s
+*/
+void FTPSetGlobalRateLimit(double ftp_rate_limit_kb) {
+    long bytes_per_sec =
+            ftp_rate_limit_kb <= 0 ? -1 : (long) (ftp_rate_limit_kb * 1024);
+    atomic_store(&global_rate.bytes_per_sec, bytes_per_sec);
+}
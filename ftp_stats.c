@@ -0,0 +1,129 @@
+/*
+    传输统计
+    每次 get/put/list/pget/pput 结束后 s->stats 保存本次统计,
+    设置了 stats_fd 时同时写入一行 JSON, 供调度程序跟踪吞吐量和慢服务器
+*/
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include "ftpclient.h"
+
+/* fd 是否为 socket, 用于区分网络和本地读写时间 */
+int FTPStatsIsNet(int fd) {
+    struct stat st;
+    return fstat(fd, &st) == 0 && S_ISSOCK(st.st_mode);
+}
+
+/* 开始一次传输, offset 为断点续传起始偏移 */
+void FTPStatsBegin(ftp_session* s,
+                   const char* cmd,
+                   const char* filename,
+                   long offset) {
+    ftp_stats* st = &s->stats;
+    memset(st, 0, sizeof(*st));
+    snprintf(st->cmd, sizeof(st->cmd), "%s", cmd);
+    snprintf(st->file, sizeof(st->file), "%s", filename);
+    st->offset = offset;
+    st->start = FTPNow();
+}
+
+/*
+    记录一次数据读写系统调用, start 为调用开始时刻
+    返回当前时刻, 可直接作为下一次调用的开始时刻
+*/
+double FTPStatsIo(ftp_stats* st, int net, double start) {
+    double now = FTPNow();
+    if (net) {
+        st->net_time += now - start;
+    } else {
+        st->disk_time += now - start;
+    }
+    st->syscalls++;
+    return now;
+}
+
+/* 合并分段的统计, 墙钟时间以主连接为准, 响应码取最差 (最大) 的分段 */
+void FTPStatsMerge(ftp_stats* st, const ftp_stats* seg) {
+    if (seg->reply > st->reply) st->reply = seg->reply;
+    st->bytes += seg->bytes;
+    st->wire_bytes += seg->wire_bytes;
+    st->net_time += seg->net_time;
+    st->disk_time += seg->disk_time;
+    st->rate_wait += seg->rate_wait;
+    st->syscalls += seg->syscalls;
+}
+
+/*
+    结束传输, 记录最终响应码, 设置了 stats_fd 时写入一行 JSON
+    ret 为传输返回值, 失败而服务器响应成功 (本地错误) 时响应码记为 0
+*/
+void FTPStatsEnd(ftp_session* s, int ret, int reply) {
+    ftp_stats* st = &s->stats;
+    st->reply = (ret == -1 && reply < 400) ? 0 : reply;
+    st->elapsed = FTPNow() - st->start;
+    // 未压缩时数据连接上的字节数即文件字节数
+    if (st->wire_bytes == 0) st->wire_bytes = st->bytes;
+    if (s->stats_fd < 0) return;
+
+    char line[BUFF_SIZE * 2];
+    int len = FTPStatsJson(st, line, sizeof(line) - 1);
+    line[len++] = '\n';
+    if (write(s->stats_fd, line, len) != len) {
+        // 统计输出失败不影响传输
+    }
+}
+
+/* 统计格式化为一行 JSON (不含换行), 返回长度 */
+int FTPStatsJson(const ftp_stats* st, char* buf, int size) {
+    // 文件名转义 '"' '\\' 和控制字符
+    char file[sizeof(st->file) * 6];
+    int n = 0;
+    const unsigned char* p;
+    for (p = (const unsigned char*) st->file; *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            file[n++] = '\\';
+            file[n++] = *p;
+        } else if (*p < 0x20) {
+            n += sprintf(file + n, "\\u%04x", *p);
+        } else {
+            file[n++] = *p;
+        }
+    }
+    file[n] = '\0';
+
+    double mbps = st->elapsed > 0 ? st->bytes / st->elapsed / (1 << 20) : 0;
+    // 压缩比: 文件字节数 / 数据连接上的字节数
+    double ratio = st->wire_bytes > 0 ? (double) st->bytes / st->wire_bytes : 1;
+    n = snprintf(buf,
+                 size,
+                 "{\"cmd\":\"%s\",\"file\":\"%s\",\"bytes\":%ld,"
+                 "\"wire_bytes\":%ld,\"ratio\":%.3f,\"offset\":%ld,"
+                 "\"elapsed\":%.6f,\"net_time\":%.6f,"
+                 "\"disk_time\":%.6f,\"rate_wait\":%.6f,\"syscalls\":%ld,"
+                 "\"reply\":%d,\"mbps\":%.3f}",
+                 st->cmd,
+                 file,
+                 st->bytes,
+                 st->wire_bytes,
+                 ratio,
+                 st->offset,
+                 st->elapsed,
+                 st->net_time,
+                 st->disk_time,
+                 st->rate_wait,
+                 st->syscalls,
+                 st->reply,
+                 mbps);
+    return n < size ? n : size - 1;
+}
+
+/*
+    命令 "stats <path>"
+    每次传输结束后向 fd 写入一行 JSON, -1 关闭
+*/
+void FTPSetStatsFd(ftp_session* s, int fd) {
+    s->stats_fd = fd;
+}
@@ -0,0 +1,442 @@
+/*
+    io_uring 数据传输
+    不依赖 liburing, 直接使用 io_uring_setup/io_uring_enter/io_uring_register
+
+    FTP_URING_DEPTH 个缓冲区轮流使用, 每完成一个请求就补充新的请求, 不等整批结束:
+    下载 recv(socket, MSG_WAITALL) 与 write(file) 链接 (IOSQE_IO_LINK) 为一对,
+    recv 完成后立即提交下一对, 多个 write 与下一个 recv 同时进行
+    上传 空闲缓冲区都提前 read(file), 读完的按文件顺序 send(socket, MSG_WAITALL)
+    socket 上同一时刻只有一个请求, 保证数据顺序; 文件一侧按偏移读写, 可以同时进行
+    文件一侧使用注册缓冲区 (READ_FIXED/WRITE_FIXED), 注册失败时使用普通 READ/WRITE
+*/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include "ftpclient.h"
+#include "log.h"
+
+#if defined(__NR_io_uring_setup) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+
+struct ftp_uring {
+    int fd;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* sq_ptr;
+    size_t sq_len;
+    void* cq_ptr;
+    size_t cq_len;
+    size_t sqes_len;
+    int fixed;  // 已注册缓冲区
+};
+
+static void FTPUringClose(struct ftp_uring* ring) {
+    if (ring->sqes) munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_ptr && ring->cq_ptr != ring->sq_ptr) {
+        munmap(ring->cq_ptr, ring->cq_len);
+    }
+    if (ring->sq_ptr) munmap(ring->sq_ptr, ring->sq_len);
+    close(ring->fd);
+}
+
+/* 创建 entries 项的 io_uring 并映射 SQ/CQ, 失败返回 -1 */
+static int FTPUringOpen(struct ftp_uring* ring, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (ring->fd < 0) return -1;
+
+    ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_len > ring->sq_len) ring->sq_len = ring->cq_len;
+        ring->cq_len = ring->sq_len;
+    }
+    ring->sq_ptr = mmap(NULL,
+                        ring->sq_len,
+                        PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE,
+                        ring->fd,
+                        IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED) {
+        ring->sq_ptr = NULL;
+        FTPUringClose(ring);
+        return -1;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = ring->sq_ptr;
+    } else {
+        ring->cq_ptr = mmap(NULL,
+                            ring->cq_len,
+                            PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE,
+                            ring->fd,
+                            IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED) {
+            ring->cq_ptr = NULL;
+            FTPUringClose(ring);
+            return -1;
+        }
+    }
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe*) mmap(NULL,
+                                             ring->sqes_len,
+                                             PROT_READ | PROT_WRITE,
+                                             MAP_SHARED | MAP_POPULATE,
+                                             ring->fd,
+                                             IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        FTPUringClose(ring);
+        return -1;
+    }
+
+    char* sq = (char*) ring->sq_ptr;
+    char* cq = (char*) ring->cq_ptr;
+    ring->sq_tail = (unsigned*) (sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned*) (sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned*) (sq + p.sq_off.array);
+    ring->cq_head = (unsigned*) (cq + p.cq_off.head);
+    ring->cq_tail = (unsigned*) (cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned*) (cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+    return 0;
+}
+
+/* 取一个空闲 SQE, 提交前不更新内核可见的 tail */
+static struct io_uring_sqe* FTPUringSqe(struct ftp_uring* ring,
+                                        unsigned* tail,
+                                        int opcode,
+                                        int fd,
+                                        void* buf,
+                                        unsigned len,
+                                        long long offset,
+                                        unsigned long long user_data) {
+    unsigned index = *tail & *ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long) buf;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+    ring->sq_array[index] = index;
+    (*tail)++;
+    return sqe;
+}
+
+/*
+    提交 [sq_tail, tail) 的请求, 至少等到一个完成
+    等待时间计入网络时间
+*/
+static int FTPUringEnter(struct ftp_uring* ring, unsigned tail, ftp_stats* st) {
+    unsigned n = tail - *ring->sq_tail;
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+    while (1) {
+        double t = FTPNow();
+        int ret = syscall(__NR_io_uring_enter,
+                          ring->fd,
+                          n,
+                          1,
+                          IORING_ENTER_GETEVENTS,
+                          NULL,
+                          0);
+        FTPStatsIo(st, 1, t);
+        if (ret >= 0) return 0;
+        if (errno != EINTR) break;
+        n = 0;  // 被打断时请求已提交, 只需继续等待
+    }
+    LOGE("io_uring_enter error.\n");
+    return -1;
+}
+
+/* 缓冲区状态 */
+#define SLOT_FREE 0
+#define SLOT_SRC 1   // 正在读取 (上传 read) 或接收 (下载 recv)
+#define SLOT_FULL 2  // 上传: 已读取, 等待按顺序发送
+#define SLOT_SINK 3  // 正在写入 (下载 write) 或发送 (上传 send)
+
+/* 缓冲区 k 的请求, user_data 为 k * 2 + (0 读取或接收, 1 写入或发送) */
+#define SLOT_DATA(k, sink) ((unsigned long long) (k) * 2 + (sink))
+
+struct ftp_uring_slot {
+    int state;
+    off_t off;      // 数据在文件中的偏移
+    unsigned len;   // 数据长度
+    unsigned done;  // 已写入或已发送的长度
+};
+
+/*
+    src_fd 传输数据到 dest_fd, 一端为 socket, 另一端为普通文件
+    文件从当前偏移处开始读写, 结束后更新文件偏移
+    返回传输的字节数, 不支持 io_uring 时返回 -1, 由调用者回退
+*/
+long FTPUringTransmit(ftp_session* s, int dest_fd, int src_fd) {
+    struct stat dest_st, src_st;
+    if (fstat(dest_fd, &dest_st) < 0 || fstat(src_fd, &src_st) < 0) return -1;
+    int download = S_ISSOCK(src_st.st_mode) && S_ISREG(dest_st.st_mode);
+    int upload = S_ISREG(src_st.st_mode) && S_ISSOCK(dest_st.st_mode);
+    if (!download && !upload) return -1;
+    int file_fd = download ? dest_fd : src_fd;
+    int sock_fd = download ? src_fd : dest_fd;
+    off_t start = lseek(file_fd, 0, SEEK_CUR);
+    if (start < 0) return -1;
+
+    struct ftp_uring ring;
+    if (FTPUringOpen(&ring, 2 * FTP_URING_DEPTH) == -1) return -1;
+    unsigned size = s->data_buf_size;
+    char* bufs = (char*) mmap(NULL,
+                              (size_t) size * FTP_URING_DEPTH,
+                              PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS,
+                              -1,
+                              0);
+    if (bufs == MAP_FAILED) {
+        FTPUringClose(&ring);
+        return -1;
+    }
+    // 注册缓冲区, 受 RLIMIT_MEMLOCK 限制, 失败时不使用 FIXED 请求
+    struct iovec iov[FTP_URING_DEPTH];
+    int k;
+    for (k = 0; k < FTP_URING_DEPTH; k++) {
+        iov[k].iov_base = bufs + (size_t) k * size;
+        iov[k].iov_len = size;
+    }
+    ring.fixed = syscall(__NR_io_uring_register,
+                         ring.fd,
+                         IORING_REGISTER_BUFFERS,
+                         iov,
+                         FTP_URING_DEPTH) == 0;
+    int read_op = ring.fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    int write_op = ring.fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+
+    /*
+        socket 上同一时刻只有一个 recv 或 send, 保证数据顺序;
+        文件一侧按偏移读写, 多个缓冲区的请求同时进行, 与网络传输重叠
+        下载: recv -> write 链接为一对, recv 完成后立即提交下一对,
+              短读 (数据结束) 使链接的 write 以 -ECANCELED 结束, 按实际长度重新提交
+        上传: 空闲缓冲区都提前 read, 读完的缓冲区按文件顺序依次 send
+    */
+    struct ftp_uring_slot slots[FTP_URING_DEPTH];
+    memset(slots, 0, sizeof(slots));
+    off_t next = start;   // 下一次 recv 或 read 的文件偏移
+    off_t sent = start;   // 上传: 已发送到的偏移
+    off_t end = upload ? src_st.st_size : -1;  // 上传: 文件末尾
+    off_t written = start;  // 下载: 文件实际写到的位置
+    int sock_busy = 0;  // socket 上有未完成的请求
+    int inflight = 0;   // 未完成的请求数
+    int eof = 0, err = 0;
+    unsigned tail = *ring.sq_tail;  // 已填写, 下次 io_uring_enter 时提交
+    while (1) {
+        for (k = 0; k < FTP_URING_DEPTH && !eof && !err; k++) {
+            struct ftp_uring_slot* slot = &slots[k];
+            char* buf = bufs + (size_t) k * size;
+            if (slot->state != SLOT_FREE) continue;
+            if (download) {
+                if (sock_busy) break;
+                struct io_uring_sqe* sqe = FTPUringSqe(&ring,
+                                                       &tail,
+                                                       IORING_OP_RECV,
+                                                       sock_fd,
+                                                       buf,
+                                                       size,
+                                                       0,
+                                                       SLOT_DATA(k, 0));
+                sqe->msg_flags = MSG_WAITALL;
+                sqe->flags = IOSQE_IO_LINK;
+                sqe = FTPUringSqe(&ring,
+                                  &tail,
+                                  write_op,
+                                  file_fd,
+                                  buf,
+                                  size,
+                                  next,
+                                  SLOT_DATA(k, 1));
+                if (ring.fixed) sqe->buf_index = k;
+                slot->off = next;
+                slot->done = 0;
+                slot->state = SLOT_SRC;
+                sock_busy = 1;
+                inflight += 2;
+            } else {
+                if (next >= end) break;
+                slot->off = next;
+                slot->len = end - next < size ? end - next : size;
+                slot->done = 0;
+                slot->state = SLOT_SRC;
+                struct io_uring_sqe* sqe = FTPUringSqe(&ring,
+                                                       &tail,
+                                                       read_op,
+                                                       file_fd,
+                                                       buf,
+                                                       slot->len,
+                                                       next,
+                                                       SLOT_DATA(k, 0));
+                if (ring.fixed) sqe->buf_index = k;
+                next += slot->len;
+                inflight++;
+            }
+        }
+        // 上传: 按文件顺序发送下一个已读取的缓冲区
+        for (k = 0; upload && !sock_busy && !err && k < FTP_URING_DEPTH; k++) {
+            struct ftp_uring_slot* slot = &slots[k];
+            if (slot->state != SLOT_FULL || slot->off != sent) continue;
+            struct io_uring_sqe* sqe =
+                    FTPUringSqe(&ring,
+                                &tail,
+                                IORING_OP_SEND,
+                                sock_fd,
+                                bufs + (size_t) k * size + slot->done,
+                                slot->len - slot->done,
+                                0,
+                                SLOT_DATA(k, 1));
+            sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+            slot->state = SLOT_SINK;
+            sock_busy = 1;
+            inflight++;
+        }
+        if (inflight == 0) break;
+        if (FTPUringEnter(&ring, tail, &s->stats) == -1) {
+            err = 1;
+            break;
+        }
+
+        // 处理已完成的请求, 失败后不再提交新的读取, 等待已提交的请求结束
+        unsigned head = *ring.cq_head;
+        while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe* cqe = &ring.cqes[head & *ring.cq_mask];
+            head++;
+            inflight--;
+            int res = cqe->res;
+            k = cqe->user_data / 2;
+            int sink = cqe->user_data % 2;
+            struct ftp_uring_slot* slot = &slots[k];
+            char* buf = bufs + (size_t) k * size;
+            if (download && !sink) {
+                sock_busy = 0;
+                if (res < 0) {
+                    errno = -res;
+                    LOGE("io_uring recv error.\n");
+                    err = 1;
+                } else if (res == 0) {
+                    eof = 1;
+                } else {
+                    slot->len = res;
+                    next += res;
+                    if ((unsigned) res < size) eof = 1;  // 数据结束
+                }
+                // 接收失败或为空时链接的 write 被取消, 稍后收到其结果
+                slot->state = res > 0 ? SLOT_SINK : SLOT_FREE;
+            } else if (download) {
+                if (res == -ECANCELED && slot->state == SLOT_FREE) continue;
+                if (res == -ECANCELED) res = 0;  // 短读打断了链接
+                if (res < 0) {
+                    errno = -res;
+                    LOGE("io_uring write error.\n");
+                    err = 1;
+                    slot->state = SLOT_FREE;
+                    continue;
+                }
+                // 短读未打断链接的内核上, 写入可能超出实际数据, 结束时截断
+                if (slot->off + slot->done + res > written) {
+                    written = slot->off + slot->done + res;
+                }
+                slot->done += res;
+                if (slot->done < slot->len && !err) {
+                    // 写入不完整, 提交剩余部分
+                    struct io_uring_sqe* sqe =
+                            FTPUringSqe(&ring,
+                                        &tail,
+                                        write_op,
+                                        file_fd,
+                                        buf + slot->done,
+                                        slot->len - slot->done,
+                                        slot->off + slot->done,
+                                        SLOT_DATA(k, 1));
+                    if (ring.fixed) sqe->buf_index = k;
+                    inflight++;
+                } else {
+                    slot->state = SLOT_FREE;
+                }
+            } else if (!sink) {
+                if (res < 0) {
+                    errno = -res;
+                    LOGE("io_uring read error.\n");
+                    err = 1;
+                    slot->state = SLOT_FREE;
+                } else if ((unsigned) res < slot->len) {
+                    // 文件变短, 只发送到读到的位置
+                    if (slot->off + res < end) end = slot->off + res;
+                    slot->len = res;
+                    slot->state = res > 0 ? SLOT_FULL : SLOT_FREE;
+                } else {
+                    slot->state = SLOT_FULL;
+                }
+            } else {
+                sock_busy = 0;
+                if (res <= 0) {
+                    errno = -res;
+                    LOGE("io_uring send error.\n");
+                    err = 1;
+                    slot->state = SLOT_FREE;
+                    continue;
+                }
+                slot->done += res;
+                if (slot->done < slot->len) {
+                    slot->state = SLOT_FULL;  // 继续发送剩余部分
+                } else {
+                    sent += slot->len;
+                    slot->state = SLOT_FREE;
+                }
+            }
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+        // 上传: 文件变短后超出末尾的缓冲区不再发送
+        for (k = 0; upload && k < FTP_URING_DEPTH; k++) {
+            if (slots[k].state == SLOT_FULL && slots[k].off >= end) {
+                slots[k].state = SLOT_FREE;
+            }
+        }
+        if (upload && sent >= end) eof = 1;
+    }
+
+    long total = (download ? next : sent) - start;
+    if (download && written > next && ftruncate(file_fd, next) < 0) {
+        LOGE("ftruncate error.\n");
+    }
+    lseek(file_fd, start + total, SEEK_SET);
+    // 出错时仍有未完成的请求可能写入缓冲区, 关闭 io_uring 但不释放缓冲区
+    if (inflight == 0) munmap(bufs, (size_t) size * FTP_URING_DEPTH);
+    FTPUringClose(&ring);
+    return total;
+}
+
+#else
+
+/* 编译环境没有 io_uring, 总是回退 */
+long FTPUringTransmit(ftp_session* s, int dest_fd, int src_fd) {
+    (void) s;
+    (void) dest_fd;
+    (void) src_fd;
+    return -1;
+}
+
+#endif
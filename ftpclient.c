@@ -0,0 +1,2498 @@
+/*
+    FTP指令: http://www.nsftools.com/tips/RawFTP.htm
+    libftpclient 实现, 所有函数只访问传入的 ftp_session
+*/
+#define _GNU_SOURCE  // splice()
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/sendfile.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "ftpclient.h"
+#include "log.h"
+
+#define FTP_VERIFY_MISMATCH (-2)  // FTPGetFile/FTPPutFile: 传输完成但校验不一致
+
+/* 分段上传/下载 每个分段一个线程 一个控制连接 */
+struct ftp_segment {
+    pthread_t tid;
+    const ftp_session* parent;  // 主连接, 提供服务器地址和登录信息
+    const char* cwd;            // 主连接当前工作目录
+    const char* filename;
+    int file_fd;    // 本地文件, 各分段 pread/pwrite 各自偏移
+    long offset;    // 分段起始偏移
+    long length;    // 分段长度
+    ftp_rate* rate;  // 所有分段共享本次传输的令牌桶
+    sem_t* opened;  // 非空时, STOR 响应后通知主线程服务器文件已打开
+    ftp_stats stats;  // 分段的传输统计, 结束后合并到主连接
+    int ok;
+};
+
+static long FTPPasvSize(ftp_session* s, const char* filename, int* ftp_data_fd);
+static int FTPDataConnect(ftp_session* s);
+static int FTPSpareTake(ftp_session* s);
+static void FTPSpareClose(ftp_session* s);
+static void FTPSpareConnect(ftp_session* s);
+static void FTPTransferEnd(ftp_session* s, int ftp_data_fd, int ok);
+static int FTPBlockTake(ftp_session* s);
+static int FTPFramed(const ftp_session* s);
+static long FTPFramedSend(ftp_session* s, int data_fd, int src_fd);
+static long FTPFramedRecv(ftp_session* s, int dest_fd, int data_fd);
+static void FTPBlockClose(ftp_session* s);
+static void FTPDataRate(ftp_session* s, long nbytes, double seconds);
+
+/* ---------------------------------- */
+
+const char* skipResponseCode(const char* response) {
+    while (*response != ' ') response++;
+    return response + 1;
+}
+
+/* ---------------------------------- */
+
+/*
+    命令 "REST offset\r\n"
+*/
+int FTPRest(ftp_session* s, long int offset) {
+    sprintf(s->send_buf, "REST %ld\r\n", offset);
+    FTPCommand(s);
+    if (FTPCheckResponse(&s->reply)) {
+        printf("<< REST failed. %.*s", s->reply.len, s->reply.text);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+    命令 "PASV\r\n"
+    客户端发送命令改变FTP数据模式为被动模式
+*/
+int FTPPasv(ftp_session* s) {
+    if (s->data_mode == FTP_PORT_MODE) close(s->data_port);
+    FTPBlockClose(s);
+
+    sprintf(s->send_buf, "PASV\r\n");
+    FTPCommand(s);
+    return FTPPasvReply(s, &s->reply);
+}
+
+/*
+    解析 PASV 响应
+    "227 Entering Passive Mode (h1,h2,h3,h4,p1,p2)."
+*/
+int FTPPasvReply(ftp_session* s, const ftp_reply* reply) {
+    if (FTPCheckResponse(reply)) {
+        printf("<< PASV failed. %.*s\n", reply->len, reply->text);
+        return -1;
+    }
+    int port = -1, h1, h2, h3, h4, p1, p2;
+    if (sscanf(reply->text,
+               "%*[^(](%d,%d,%d,%d,%d,%d)",
+               &h1,
+               &h2,
+               &h3,
+               &h4,
+               &p1,
+               &p2) != 6) {
+        printf("<< PASV failed. %.*s\n", reply->len, reply->text);
+        return -1;
+    }
+    port = p1 * 256 + p2;
+
+    s->data_mode = FTP_PASV_MODE;
+    s->data_port = port;
+
+    return 0;
+}
+
+/*
+    命令 "PORT h1,h2,h3,h4,p1,p2\r\n"
+    客户端发送命令改变FTP数据模式为主动模式
+*/
+int FTPPort(ftp_session* s, const char* port_cmd) {
+    if (s->data_mode == FTP_PORT_MODE) close(s->data_port);
+    FTPSpareClose(s);
+    FTPBlockClose(s);
+
+    int h1, h2, h3, h4, p1, p2;
+    sscanf(port_cmd, "%d,%d,%d,%d,%d,%d", &h1, &h2, &h3, &h4, &p1, &p2);
+    LOGI("PORT %d,%d,%d,%d,%d,%d\n", h1, h2, h3, h4, p1, p2);
+
+    int port = p1 * 256 + p2;
+    int sock_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock_fd < 0) {
+        LOGE("[socket]\n");
+        return -1;
+    }
+
+    int opt = 1;
+    setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    struct sockaddr_in addr;
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(sock_fd, (struct sockaddr*) &addr, sizeof(addr)) == -1) {
+        LOGE("[bind]\n");
+        return -1;
+    }
+
+    if (listen(sock_fd, 64) == -1) {
+        LOGE("[listen]\n");
+        close(sock_fd);
+        return -1;
+    }
+
+    sprintf(s->send_buf, "PORT %d,%d,%d,%d,%d,%d\r\n", h1, h2, h3, h4, p1, p2);
+    FTPCommand(s);
+    if (FTPCheckResponse(&s->reply)) {
+        printf("<< PORT failed. %.*s\n", s->reply.len, s->reply.text);
+        close(sock_fd);
+        return -1;
+    }
+
+    s->data_mode = FTP_PORT_MODE;
+    s->data_port = sock_fd;
+
+    return 0;
+}
+
+/*
+    命令 "STOR filename\r\n"
+    客户端发送命令上传文件至服务器端
+*/
+int FTPStor(ftp_session* s, const char* filename) {
+    sprintf(s->send_buf, "STOR %s\r\n", filename);
+    FTPCommand(s);
+    if (FTPCheckResponse(&s->reply)) {
+        printf("<< STOR %s failed. %.*s",
+               filename,
+               s->reply.len,
+               s->reply.text);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+    命令 "APPE filename\r\n"
+    上传添加到指定文件末尾
+*/
+int FTPAppe(ftp_session* s, const char* filename) {
+    sprintf(s->send_buf, "APPE %s\r\n", filename);
+    FTPCommand(s);
+    if (FTPCheckResponse(&s->reply)) {
+        printf("<< APPE %s failed. %.*s",
+               filename,
+               s->reply.len,
+               s->reply.text);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+    命令 "RETR filename\r\n"
+    客户端发送命令从服务器端下载文件
+*/
+int FTPRetr(ftp_session* s, const char* filename) {
+    sprintf(s->send_buf, "RETR %s\r\n", filename);
+    FTPCommand(s);
+    if (FTPCheckResponse(&s->reply)) {
+        printf("<< RETR %s failed. %.*s",
+               filename,
+               s->reply.len,
+               s->reply.text);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+    命令 "CWD dirname\r\n"
+    客户端发送命令改变工作目录
+    客户端接收服务器的响应码和信息
+*/
+int FTPCd(ftp_session* s, char* dirname) {
+    // 当dirname为空时, 设置为 "."
+    if (strlen(dirname) == 0) {
+        dirname[0] = '.';
+        dirname[1] = '\0';
+    }
+    // 缓存中不存在或不是目录时不发送 CWD, 已在该目录时也不发送
+    // 不使用缓存时也记录当前目录, 之后打开缓存可以解析相对路径
+    char path[BUFF_SIZE];
+    int resolved = FTPCachePath(s, dirname, path, sizeof(path)) == 0;
+    if (resolved && s->cache) {
+        ftp_entry e;
+        int cached = FTPCacheLookup(s, path, &e);
+        if (cached == 0 || (cached == 1 && e.type != FTP_ENTRY_DIR &&
+                            e.type != FTP_ENTRY_LINK)) {
+            printf("<< CWD %s failed. Not a directory (cached).\n", dirname);
+            return -1;
+        }
+        if (strcmp(path, s->cwd) == 0) return 0;
+    }
+    sprintf(s->send_buf, "CWD %s\r\n", dirname);
+    FTPCommand(s);
+    if (FTPCheckResponse(&s->reply)) {
+        printf("<< CWD %s failed. %.*s", dirname, s->reply.len, s->reply.text);
+        return -1;
+    }
+    if (resolved) {
+        ftp_entry dir = {NULL, -1, -1, 0, FTP_ENTRY_DIR};
+        FTPCacheStore(s, path, &dir);
+        strcpy(s->cwd, path);
+    } else {
+        s->cwd[0] = '\0';  // 相对路径且原来的目录未知
+    }
+    // printf("cd %s ok.\n", dirname);
+    return 0;
+}
+
+/*
+    列表命令 cmd (不含 "\r\n"), 如 "LIST -al dirname", "MLSD dirname"
+    打开数据连接后由 recv 读取列表数据, recv 返回 -1 表示数据连接出错
+    正常为 "125 Data connection already open. Transfer starting."
+    结束为 "226 Transfer complete."
+*/
+int FTPListCommand(ftp_session* s,
+                   const char* cmd,
+                   ftp_data_recv recv,
+                   void* arg) {
+    int verb_len = strcspn(cmd, " ");
+    // 打开数据传输套接字
+    int ftp_data_fd = -1;
+    // 被动模式
+    if (s->data_mode == FTP_PASV_MODE) {
+        ftp_data_fd = FTPOpenDataSockfd(s);
+    }
+
+    snprintf(s->send_buf, BUFF_SIZE, "%s\r\n", cmd);
+    FTPCommand(s);
+    // 125 Data connection already open. Transfer starting.
+    if (FTPCheckResponse(&s->reply)) {
+        printf("<< %.*s failed. %.*s",
+               verb_len,
+               cmd,
+               s->reply.len,
+               s->reply.text);
+        close(ftp_data_fd);
+        return -1;
+    }
+
+    // 主动模式
+    if (s->data_mode == FTP_PORT_MODE) {
+        ftp_data_fd = FTPOpenDataSockfd(s);
+    }
+
+    // read data
+    long nrecv = recv(s, ftp_data_fd, arg);
+    s->stats.bytes = nrecv;
+
+    // 226 Transfer complete. 关闭或保留数据套接字
+    FTPTransferEnd(s, ftp_data_fd, nrecv >= 0);
+    // LOGI("%.*s", s->reply.len, s->reply.text);
+    if (FTPCheckResponse(&s->reply)) {
+        printf("<< %.*s failed. %.*s",
+               verb_len,
+               cmd,
+               s->reply.len,
+               s->reply.text);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* 列表数据原样写入 *(int*) arg */
+static long FTPListToFd(ftp_session* s, int data_fd, void* arg) {
+    int dest_fd = *(int*) arg;
+    return FTPFramed(s) ? FTPFramedRecv(s, dest_fd, data_fd)
+                        : FTPTransmit(s, dest_fd, data_fd);
+}
+
+int FTPList(ftp_session* s) {
+    return FTPListFd(s, "", STDOUT_FILENO);
+}
+
+/*
+    命令 "LIST -al [dirname]\r\n"
+    目录列表写入 dest_fd, dirname 为空时列出当前目录
+*/
+int FTPListFd(ftp_session* s, const char* dirname, int dest_fd) {
+    char cmd[BUFF_SIZE];
+    snprintf(cmd,
+             sizeof(cmd),
+             "LIST -al%s%.*s",
+             dirname[0] ? " " : "",
+             BUFF_SIZE - 16,
+             dirname);
+    FTPStatsBegin(s, "LIST", dirname, 0);
+    int ret = FTPListCommand(s, cmd, FTPListToFd, &dest_fd);
+    FTPStatsEnd(s, ret, s->reply.code);
+    return ret;
+}
+
+/*
+    命令 "pwd\r\n"
+    客户端发送命令获取当前所在路径
+    客户端接收服务器的响应码和信息
+*/
+int FTPPwd(ftp_session* s) {
+    sprintf(s->send_buf, "PWD\r\n");
+    FTPCommand(s);
+    if (FTPCheckResponse(&s->reply)) {
+        printf("<< PWD failed. %.*s", s->reply.len, s->reply.text);
+        return -1;
+    }
+    // 去除开头的response code
+    const char* path = skipResponseCode(s->reply.text);
+    printf("%.*s", (int) (s->reply.text + s->reply.len - path), path);
+    // printf("PWD ok.\n");
+    return 0;
+}
+
+/*
+    命令 "MKD dirname\r\n"
+    创建目录
+*/
+int FTPMkdir(ftp_session* s, const char* dirname) {
+    sprintf(s->send_buf, "MKD %s\r\n", dirname);
+    FTPCommand(s);
+    if (FTPCheckResponse(&s->reply)) {
+        printf("<< MKD %s failed. %.*s", dirname, s->reply.len, s->reply.text);
+        return -1;
+    }
+    // 新目录为空
+    FTPCacheListed(s, dirname, FTPCacheMark(s), FTPNow());
+    return 0;
+}
+
+/*
+    缓存中的文件大小, 命中返回 1, *size 为 -1 表示已知不存在
+    目录或大小未知时返回 0, 需要发送 SIZE
+*/
+static int FTPCachedSize(ftp_session* s, const char* filename, long* size) {
+    ftp_entry e;
+    switch (FTPCacheLookup(s, filename, &e)) {
+    case 0:
+        *size = -1;
+        return 1;
+    case 1:
+        if (e.type == FTP_ENTRY_FILE && e.size >= 0) {
+            *size = e.size;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void FTPCacheSize(ftp_session* s, const char* filename, long size) {
+    ftp_entry e = {NULL, size, -1, 0, FTP_ENTRY_FILE};
+    FTPCacheStore(s, filename, &e);
+}
+
+/*
+    命令 "SIZE filename\r\n", 不查缓存
+    续传的偏移必须来自服务器的响应, 缓存中的大小可能已过期
+*/
+static long FTPSizeCommand(ftp_session* s, const char* filename) {
+    sprintf(s->send_buf, "SIZE %s\r\n", filename);
+    FTPCommand(s);
+    if (FTPCheckResponse(&s->reply)) {
+        printf("<< SIZE %s failed. %.*s",
+               filename,
+               s->reply.len,
+               s->reply.text);
+        return -1;
+    }
+    // ASCII 模式下服务器返回的大小可能不同, 只缓存二进制模式的大小
+    long size = atol(skipResponseCode(s->reply.text));
+    if (s->trans_type == FTP_TYPE_BINARY) FTPCacheSize(s, filename, size);
+    return size;
+}
+
+/*
+    命令 "SIZE filename\r\n"
+    客户端发送命令从服务器端得到下载文件的大小
+    客户端接收服务器的响应码和信息，正常为 "213 <size>"
+*/
+long FTPSize(ftp_session* s, const char* filename) {
+    long size;
+    if (s->trans_type == FTP_TYPE_BINARY &&
+        FTPCachedSize(s, filename, &size)) {
+        if (size == -1) {
+            printf("<< SIZE %s failed. No such file (cached).\n", filename);
+        }
+        return size;
+    }
+    return FTPSizeCommand(s, filename);
+}
+
+/*
+    命令 "MDTM filename\r\n"
+    响应 "213 YYYYMMDDhhmmss[.sss]" (UTC), 返回修改时间, 失败返回 -1
+*/
+time_t FTPMdtm(ftp_session* s, const char* filename) {
+    sprintf(s->send_buf, "MDTM %s\r\n", filename);
+    FTPCommand(s);
+    if (FTPCheckResponse(&s->reply)) {
+        printf("<< MDTM %s failed. %.*s",
+               filename,
+               s->reply.len,
+               s->reply.text);
+        return -1;
+    }
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    if (sscanf(skipResponseCode(s->reply.text),
+               "%4d%2d%2d%2d%2d%2d",
+               &tm.tm_year,
+               &tm.tm_mon,
+               &tm.tm_mday,
+               &tm.tm_hour,
+               &tm.tm_min,
+               &tm.tm_sec) != 6) {
+        return -1;
+    }
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    return timegm(&tm);
+}
+
+/*
+    命令 "TYPE I\r\n" + "SIZE filename\r\n" 流水线发送
+    部分服务器在 ASCII 模式下拒绝 SIZE, 先切换为二进制模式
+*/
+long FTPBinarySize(ftp_session* s, const char* filename) {
+    long size;
+    if (FTPCachedSize(s, filename, &size)) {
+        if (size == -1) {
+            printf("<< SIZE %s failed. No such file (cached).\n", filename);
+        }
+        return size;
+    }
+    ftp_reply replies[2];
+    sprintf(s->send_buf, "TYPE I\r\nSIZE %s\r\n", filename);
+    switch (FTPPipeline(s, 2, replies)) {
+    case 0:
+        printf("<< TYPE I failed. %.*s", replies[0].len, replies[0].text);
+        return -1;
+    case 1:
+        s->trans_type = FTP_TYPE_BINARY;
+        printf("<< SIZE %s failed. %.*s",
+               filename,
+               replies[1].len,
+               replies[1].text);
+        return -1;
+    }
+    s->trans_type = FTP_TYPE_BINARY;
+    size = atol(skipResponseCode(replies[1].text));
+    FTPCacheSize(s, filename, size);
+    return size;
+}
+
+/*
+    命令 "DELE filename\r\n"
+    创建目录
+*/
+int FTPDele(ftp_session* s, const char* filename) {
+    sprintf(s->send_buf, "DELE %s\r\n", filename);
+    FTPCommand(s);
+    if (FTPCheckResponse(&s->reply)) {
+        printf("<< DELE %s failed. %.*s",
+               filename,
+               s->reply.len,
+               s->reply.text);
+        return -1;
+    }
+    FTPCacheStore(s, filename, NULL);
+    return 0;
+}
+
+/*
+    命令 "RMD dirname\r\n"
+    创建目录
+*/
+int FTPRmd(ftp_session* s, const char* dirname) {
+    sprintf(s->send_buf, "RMD %s\r\n", dirname);
+    FTPCommand(s);
+    if (FTPCheckResponse(&s->reply)) {
+        printf("<< RMD %s failed. %.*s", dirname, s->reply.len, s->reply.text);
+        return -1;
+    }
+    FTPCacheStore(s, dirname, NULL);
+    return 0;
+}
+
+/*
+    命令 "RNFR oldfilename\r\n"
+    响应 "350 Ready for destination name."
+    命令 "RNTO newfilename\r\n"
+    响应 "250 Renaming ok."
+    重新命名filename
+*/
+int FTPRename(ftp_session* s,
+              const char* oldfilename,
+              const char* newfilename) {
+    // RNFR 失败时服务器以 503 拒绝 RNTO, 可流水线发送
+    ftp_reply replies[2];
+    sprintf(s->send_buf, "RNFR %s\r\nRNTO %s\r\n", oldfilename, newfilename);
+    switch (FTPPipeline(s, 2, replies)) {
+    case 0:
+        printf("<< RNFR %s failed. %.*s",
+               oldfilename,
+               replies[0].len,
+               replies[0].text);
+        return -1;
+    case 1:
+        printf("<< RNTO %s failed. %.*s",
+               newfilename,
+               replies[1].len,
+               replies[1].text);
+        return -1;
+    }
+    FTPCacheRename(s, oldfilename, newfilename);
+    return 0;
+}
+
+/*
+    命令 "TYPE A\r\n"
+    客户端与服务端将改变传输模式为ASCII模式
+    客户端接收服务器的响应码
+    正常为 "200 Type set to: Ascii."
+*/
+int FTPAscii(ftp_session* s) {
+    sprintf(s->send_buf, "TYPE A\r\n");
+    FTPCommand(s);
+    if (FTPCheckResponse(&s->reply)) {
+        printf("<< TYPE A failed. %.*s", s->reply.len, s->reply.text);
+        return -1;
+    }
+    s->trans_type = FTP_TYPE_ASCII;
+    if (s->verify) printf("Transfers in ASCII mode are not verified.\n");
+    return 0;
+}
+
+/*
+    命令 "TYPE I\r\n"
+    客户端与服务端将改变传输模式为二进制模式
+    客户端接收服务器的响应码
+    正常为 "200 Type set to: Binary."
+*/
+int FTPBinary(ftp_session* s) {
+    sprintf(s->send_buf, "TYPE I\r\n");
+    FTPCommand(s);
+    if (FTPCheckResponse(&s->reply)) {
+        printf("<< TYPE I failed. %.*s", s->reply.len, s->reply.text);
+        return -1;
+    }
+    s->trans_type = FTP_TYPE_BINARY;
+    return 0;
+}
+
+/*
+    命令 "QUIT\r\n"
+    客户端将断开与服务器端的连接
+    客户端接收服务器的响应码
+    正常为 "221 Goodbye."
+*/
+int FTPQuit(ftp_session* s) {
+    sprintf(s->send_buf, "QUIT\r\n");
+    FTPCommand(s);
+    if (FTPCheckResponse(&s->reply)) {
+        printf("<< QUIT failed. %.*s", s->reply.len, s->reply.text);
+        return -1;
+    }
+    const char* msg = skipResponseCode(s->reply.text);
+    printf("%.*s", (int) (s->reply.text + s->reply.len - msg), msg);
+    /* 客户端关闭控制连接 */
+    FTPSpareClose(s);
+    FTPBlockClose(s);
+    close(s->ctl_fd);
+    return 0;
+}
+
+/*
+    FEAT 响应中以 feature 开头的一行, 每个特性占一行, 以空格开头
+    返回 feature 之后到行尾的部分, *len 为其长度, 没有时返回 NULL
+*/
+static const char* FTPFeatFind(const ftp_reply* reply,
+                               const char* feature,
+                               int* len) {
+    const char* line = reply->text;
+    const char* end = reply->text + reply->len;
+    size_t nfeature = strlen(feature);
+    while ((line = memchr(line, '\n', end - line)) != NULL) {
+        line++;
+        while (line < end && *line == ' ') line++;
+        if (end - line >= (long) nfeature &&
+            strncasecmp(line, feature, nfeature) == 0) {
+            line += nfeature;
+            *len = strcspn(line, "\r\n");
+            return line;
+        }
+    }
+    return NULL;
+}
+
+/*
+    命令 "FEAT\r\n"
+    响应为多行 "211-Features:" ... "211 End"
+    服务器支持 feature 返回 1, 不支持返回 0, 出错返回 -1
+*/
+int FTPFeat(ftp_session* s, const char* feature) {
+    sprintf(s->send_buf, "FEAT\r\n");
+    FTPCommand(s);
+    if (FTPCheckResponse(&s->reply)) {
+        printf("<< FEAT failed. %.*s", s->reply.len, s->reply.text);
+        return -1;
+    }
+    int len;
+    return FTPFeatFind(&s->reply, feature, &len) != NULL;
+}
+
+/* ---------------------------------- */
+
+/*
+    命令 "setlimit %d"
+    <=0 不限速 单位 KB/s
+*/
+void FTPSetRateLimit(ftp_session* s, double ftp_rate_limit_kb) {
+    if (ftp_rate_limit_kb < 0) {
+        s->bytes_per_sec = -1;
+    } else {
+        s->bytes_per_sec = (int) (ftp_rate_limit_kb * 1024);
+    }
+}
+
+/*
+    检查返回值
+    判断命令是否正确执行
+*/
+int FTPCheckResponse(const ftp_reply* reply) {
+    // printf("<< check: %.*s", reply->len, reply->text);
+    if (reply->code >= 100 && reply->code < 300) {
+        // 202 Command not implemented, superfluous at this site.
+        if (reply->code == 202) return 1;
+        return 0;
+    } else {
+        // 350 Requested file action pending further information U
+        if (reply->code == 350) return 0;
+        return 1;
+    }
+}
+
+/*
+    命令 "buffer %d"
+    数据连接每次 read/write 的块大小, 单位 KB, <=0 恢复默认 256KB
+*/
+void FTPSetDataBuffer(ftp_session* s, int size) {
+    if (size <= 0) size = FTP_DATA_BUFF_SIZE;
+    if (size < BUFF_SIZE) size = BUFF_SIZE;
+    if (size > FTP_DATA_BUFF_MAX) size = FTP_DATA_BUFF_MAX;
+    s->data_buf_size = size;
+}
+
+/*
+    src_fd 传输数据到 dest_fd
+    每次读写 data_buf_size 字节, 返回传输的字节数, 分配缓冲区失败返回 -1
+*/
+long FTPTransmit(ftp_session* s, int dest_fd, int src_fd) {
+    char* trans_buf = (char*) malloc(s->data_buf_size);
+    if (trans_buf == NULL) {
+        LOGE("malloc error.\n");
+        return -1;
+    }
+    ftp_rate local_rate;
+    ftp_rate* rate = FTPSessionRate(s, &local_rate);
+    ftp_stats* st = &s->stats;
+    int src_net = FTPStatsIsNet(src_fd);
+    int dest_net = FTPStatsIsNet(dest_fd);
+    long total_trans_bytes = 0;
+    ssize_t nread;
+    double t = FTPNow();
+    // 客户端通过数据连接 从服务器接收文件内容
+    while ((nread = read(src_fd,
+                         trans_buf,
+                         FTPRateChunk(rate, s->data_buf_size))) > 0) {
+        t = FTPStatsIo(st, src_net, t);
+        FTPHashUpdate(&s->hash, trans_buf, nread);
+        /* 客户端写文件 */
+        if (write(dest_fd, trans_buf, nread) < 0) {
+            LOGE("write error.\n");
+        }
+        FTPStatsIo(st, dest_net, t);
+        total_trans_bytes += nread;
+        st->rate_wait += FTPRateConsume(rate, nread);
+        t = FTPNow();
+    }
+    FTPStatsIo(st, src_net, t);
+    free(trans_buf);
+    return total_trans_bytes;
+}
+
+/* 块模式和压缩模式的数据需要在用户态分块或压缩 */
+static int FTPFramed(const ftp_session* s) {
+    return s->block_mode || s->deflate;
+}
+
+static long FTPFramedSend(ftp_session* s, int data_fd, int src_fd) {
+    return s->deflate ? FTPDeflateSend(s, data_fd, src_fd)
+                      : FTPBlockSend(s, data_fd, src_fd);
+}
+
+static long FTPFramedRecv(ftp_session* s, int dest_fd, int data_fd) {
+    return s->deflate ? FTPInflateRecv(s, dest_fd, data_fd)
+                      : FTPBlockRecv(s, dest_fd, data_fd);
+}
+
+/*
+    零拷贝和 io_uring 的数据不经过用户态缓冲区, 校验时需要计算摘要, 不能使用
+*/
+static int FTPZeroCopyUsable(const ftp_session* s) {
+    return s->zero_copy && s->trans_type == FTP_TYPE_BINARY && !s->hash.algo;
+}
+
+/*
+    io_uring 的读写由内核完成, 不经过令牌桶, 只在不限速的二进制传输中使用
+*/
+static int FTPUringUsable(ftp_session* s) {
+    return s->uring && s->trans_type == FTP_TYPE_BINARY && !s->hash.algo &&
+           s->bytes_per_sec <= 0 && FTPRateChunk(NULL, LONG_MAX) == LONG_MAX;
+}
+
+/*
+    src_fd (文件) 通过 sendfile 零拷贝传输数据到 dest_fd (socket)
+    从文件当前偏移处开始发送, 支持断点续传
+    返回传输的字节数, 内核不支持时返回 -1, 由调用者回退到 FTPTransmit
+*/
+long FTPSendfile(ftp_session* s, int dest_fd, int src_fd) {
+    ftp_rate local_rate;
+    ftp_rate* rate = FTPSessionRate(s, &local_rate);
+    ftp_stats* st = &s->stats;
+    int64_t total_trans_bytes = 0;
+    ssize_t nsent;
+    while (1) {
+        // sendfile 同时读文件和写 socket, 计入网络时间
+        double t = FTPNow();
+        nsent = sendfile(
+                dest_fd, src_fd, NULL, FTPRateChunk(rate, SENDFILE_MAX));
+        FTPStatsIo(st, 1, t);
+        if (nsent < 0) {
+            if (errno == EINTR) continue;
+            // 还未发送任何数据 回退到 read/write
+            if (total_trans_bytes == 0 &&
+                (errno == EINVAL || errno == ENOSYS)) {
+                return -1;
+            }
+            LOGE("sendfile error.\n");
+            break;
+        }
+        if (nsent == 0) break;
+        total_trans_bytes += nsent;
+        st->rate_wait += FTPRateConsume(rate, nsent);
+    }
+    return total_trans_bytes;
+}
+
+/*
+    src_fd (socket) 通过 splice 经管道零拷贝传输数据到 dest_fd (文件)
+    写入文件当前偏移处, dest_fd 不能以 O_APPEND 打开
+    返回传输的字节数, 内核不支持时返回 -1, 由调用者回退到 FTPTransmit
+*/
+long FTPSplice(ftp_session* s, int dest_fd, int src_fd) {
+    int pipe_fd[2];
+    if (pipe(pipe_fd) < 0) {
+        LOGE("pipe error.\n");
+        return -1;
+    }
+    // 增大管道 减少 splice 调用次数, 失败则使用默认大小
+    int pipe_size = fcntl(pipe_fd[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+    if (pipe_size <= 0) pipe_size = fcntl(pipe_fd[1], F_GETPIPE_SZ);
+
+    ftp_rate local_rate;
+    ftp_rate* rate = FTPSessionRate(s, &local_rate);
+    ftp_stats* st = &s->stats;
+    int flag = 0;  // 跳出循环标志
+    int64_t total_trans_bytes = 0;
+    ssize_t nread, nwrite;
+    while (!flag) {
+        double t = FTPNow();
+        nread = splice(src_fd,
+                       NULL,
+                       pipe_fd[1],
+                       NULL,
+                       FTPRateChunk(rate, pipe_size),
+                       SPLICE_F_MOVE | SPLICE_F_MORE);
+        t = FTPStatsIo(st, 1, t);
+        if (nread < 0) {
+            if (errno == EINTR) continue;
+            // 还未接收任何数据 回退到 read/write
+            if (total_trans_bytes == 0 &&
+                (errno == EINVAL || errno == ENOSYS)) {
+                close(pipe_fd[0]);
+                close(pipe_fd[1]);
+                return -1;
+            }
+            LOGE("splice error.\n");
+            break;
+        }
+        if (nread == 0) break;
+        total_trans_bytes += nread;
+        st->rate_wait += FTPRateConsume(rate, nread);
+        t = FTPNow();
+        /* 管道数据写入文件 */
+        while (nread > 0) {
+            nwrite = splice(
+                    pipe_fd[0], NULL, dest_fd, NULL, nread, SPLICE_F_MOVE);
+            t = FTPStatsIo(st, 0, t);
+            if (nwrite < 0 && errno == EINTR) continue;
+            if (nwrite <= 0) {
+                LOGE("write error.\n");
+                flag = 1;
+                break;
+            }
+            nread -= nwrite;
+        }
+    }
+    close(pipe_fd[0]);
+    close(pipe_fd[1]);
+    return total_trans_bytes;
+}
+
+/*
+    服务器计算 filename 的摘要与本地的 hex 比较
+    HASH 响应 "213 SHA-256 0-49 <hex> filename", XCRC 响应 "250 <hex>"
+    一致返回 0, 不一致返回 1, 服务器不能计算返回 -1
+*/
+static int FTPVerifyRemote(ftp_session* s,
+                           const char* filename,
+                           const char* hex) {
+    const char* cmd = s->verify_xcrc ? "XCRC" : "HASH";
+    sprintf(s->send_buf, "%s %s\r\n", cmd, filename);
+    FTPCommand(s);
+    if (FTPCheckResponse(&s->reply)) {
+        printf("<< %s %s failed. %.*s",
+               cmd,
+               filename,
+               s->reply.len,
+               s->reply.text);
+        return -1;
+    }
+    const char* p = skipResponseCode(s->reply.text);
+    int skip = s->verify_xcrc ? 0 : 2;  // HASH 先跳过算法名和范围
+    int n;
+    while (1) {
+        p += strspn(p, " ");
+        n = strcspn(p, " \r\n");
+        if (skip-- == 0) break;
+        p += n;
+    }
+    char remote[FTP_HASH_HEX];
+    if (n == 0 || n >= (int) sizeof(remote)) {
+        printf("<< %s %s failed. %.*s",
+               cmd,
+               filename,
+               s->reply.len,
+               s->reply.text);
+        return -1;
+    }
+    memcpy(remote, p, n);
+    remote[n] = '\0';
+    // CRC32 可能省略前导零
+    if (s->verify == FTP_HASH_CRC32) {
+        return strtoul(remote, NULL, 16) != strtoul(hex, NULL, 16);
+    }
+    return strcasecmp(remote, hex) != 0;
+}
+
+/*
+    开始校验: 二进制传输时在传输循环中计算摘要
+    续传时文件 fd 中已有的 offset 字节先从本地读取
+*/
+static void FTPVerifyBegin(ftp_session* s, int fd, long offset) {
+    if (!s->verify || s->trans_type != FTP_TYPE_BINARY) return;
+    FTPHashInit(&s->hash, s->verify);
+    if (offset > 0 && FTPHashFile(&s->hash, fd, 0, offset) == -1) {
+        LOGW("read %ld bytes for verify failed, not verified.\n", offset);
+        s->hash.algo = 0;
+    }
+}
+
+/* 传输成功后比较摘要, 不一致返回 FTP_VERIFY_MISMATCH */
+static int FTPVerifyEnd(ftp_session* s, const char* remote) {
+    if (!s->hash.algo) return 0;
+    char hex[FTP_HASH_HEX];
+    FTPHashHex(&s->hash, hex);
+    s->hash.algo = 0;
+    if (FTPVerifyRemote(s, remote, hex) != 1) return 0;
+    printf("<< %s %s mismatch.\n", FTPHashName(s->verify), remote);
+    return FTP_VERIFY_MISMATCH;
+}
+
+/*
+    本地文件 fd 与远程文件大小相同, 开启校验时读取整个本地文件比较摘要
+    不一致返回 1, 一致或不能校验返回 0 (按大小相同处理)
+*/
+static int FTPVerifyExisting(ftp_session* s, int fd, const char* remote) {
+    if (!s->verify || s->trans_type != FTP_TYPE_BINARY) return 0;
+    ftp_hash h;
+    char hex[FTP_HASH_HEX];
+    FTPHashInit(&h, s->verify);
+    if (FTPHashFile(&h, fd, 0, -1) == -1) {
+        LOGW("read for verify failed.\n");
+        return 0;
+    }
+    FTPHashHex(&h, hex);
+    return FTPVerifyRemote(s, remote, hex) == 1;
+}
+
+/*
+    本地文件 local 与远程文件 remote 大小相同, 开启校验时比较摘要
+    不一致返回 1, 一致, 未开启校验或不能校验返回 0
+*/
+int FTPVerifyDiffers(ftp_session* s, const char* local, const char* remote) {
+    if (!s->verify || s->trans_type != FTP_TYPE_BINARY) return 0;
+    int fd = open(local, O_RDONLY);
+    if (fd < 0) {
+        LOGW("open %s for verify failed.\n", local);
+        return 0;
+    }
+    int ret = FTPVerifyExisting(s, fd, remote);
+    close(fd);
+    return ret;
+}
+
+/*
+    被动模式下 "PASV" 与 "SIZE filename" 流水线发送, 并打开数据连接
+    返回服务器文件大小, 不存在返回 -1
+    *ftp_data_fd 为数据连接, PASV 失败时为 -1
+*/
+static long FTPPasvSize(ftp_session* s,
+                        const char* filename,
+                        int* ftp_data_fd) {
+    ftp_reply replies[2];
+    double start = FTPNow();
+    *ftp_data_fd = FTPBlockTake(s);
+    if (*ftp_data_fd < 0) *ftp_data_fd = FTPSpareTake(s);
+    if (*ftp_data_fd >= 0) {
+        // 已有块模式保留或预先打开的数据连接, 只需 SIZE
+        FTPHistRecord("DATA", FTPNow() - start);
+        sprintf(s->send_buf, "SIZE %s\r\n", filename);
+        FTPPipeline(s, 1, &replies[1]);
+    } else {
+        sprintf(s->send_buf, "PASV\r\nSIZE %s\r\n", filename);
+        FTPPipeline(s, 2, replies);
+        if (FTPPasvReply(s, &replies[0]) == 0) {
+            *ftp_data_fd = FTPDataConnect(s);
+            if (*ftp_data_fd >= 0) FTPHistRecord("DATA", FTPNow() - start);
+        }
+    }
+    if (FTPCheckResponse(&replies[1])) {
+        printf("<< SIZE %s failed. %.*s",
+               filename,
+               replies[1].len,
+               replies[1].text);
+        return -1;
+    }
+    return atol(skipResponseCode(replies[1].text));
+}
+
+static int FTPPutFile(ftp_session* s,
+                      const char* filename,
+                      const char* newfilename) {
+    // 检查本地文件是否存在
+    if (access(filename, F_OK) < 0) {
+        printf("%s No such file or directory.\n", filename);
+        return -1;
+    }
+
+    // 未给出上传后新的文件名则使用源文件名
+    if (strlen(newfilename) == 0) {
+        newfilename = filename;
+    }
+
+    /* 客户端打开文件并判断是否断点续传 */
+    int file_handle = open(filename, O_RDONLY, 0);
+    if (file_handle < 0) {
+        LOGE("open error!\n");
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(file_handle, &st) == -1) {
+        LOGE("fstat failed.\n");
+        close(file_handle);
+        return -1;
+    }
+    long int offset = st.st_size;
+
+    // 打开传输fd
+    int ftp_data_fd = -1;
+    long int ftp_file_size = -1;
+
+    // 被动模式 每次传输都需要重新打开, PASV 与 SIZE 流水线发送
+    // 缓存中的远程大小可能已过期, 只用于判断不存在, 相同或覆盖上传,
+    // 本地文件更大需要续传时发送 SIZE, APPE 的偏移以服务器响应为准
+    int cached = FTPCachedSize(s, newfilename, &ftp_file_size) &&
+                 (ftp_file_size == -1 || offset <= ftp_file_size);
+    if (cached) {
+        if (s->data_mode == FTP_PASV_MODE) {
+            ftp_data_fd = FTPOpenDataSockfd(s);
+        }
+    } else if (s->data_mode == FTP_PASV_MODE) {
+        ftp_file_size = FTPPasvSize(s, newfilename, &ftp_data_fd);
+    } else {
+        ftp_file_size = FTPSizeCommand(s, newfilename);
+    }
+    if (ftp_file_size != -1) {
+        // 存在文件 断点续传
+        int err = 0;     // 错误标示
+        int resume = 0;  // 恢复到覆盖上传模式
+        if (offset == ftp_file_size &&
+            !FTPVerifyExisting(s, file_handle, newfilename)) {
+            // 文件大小相同认为文件相同, 开启校验时摘要也相同
+            printf("File exists.\n");
+            err = 1;
+        } else if (offset <= ftp_file_size) {
+            // 不相同文件 需要覆盖 (大小相同但摘要不同时也覆盖)
+            // 传输上传文件指令 STOR
+            if (offset == ftp_file_size) {
+                printf("%s differs from the server, uploading again.\n",
+                       filename);
+            }
+            resume = 1;
+
+            if (!err && FTPStor(s, newfilename) == -1) {
+                err = 1;
+            }
+        }
+        // 定位本地文件offset到续传处, 覆盖时从头上传
+        long pos = resume ? 0 : ftp_file_size;
+        if (!err && lseek(file_handle, pos, SEEK_SET) == -1) {
+            LOGE("lseek error.\n");
+            err = 1;
+        }
+        if (!resume) {
+            snprintf(s->stats.cmd, sizeof(s->stats.cmd), "APPE");
+            s->stats.offset = ftp_file_size;
+        }
+        // 如果断点续传失败 则取消下载
+        if (!err && !resume && FTPAppe(s, newfilename) == -1) {
+            printf("APPE %s resume from break-point failed.\n",
+                   newfilename);
+            err = 1;
+        }
+
+        if (err && !resume) {
+            if (ftp_data_fd != -1) close(ftp_data_fd);
+            close(file_handle);
+            return -1;
+        }
+    } else {
+        // 不存在文件
+        // 传输上传文件指令 STOR
+        if (FTPStor(s, newfilename) == -1) {
+            if (ftp_data_fd != -1) close(ftp_data_fd);
+            close(file_handle);
+            return -1;
+        }
+    }
+
+    // 主动模式
+    if (s->data_mode == FTP_PORT_MODE) {
+        ftp_data_fd = FTPOpenDataSockfd(s);
+    }
+
+    // 二进制模式使用 io_uring 或 sendfile 零拷贝上传, ASCII 模式或不支持时回退
+    // 块模式和压缩模式需要在用户态处理数据, 不使用零拷贝
+    FTPVerifyBegin(s, file_handle, s->stats.offset);
+    double start = FTPNow();
+    long nsent = -1;
+    int ok = 1;
+    if (FTPFramed(s)) {
+        nsent = FTPFramedSend(s, ftp_data_fd, file_handle);
+        ok = nsent >= 0;
+    } else if (FTPUringUsable(s)) {
+        nsent = FTPUringTransmit(s, ftp_data_fd, file_handle);
+    }
+    if (nsent == -1 && ok && FTPZeroCopyUsable(s)) {
+        nsent = FTPSendfile(s, ftp_data_fd, file_handle);
+    }
+    if (nsent == -1 && ok) nsent = FTPTransmit(s, ftp_data_fd, file_handle);
+    FTPDataRate(s, nsent, FTPNow() - start);
+    s->stats.bytes = nsent;
+
+    /* 客户端关闭文件 */
+    close(file_handle);
+
+    // 226 Transfer complete. 关闭或保留数据传输套接字
+    FTPTransferEnd(s, ftp_data_fd, ok);
+    // LOGI("%.*s", s->reply.len, s->reply.text);
+    if (FTPCheckResponse(&s->reply)) {
+        printf("<< PUT %s failed. %.*s",
+               newfilename,
+               s->reply.len,
+               s->reply.text);
+        return -1;
+    }
+
+    // printf("put ok.\n");
+    return FTPVerifyEnd(s, newfilename);
+}
+
+int FTPPut(ftp_session* s, const char* filename, const char* newfilename) {
+    const char* remote = strlen(newfilename) ? newfilename : filename;
+    FTPStatsBegin(s, "STOR", remote, 0);
+    int ret = FTPPutFile(s, filename, newfilename);
+    // 校验不一致时删除远程文件重新上传, 不会被当作续传
+    int retries = FTP_VERIFY_RETRIES;
+    while (ret == FTP_VERIFY_MISMATCH && retries-- > 0) {
+        FTPDele(s, remote);
+        s->stats.offset = 0;
+        ret = FTPPutFile(s, filename, newfilename);
+    }
+    s->hash.algo = 0;
+    if (ret == FTP_VERIFY_MISMATCH) ret = -1;
+    // 续传时远程大小为续传偏移加上本次发送的字节数
+    // ASCII 模式下远程大小不确定, 失败时可能留下不完整的文件
+    if (ret == 0 && s->trans_type == FTP_TYPE_BINARY) {
+        FTPCacheSize(s, remote, s->stats.offset + s->stats.bytes);
+    } else {
+        FTPCacheForget(s, remote);
+    }
+    FTPStatsEnd(s, ret, s->reply.code);
+    return ret;
+}
+
+static int FTPGetFile(ftp_session* s,
+                      const char* filename,
+                      const char* newfilename) {
+    // 下载文件是否重命名
+    if (strlen(newfilename) == 0) {
+        newfilename = filename;
+    }
+    struct stat st;
+    long local_size = stat(newfilename, &st) == 0 ? st.st_size : -1;
+
+    // 打开传输fd
+    int ftp_data_fd = -1;
+    long int ftp_file_size = -1;
+
+    // 被动模式 每次传输都需要重新打开, PASV 与 SIZE 流水线发送
+    // 缓存中有远程文件大小 (如 mget 刚列出的目录) 时不发送 SIZE,
+    // 缓存可能已过期, 本地文件大小不同需要续传时仍发送 SIZE
+    int cached = FTPCachedSize(s, filename, &ftp_file_size) &&
+                 (ftp_file_size == -1 || local_size == -1 ||
+                  local_size == ftp_file_size);
+    if (cached) {
+        if (ftp_file_size == -1) {
+            printf("<< SIZE %s failed. No such file (cached).\n", filename);
+        } else if (s->data_mode == FTP_PASV_MODE) {
+            ftp_data_fd = FTPOpenDataSockfd(s);
+        }
+    } else if (s->data_mode == FTP_PASV_MODE) {
+        ftp_file_size = FTPPasvSize(s, filename, &ftp_data_fd);
+    } else {
+        ftp_file_size = FTPSizeCommand(s, filename);
+    }
+    if (ftp_file_size == -1) {
+        if (ftp_data_fd != -1) close(ftp_data_fd);
+        return -1;
+    }
+
+    int file_handle = -1;
+    if (local_size != -1) {
+        // 如果文件存在 断点续传
+        // 不使用 O_APPEND (splice 不支持), 由 lseek 定位到文件末尾
+        // 校验时需要读取已有的部分
+        file_handle = open(newfilename, s->verify ? O_RDWR : O_WRONLY);
+        if (file_handle < 0) {
+            LOGE("open error!\n");
+            if (ftp_data_fd != -1) close(ftp_data_fd);
+            return -1;
+        }
+        int err = 0;  // 错误标示
+        long int offset = 0;
+        if ((offset = lseek(file_handle, 0, SEEK_END)) != -1) {
+            if (offset == ftp_file_size &&
+                FTPVerifyExisting(s, file_handle, filename)) {
+                // 大小相同但摘要不同, 重新下载整个文件
+                printf("%s differs from the server, downloading again.\n",
+                       newfilename);
+                if (ftruncate(file_handle, 0) == -1 ||
+                    (offset = lseek(file_handle, 0, SEEK_SET)) != 0) {
+                    LOGE("truncate failed.\n");
+                    err = 1;
+                }
+            } else if (offset == ftp_file_size) {
+                printf("File exists.\n");
+                err = 1;
+            }
+            s->stats.offset = offset;
+            // 如果断点续传失败 则取消下载
+            if (!err && FTPRest(s, offset) == -1) {
+                printf("STOR %s resume from break-point failed.\n",
+                       newfilename);
+                err = 1;
+            }
+        } else {
+            err = 1;
+            LOGE("lseek failed.\n");
+        }
+        if (err) {
+            if (ftp_data_fd != -1) close(ftp_data_fd);
+            close(file_handle);
+            return -1;
+        }
+    } else {
+        file_handle = open(newfilename, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+        if (file_handle < 0) {
+            LOGE("open error!\n");
+            if (ftp_data_fd != -1) close(ftp_data_fd);
+            return -1;
+        }
+    }
+
+    // 传输下载文件指令 RETR
+    if (FTPRetr(s, filename) == -1) {
+        if (ftp_data_fd != -1) close(ftp_data_fd);
+        close(file_handle);
+        return -1;
+    }
+
+    // 主动模式
+    if (s->data_mode == FTP_PORT_MODE) {
+        ftp_data_fd = FTPOpenDataSockfd(s);
+    }
+
+    // 二进制模式使用 io_uring 或 splice 零拷贝下载, ASCII 模式或不支持时回退
+    // 块模式和压缩模式需要在用户态处理数据, 不使用零拷贝
+    FTPVerifyBegin(s, file_handle, s->stats.offset);
+    double start = FTPNow();
+    long nrecv = -1;
+    int ok = 1;
+    if (FTPFramed(s)) {
+        nrecv = FTPFramedRecv(s, file_handle, ftp_data_fd);
+        ok = nrecv >= 0;
+    } else if (FTPUringUsable(s)) {
+        nrecv = FTPUringTransmit(s, file_handle, ftp_data_fd);
+    }
+    if (nrecv == -1 && ok && FTPZeroCopyUsable(s)) {
+        nrecv = FTPSplice(s, file_handle, ftp_data_fd);
+    }
+    if (nrecv == -1 && ok) nrecv = FTPTransmit(s, file_handle, ftp_data_fd);
+    FTPDataRate(s, nrecv, FTPNow() - start);
+    s->stats.bytes = nrecv;
+
+    // 客户端关闭文件
+    close(file_handle);
+
+    // 226 Transfer complete. 关闭或保留数据套接字
+    FTPTransferEnd(s, ftp_data_fd, ok);
+    // LOGI("%.*s", s->reply.len, s->reply.text);
+    if (FTPCheckResponse(&s->reply)) {
+        printf("<< Get failed. %.*s", s->reply.len, s->reply.text);
+        return -1;
+    }
+
+    // printf("get ok.\n");
+    return FTPVerifyEnd(s, filename);
+}
+
+int FTPGet(ftp_session* s, const char* filename, const char* newfilename) {
+    FTPStatsBegin(s, "RETR", filename, 0);
+    int ret = FTPGetFile(s, filename, newfilename);
+    // 校验不一致时删除本地文件重新下载
+    int retries = FTP_VERIFY_RETRIES;
+    while (ret == FTP_VERIFY_MISMATCH && retries-- > 0) {
+        unlink(strlen(newfilename) ? newfilename : filename);
+        s->stats.offset = 0;
+        ret = FTPGetFile(s, filename, newfilename);
+    }
+    s->hash.algo = 0;
+    if (ret == FTP_VERIFY_MISMATCH) ret = -1;
+    FTPStatsEnd(s, ret, s->reply.code);
+    return ret;
+}
+
+/*
+    获取当前工作目录 "257 "/path" is current directory."
+    去掉引号后写入 cwd
+*/
+int FTPGetCwd(ftp_session* s, char* cwd, int size) {
+    sprintf(s->send_buf, "PWD\r\n");
+    FTPCommand(s);
+    if (FTPCheckResponse(&s->reply)) {
+        printf("<< PWD failed. %.*s", s->reply.len, s->reply.text);
+        return -1;
+    }
+    const char* begin = memchr(s->reply.text, '"', s->reply.len);
+    const char* end = NULL;
+    if (begin) {
+        end = memrchr(begin + 1, '"', s->reply.text + s->reply.len - begin - 1);
+    }
+    if (!end || end - begin - 1 >= size) return -1;
+    memcpy(cwd, begin + 1, end - begin - 1);
+    cwd[end - begin - 1] = '\0';
+    if (cwd != s->cwd && cwd[0] == '/') strcpy(s->cwd, cwd);
+    return 0;
+}
+
+/*
+    从 src_fd (socket) 接收 length 字节, pwrite 到 dest_fd 的 offset 处
+    收满 length 字节即停止, 返回实际接收的字节数
+*/
+static long FTPTransmitRange(int dest_fd,
+                             int src_fd,
+                             long offset,
+                             long length,
+                             ftp_rate* rate,
+                             ftp_stats* st,
+                             void* trans_buf,
+                             int buf_size) {
+    long total_trans_bytes = 0;
+    while (total_trans_bytes < length) {
+        long n = FTPRateChunk(rate, buf_size);
+        if (n > length - total_trans_bytes) n = length - total_trans_bytes;
+        double t = FTPNow();
+        ssize_t nread = read(src_fd, trans_buf, n);
+        t = FTPStatsIo(st, 1, t);
+        if (nread <= 0) break;
+        if (pwrite(dest_fd, trans_buf, nread, offset) != nread) {
+            LOGE("pwrite error.\n");
+            break;
+        }
+        FTPStatsIo(st, 0, t);
+        offset += nread;
+        total_trans_bytes += nread;
+        st->rate_wait += FTPRateConsume(rate, nread);
+    }
+    st->bytes = total_trans_bytes;
+    return total_trans_bytes;
+}
+
+/* 分段连接使用主连接的数据缓冲区设置 */
+static void FTPSegmentInherit(ftp_session* s, const ftp_session* parent) {
+    s->data_buf_size = parent->data_buf_size;
+    s->sockbuf_auto = parent->sockbuf_auto;
+    s->data_rate = parent->data_rate;
+    s->cache = parent->cache;
+}
+
+/*
+    分段线程登录新的控制连接
+    进入主连接的工作目录, 切换为二进制被动模式
+*/
+static ftp_session* FTPSegmentLogin(struct ftp_segment* seg) {
+    const ftp_session* parent = seg->parent;
+    ftp_session* s;
+    char cwd[BUFF_SIZE];
+    strcpy(cwd, seg->cwd);
+
+    // 使用连接池中已登录的连接
+    if (parent->pool) {
+        s = FTPPoolAcquire(parent->pool);
+        if (s == NULL) return NULL;
+        FTPSegmentInherit(s, parent);
+        if (FTPCd(s, cwd) == -1 || FTPBinary(s) == -1) {
+            FTPPoolDiscard(parent->pool, s);
+            return NULL;
+        }
+        s->data_mode = FTP_PASV_MODE;
+        return s;
+    }
+
+    s = (ftp_session*) malloc(sizeof(ftp_session));
+    if (s == NULL) {
+        LOGE("malloc error.\n");
+        return NULL;
+    }
+    FTPSessionInit(s);
+    s->verbose = 0;
+
+    if (FTPOpen(s, seg->parent->server_ip, seg->parent->port) == -1 ||
+        FTPLogin(s, seg->parent->username, seg->parent->password) == -1 ||
+        FTPCd(s, cwd) == -1 || FTPBinary(s) == -1) {
+        if (s->ctl_fd != -1) close(s->ctl_fd);
+        free(s);
+        return NULL;
+    }
+    // 分段只使用被动模式
+    s->data_mode = FTP_PASV_MODE;
+    FTPSegmentInherit(s, parent);
+    return s;
+}
+
+/*
+    分段线程退出登录并释放 session
+    连接池中的连接归还, 分段失败时控制连接状态未知, 丢弃重连
+*/
+static void FTPSegmentLogout(struct ftp_segment* seg, ftp_session* s) {
+    if (seg->parent->pool) {
+        if (seg->ok) {
+            FTPPoolRelease(seg->parent->pool, s);
+        } else {
+            FTPPoolDiscard(seg->parent->pool, s);
+        }
+        return;
+    }
+    sprintf(s->send_buf, "QUIT\r\n");
+    FTPCommand(s);
+    close(s->ctl_fd);
+    free(s);
+}
+
+/*
+    分段下载线程
+    登录新的控制连接, "REST offset" + "RETR filename" 下载一个分段
+*/
+static void* FTPGetSegment(void* arg) {
+    struct ftp_segment* seg = (struct ftp_segment*) arg;
+    ftp_session* s = FTPSegmentLogin(seg);
+    if (s == NULL) return NULL;
+
+    // 服务器限制每个 IP 的连接数时 PASV 或连接可能失败, 不再发送 RETR
+    int ftp_data_fd = FTPOpenDataSockfd(s);
+    if (ftp_data_fd < 0) {
+        FTPSegmentLogout(seg, s);
+        return NULL;
+    }
+    // REST 需紧接在 RETR 之前
+    if (FTPRest(s, seg->offset) == -1 || FTPRetr(s, seg->filename) == -1) {
+        close(ftp_data_fd);
+        FTPSegmentLogout(seg, s);
+        return NULL;
+    }
+
+    char* trans_buf = (char*) malloc(s->data_buf_size);
+    long nrecv = -1;
+    if (trans_buf != NULL) {
+        nrecv = FTPTransmitRange(seg->file_fd,
+                                 ftp_data_fd,
+                                 seg->offset,
+                                 seg->length,
+                                 seg->rate,
+                                 &seg->stats,
+                                 trans_buf,
+                                 s->data_buf_size);
+        free(trans_buf);
+    }
+    seg->ok = nrecv == seg->length;
+
+    // 提前关闭数据连接, 服务器可能返回 226 或 426, 均忽略
+    close(ftp_data_fd);
+    FTPReadReply(s);
+    seg->stats.reply = s->reply.code;
+
+    FTPSegmentLogout(seg, s);
+    return NULL;
+}
+
+/*
+    命令 "pget filename [-n N]"
+    N 个控制连接并行下载文件的不同分段
+*/
+static int FTPPgetFile(ftp_session* s, const char* filename, int nsegments) {
+    // 下载长度和预分配大小必须来自服务器, 缓存的大小可能已过期
+    long ftp_file_size = FTPSizeCommand(s, filename);
+    if (ftp_file_size == -1) {
+        return -1;
+    }
+
+    if (nsegments <= 0) nsegments = PGET_DEFAULT_SEGMENTS;
+    if (nsegments > PGET_MAX_SEGMENTS) nsegments = PGET_MAX_SEGMENTS;
+    // 文件过小时减少分段
+    if (ftp_file_size < (long) nsegments * PGET_MIN_SEGMENT_SIZE) {
+        nsegments = ftp_file_size / PGET_MIN_SEGMENT_SIZE;
+        if (nsegments < 1) nsegments = 1;
+    }
+
+    char cwd[BUFF_SIZE];
+    if (FTPGetCwd(s, cwd, sizeof(cwd)) == -1) {
+        return -1;
+    }
+
+    int file_handle = open(filename, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if (file_handle < 0) {
+        LOGE("open error!\n");
+        return -1;
+    }
+    // 预分配本地文件, 不支持时退化为 ftruncate
+    if (posix_fallocate(file_handle, 0, ftp_file_size) != 0 &&
+        ftruncate(file_handle, ftp_file_size) < 0) {
+        LOGE("fallocate error.\n");
+        close(file_handle);
+        return -1;
+    }
+
+    // 所有分段共享一个令牌桶, 合计速率不超过限速
+    ftp_rate local_rate;
+    ftp_rate* rate = FTPSessionRate(s, &local_rate);
+    struct ftp_segment segs[PGET_MAX_SEGMENTS];
+    long seg_size = (ftp_file_size + nsegments - 1) / nsegments;
+    int i;
+    for (i = 0; i < nsegments; i++) {
+        segs[i].parent = s;
+        segs[i].cwd = cwd;
+        segs[i].filename = filename;
+        segs[i].file_fd = file_handle;
+        segs[i].offset = i * seg_size;
+        segs[i].length = ftp_file_size - segs[i].offset < seg_size
+                                 ? ftp_file_size - segs[i].offset
+                                 : seg_size;
+        segs[i].rate = rate;
+        segs[i].opened = NULL;
+        memset(&segs[i].stats, 0, sizeof(segs[i].stats));
+        segs[i].ok = 0;
+        if (pthread_create(&segs[i].tid, NULL, FTPGetSegment, &segs[i])) {
+            LOGE("pthread_create error.\n");
+            break;
+        }
+    }
+
+    int nfailed = nsegments - i;
+    while (i-- > 0) {
+        pthread_join(segs[i].tid, NULL);
+        FTPStatsMerge(&s->stats, &segs[i].stats);
+        if (!segs[i].ok) nfailed++;
+    }
+    close(file_handle);
+
+    if (nfailed) {
+        printf("<< PGET %s failed. %d/%d segments incomplete.\n",
+               filename,
+               nfailed,
+               nsegments);
+        return -1;
+    }
+    printf("<< PGET %s ok. %ld bytes in %d segments.\n",
+           filename,
+           ftp_file_size,
+           nsegments);
+    return 0;
+}
+
+int FTPPget(ftp_session* s, const char* filename, int nsegments) {
+    FTPStatsBegin(s, "PGET", filename, 0);
+    int ret = FTPPgetFile(s, filename, nsegments);
+    // 各分段中最差的响应码
+    FTPStatsEnd(s, ret, s->stats.reply);
+    return ret;
+}
+
+/*
+    从 src_fd (文件) 的 offset 处读取 length 字节发送到 dest_fd (socket)
+    不改变文件偏移, 多个分段可共享同一个 fd, 返回实际发送的字节数
+*/
+static long FTPSendfileRange(int dest_fd,
+                             int src_fd,
+                             long offset,
+                             long length,
+                             ftp_rate* rate,
+                             ftp_stats* st,
+                             void* trans_buf,
+                             int buf_size) {
+    long total_trans_bytes = 0;
+    off_t off = offset;
+    while (total_trans_bytes < length) {
+        long n = FTPRateChunk(rate, length - total_trans_bytes);
+        double t = FTPNow();
+        ssize_t nsent = sendfile(dest_fd, src_fd, &off, n);
+        FTPStatsIo(st, 1, t);
+        if (nsent < 0 && (errno == EINVAL || errno == ENOSYS)) {
+            // 不支持 sendfile 时回退到 pread/write
+            nsent = n > buf_size ? buf_size : n;
+            nsent = pread(src_fd, trans_buf, nsent, off);
+            if (nsent > 0 && write(dest_fd, trans_buf, nsent) != nsent) {
+                nsent = -1;
+            }
+            if (nsent > 0) off += nsent;
+        }
+        if (nsent < 0 && errno == EINTR) continue;
+        if (nsent <= 0) break;
+        total_trans_bytes += nsent;
+        st->rate_wait += FTPRateConsume(rate, nsent);
+    }
+    st->bytes = total_trans_bytes;
+    return total_trans_bytes;
+}
+
+/*
+    分段上传线程
+    登录新的控制连接, "REST offset" + "STOR filename" 上传一个分段
+*/
+static void* FTPPutSegment(void* arg) {
+    struct ftp_segment* seg = (struct ftp_segment*) arg;
+    ftp_session* s = FTPSegmentLogin(seg);
+    if (s == NULL) {
+        if (seg->opened) sem_post(seg->opened);
+        return NULL;
+    }
+
+    int ftp_data_fd = FTPOpenDataSockfd(s);
+    if (ftp_data_fd < 0) {
+        if (seg->opened) sem_post(seg->opened);
+        FTPSegmentLogout(seg, s);
+        return NULL;
+    }
+    // 偏移为 0 时不发送 REST, 由 STOR 创建/截断服务器文件
+    int err = (seg->offset > 0 && FTPRest(s, seg->offset) == -1) ||
+              FTPStor(s, seg->filename) == -1;
+    if (seg->opened) sem_post(seg->opened);
+    if (err) {
+        close(ftp_data_fd);
+        FTPSegmentLogout(seg, s);
+        return NULL;
+    }
+
+    // sendfile 不需要缓冲区, 只在回退到 pread/write 时使用
+    char trans_buf[BUFF_SIZE];
+    long nsent = FTPSendfileRange(ftp_data_fd,
+                                  seg->file_fd,
+                                  seg->offset,
+                                  seg->length,
+                                  seg->rate,
+                                  &seg->stats,
+                                  trans_buf,
+                                  sizeof(trans_buf));
+    close(ftp_data_fd);
+
+    // 226 Transfer complete.
+    FTPReadReply(s);
+    seg->stats.reply = s->reply.code;
+    seg->ok = nsent == seg->length && !FTPCheckResponse(&s->reply);
+
+    FTPSegmentLogout(seg, s);
+    return NULL;
+}
+
+/*
+    命令 "pput filename [-n N]"
+    N 个控制连接并行上传文件的不同分段, 需要服务器支持 REST STOR
+    不支持时回退到 FTPPut 单连接上传
+*/
+static int FTPPputFile(ftp_session* s, const char* filename, int nsegments) {
+    struct stat st;
+    if (stat(filename, &st) < 0) {
+        printf("%s No such file or directory.\n", filename);
+        return -1;
+    }
+
+    if (FTPFeat(s, "REST STREAM") != 1) {
+        printf("REST STREAM not supported, fallback to put.\n");
+        return FTPPutFile(s, filename, "");
+    }
+
+    // 断点续传规则与 FTPPut 相同
+    long start = 0;
+    long ftp_file_size = FTPSizeCommand(s, filename);
+    if (ftp_file_size == st.st_size) {
+        // 文件大小相同认为文件相同
+        printf("File exists.\n");
+        return -1;
+    } else if (ftp_file_size != -1 && ftp_file_size < st.st_size) {
+        start = ftp_file_size;
+    }
+    s->stats.offset = start;
+
+    long length = st.st_size - start;
+    if (nsegments <= 0) nsegments = PGET_DEFAULT_SEGMENTS;
+    if (nsegments > PGET_MAX_SEGMENTS) nsegments = PGET_MAX_SEGMENTS;
+    // 文件过小时减少分段
+    if (length < (long) nsegments * PGET_MIN_SEGMENT_SIZE) {
+        nsegments = length / PGET_MIN_SEGMENT_SIZE;
+        if (nsegments < 1) nsegments = 1;
+    }
+
+    char cwd[BUFF_SIZE];
+    if (FTPGetCwd(s, cwd, sizeof(cwd)) == -1) {
+        return -1;
+    }
+
+    int file_handle = open(filename, O_RDONLY, 0);
+    if (file_handle < 0) {
+        LOGE("open error!\n");
+        return -1;
+    }
+
+    // 从头上传时, 第一个分段 STOR 会截断服务器文件
+    // 等它打开文件后再启动其余分段
+    sem_t opened;
+    sem_init(&opened, 0, 0);
+
+    ftp_rate local_rate;
+    ftp_rate* rate = FTPSessionRate(s, &local_rate);
+    struct ftp_segment segs[PGET_MAX_SEGMENTS];
+    long seg_size = (length + nsegments - 1) / nsegments;
+    int i;
+    for (i = 0; i < nsegments; i++) {
+        segs[i].parent = s;
+        segs[i].cwd = cwd;
+        segs[i].filename = filename;
+        segs[i].file_fd = file_handle;
+        segs[i].offset = start + i * seg_size;
+        segs[i].length = st.st_size - segs[i].offset < seg_size
+                                 ? st.st_size - segs[i].offset
+                                 : seg_size;
+        segs[i].rate = rate;
+        segs[i].opened = (i == 0 && start == 0) ? &opened : NULL;
+        memset(&segs[i].stats, 0, sizeof(segs[i].stats));
+        segs[i].ok = 0;
+        if (pthread_create(&segs[i].tid, NULL, FTPPutSegment, &segs[i])) {
+            LOGE("pthread_create error.\n");
+            break;
+        }
+        if (segs[i].opened) sem_wait(&opened);
+    }
+
+    int nfailed = nsegments - i;
+    while (i-- > 0) {
+        pthread_join(segs[i].tid, NULL);
+        FTPStatsMerge(&s->stats, &segs[i].stats);
+        if (!segs[i].ok) nfailed++;
+    }
+    sem_destroy(&opened);
+    close(file_handle);
+
+    if (nfailed) {
+        printf("<< PPUT %s failed. %d/%d segments incomplete.\n",
+               filename,
+               nfailed,
+               nsegments);
+        return -1;
+    }
+    printf("<< PPUT %s ok. %ld bytes in %d segments.\n",
+           filename,
+           length,
+           nsegments);
+    return 0;
+}
+
+int FTPPput(ftp_session* s, const char* filename, int nsegments) {
+    FTPStatsBegin(s, "PPUT", filename, 0);
+    int ret = FTPPputFile(s, filename, nsegments);
+    struct stat st;
+    if (ret == 0 && stat(filename, &st) == 0) {
+        FTPCacheSize(s, filename, st.st_size);
+    } else {
+        FTPCacheForget(s, filename);
+    }
+    // 各分段中最差的响应码, 回退到 put 时为 put 的响应码
+    FTPStatsEnd(s, ret, s->stats.reply ? s->stats.reply : s->reply.code);
+    return ret;
+}
+
+/* ---------------------------------- */
+
+#define RING_MASK (FTP_REPLY_RING - 1)
+
+static const char reply_closed[] = "421 Connection closed.\r\n";
+static const char reply_too_long[] = "421 Reply too long.\r\n";
+
+/* 控制连接不可用, reply 设为 421 并清空接收缓冲区 */
+static int FTPReplyAbort(ftp_session* s, ftp_reply* reply, const char* text) {
+    s->head = s->tail = s->rstart = s->lstart = s->scan = 0;
+    s->rmulti = s->rskip = 0;
+    reply->code = 421;
+    reply->text = text;
+    reply->len = strlen(text);
+    return -1;
+}
+
+/*
+    [rstart, scan) 为一条完整响应, 生成 reply
+    响应跨越环形缓冲区末尾时拷贝到 linear, 否则直接引用 ring
+*/
+static void FTPReplyView(ftp_session* s, ftp_reply* reply) {
+    unsigned begin = s->rstart & RING_MASK;
+    int len = s->scan - s->rstart;
+    if (begin + len <= FTP_REPLY_RING) {
+        reply->text = s->ring + begin;
+    } else {
+        int first = FTP_REPLY_RING - begin;
+        memcpy(s->linear, s->ring + begin, first);
+        memcpy(s->linear + first, s->ring, len - first);
+        s->linear[len] = '\0';
+        reply->text = s->linear;
+    }
+    reply->len = len;
+    reply->code = 0;
+    int i;
+    for (i = 0; i < 3 && i < len; i++) {
+        if (reply->text[i] < '0' || reply->text[i] > '9') {
+            reply->code = 0;
+            break;
+        }
+        reply->code = reply->code * 10 + reply->text[i] - '0';
+    }
+}
+
+/*
+    从 scan 继续查找已读取的数据中的下一条完整响应
+    找到返回 1 并设置 reply, 数据不足返回 0
+*/
+static int FTPReplyParse(ftp_session* s, ftp_reply* reply) {
+    while (s->scan != s->tail) {
+        // 在连续的一段中查找换行符
+        unsigned begin = s->scan & RING_MASK;
+        unsigned n = s->tail - s->scan;
+        if (n > FTP_REPLY_RING - begin) n = FTP_REPLY_RING - begin;
+        const char* eol = memchr(s->ring + begin, '\n', n);
+        if (eol == NULL) {
+            s->scan += n;
+            continue;
+        }
+        s->scan += eol - (s->ring + begin) + 1;
+
+        // 一行结束, 取行首 4 个字符判断
+        unsigned line = s->lstart;
+        char prefix[4] = {0};
+        int i;
+        for (i = 0; i < 4 && line + i != s->scan; i++) {
+            prefix[i] = s->ring[(line + i) & RING_MASK];
+        }
+        s->lstart = s->scan;
+        if (line == s->rstart) {
+            if (prefix[3] == '-') {
+                // 多行响应 "123-...", 读取到 "123 " 结束行为止
+                memcpy(s->rcode, prefix, 3);
+                s->rmulti = 1;
+                s->rbody = s->scan;
+                continue;
+            }
+        } else if (prefix[3] != ' ' || memcmp(prefix, s->rcode, 3) != 0) {
+            continue;
+        }
+
+        FTPReplyView(s, reply);
+        s->rstart = s->scan;
+        s->rmulti = 0;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+    缓冲区已满但响应不完整
+    多行响应丢弃第一行之后已读取的内容, 继续读取到结束行
+    第一行本身放不下时返回 -1
+*/
+static int FTPReplyTruncate(ftp_session* s) {
+    if (!s->rmulti || s->rbody == s->tail) return -1;
+    LOGE("reply too long, truncated.\n");
+    s->rskip = s->lstart != s->tail;  // 丢弃了半行, 剩余部分也要丢弃
+    s->tail = s->scan = s->lstart = s->rbody;
+    return 0;
+}
+
+/*
+    read 一次, 尽量填满环形缓冲区的空闲部分, 返回 read 的返回值
+    多读到的后续响应留在缓冲区中
+*/
+static ssize_t FTPReplyFill(ftp_session* s) {
+    unsigned begin = s->tail & RING_MASK;
+    unsigned n = FTP_REPLY_RING - (s->tail - s->head);
+    if (n > FTP_REPLY_RING - begin) n = FTP_REPLY_RING - begin;
+    // 流水线的多个响应, 或 150 之后的 226, 客户端之间没有数据要发:
+    // 服务器未关闭 Nagle 时后一个响应要等前一个被 ACK, 延迟 ACK 使其多等约 40ms
+    // 立即 ACK 收到的响应; TCP_QUICKACK 不是永久的, 每次接收前重新设置
+    int opt = 1;
+    setsockopt(s->ctl_fd, IPPROTO_TCP, TCP_QUICKACK, &opt, sizeof(opt));
+    ssize_t nread = read(s->ctl_fd, s->ring + begin, n);
+    if (nread <= 0) return nread;
+
+    ssize_t nkeep = nread;
+    if (s->rskip) {
+        // 丢弃被截断行的剩余部分, 保留换行符及之后的数据
+        char* eol = memchr(s->ring + begin, '\n', nread);
+        if (eol == NULL) return nread;
+        nkeep -= eol - (s->ring + begin);
+        memmove(s->ring + begin, eol, nkeep);
+        s->rskip = 0;
+    }
+    s->tail += nkeep;
+    return nread;
+}
+
+/*
+    读取下一条完整响应, 不释放之前的响应
+    控制连接断开时 reply 为 "421 Connection closed." 并返回 -1
+*/
+static int FTPNextReply(ftp_session* s, ftp_reply* reply) {
+    while (!FTPReplyParse(s, reply)) {
+        if (s->tail - s->head == FTP_REPLY_RING && FTPReplyTruncate(s) == -1) {
+            return FTPReplyAbort(s, reply, reply_too_long);
+        }
+        if (FTPReplyFill(s) <= 0) {
+            // 控制连接已断开, 按 421 处理
+            return FTPReplyAbort(s, reply, reply_closed);
+        }
+    }
+    return 0;
+}
+
+/*
+    非阻塞控制连接上读取响应
+    已读到完整响应返回 1 (s->reply), 数据不足返回 0, 连接断开返回 -1
+    缓冲区中可能还有后续响应, 调用者应重复调用直到返回 0
+*/
+int FTPPollReply(ftp_session* s) {
+    s->head = s->rstart;
+    while (!FTPReplyParse(s, &s->reply)) {
+        if (s->tail - s->head == FTP_REPLY_RING && FTPReplyTruncate(s) == -1) {
+            return FTPReplyAbort(s, &s->reply, reply_too_long);
+        }
+        ssize_t nread = FTPReplyFill(s);
+        if (nread < 0 &&
+            (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            return 0;
+        }
+        if (nread <= 0) return FTPReplyAbort(s, &s->reply, reply_closed);
+    }
+    return 1;
+}
+
+/*
+    释放之前的响应, 读取一条完整响应到 s->reply
+    控制连接断开时 s->reply 为 "421 Connection closed." 并返回 -1
+*/
+int FTPReadReply(ftp_session* s) {
+    s->head = s->rstart;
+    return FTPNextReply(s, &s->reply);
+}
+
+/*
+    流水线发送多条命令
+    s->send_buf 中为 ncmds 条以 "\r\n" 结尾的命令, 一次 write 发出
+    按顺序读取响应, 第 i 条响应保存到 replies[i], 均引用接收缓冲区
+    返回第一条失败命令的下标, 之后的响应仍会读取以保持同步, 全部成功返回 ncmds
+    只应流水线发送前一条失败时后续命令也会被服务器拒绝或无副作用的命令
+*/
+int FTPPipeline(ftp_session* s, int ncmds, ftp_reply* replies) {
+    double start = FTPNow();
+    send(s->ctl_fd, s->send_buf, strlen(s->send_buf), MSG_NOSIGNAL);
+    s->head = s->rstart;
+    int i, failed = ncmds;
+    const char* cmd = s->send_buf;
+    for (i = 0; i < ncmds; i++) {
+        int broken = FTPNextReply(s, &replies[i]) == -1;
+        // 每条命令的延迟从整批发出时算起, 包含排在前面的命令
+        FTPHistRecord(cmd, FTPNow() - start);
+        cmd = strstr(cmd, "\r\n") + 2;
+        s->reply = replies[i];
+        if (s->verbose) printf("<< %.*s", s->reply.len, s->reply.text);
+        if (failed == ncmds && FTPCheckResponse(&s->reply)) failed = i;
+        if (broken) {
+            // 连接断开, 剩余命令均失败
+            for (i++; i < ncmds; i++) replies[i] = s->reply;
+            break;
+        }
+    }
+    return failed;
+}
+
+void FTPCommand(ftp_session* s) {
+    double start = FTPNow();
+    // 连接已断开时不触发 SIGPIPE, 由 FTPReadReply 判断
+    send(s->ctl_fd, s->send_buf, strlen(s->send_buf), MSG_NOSIGNAL);
+    FTPReadReply(s);
+    FTPHistRecord(s->send_buf, FTPNow() - start);
+    if (s->verbose) printf("<< %.*s", s->reply.len, s->reply.text);
+}
+
+/*
+    数据传输结束, 读取传输结束响应到 s->reply
+    流模式关闭数据连接, 服务器以 226 响应
+    块模式 ok 时保留数据连接, 服务器以 250 响应表示同样保留, 其他响应则关闭
+    开启预连接时先发送 PASV, 服务器结束当前传输后立即处理, 与等待 226 重叠
+*/
+static void FTPTransferEnd(ftp_session* s, int ftp_data_fd, int ok) {
+    if (s->block_mode && ok) {
+        s->block_fd = ftp_data_fd;
+    } else {
+        close(ftp_data_fd);
+    }
+    int prefetch = s->prefetch && s->data_mode == FTP_PASV_MODE &&
+                   !s->block_mode;
+    if (prefetch) {
+        FTPSpareClose(s);
+        send(s->ctl_fd, "PASV\r\n", 6, MSG_NOSIGNAL);
+    }
+    FTPReadReply(s);
+    if (s->reply.code != 250) FTPBlockClose(s);
+    if (!prefetch || s->reply.code == 421) return;
+
+    // PASV 响应在 226 之后, s->reply 仍引用接收缓冲区中的 226
+    ftp_reply pasv;
+    FTPNextReply(s, &pasv);
+    if (FTPCheckResponse(&pasv) == 0 && FTPPasvReply(s, &pasv) == 0) {
+        FTPSpareConnect(s);
+    }
+}
+
+/* 单调时钟, 秒 */
+double FTPNow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* 记录一次传输的吞吐量, 太小的传输不足以反映带宽, 忽略 */
+static void FTPDataRate(ftp_session* s, long nbytes, double seconds) {
+    if (nbytes < FTP_SOCKBUF_MIN || seconds <= 0) return;
+    double rate = nbytes / seconds;
+    s->data_rate = s->data_rate > 0 ? (s->data_rate + rate) / 2 : rate;
+}
+
+/*
+    按带宽时延积估计数据连接的套接字缓冲区大小
+    RTT 取控制连接的 TCP_INFO, 带宽取之前传输测得的吞吐量
+    取 2 倍 BDP, 吞吐量受窗口限制时下一次传输仍有增长空间
+    未开启或尚未测量时返回 0
+*/
+static int FTPSockbufSize(const ftp_session* s) {
+    if (!s->sockbuf_auto || s->data_rate <= 0 || s->ctl_fd < 0) return 0;
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    if (getsockopt(s->ctl_fd, IPPROTO_TCP, TCP_INFO, &info, &len) < 0) {
+        return 0;
+    }
+    double bdp = s->data_rate * info.tcpi_rtt / 1e6;
+    double size = 2 * bdp;
+    if (size < FTP_SOCKBUF_MIN) size = FTP_SOCKBUF_MIN;
+    if (size > FTP_SOCKBUF_MAX) size = FTP_SOCKBUF_MAX;
+    return (int) size;
+}
+
+/*
+    设置数据连接的 SO_RCVBUF/SO_SNDBUF
+    设置后内核不再自动调整该连接的缓冲区, 只在估计值大于当前值时设置
+    实际大小受 net.core.rmem_max/wmem_max 限制
+*/
+static void FTPTuneSockbuf(const ftp_session* s, int sock_fd) {
+    int size = FTPSockbufSize(s);
+    if (size == 0) return;
+    int opts[2] = {SO_RCVBUF, SO_SNDBUF};
+    int i;
+    for (i = 0; i < 2; i++) {
+        int cur = 0;
+        socklen_t len = sizeof(cur);
+        getsockopt(sock_fd, SOL_SOCKET, opts[i], &cur, &len);
+        if (size > cur) {
+            setsockopt(sock_fd, SOL_SOCKET, opts[i], &size, sizeof(size));
+        }
+    }
+}
+
+/*
+    建立 TCP 连接, sock_fd 为已创建的套接字
+    记录服务器和客户端IP到 session
+*/
+static int FTPConnectSocket(ftp_session* s,
+                            int sock_fd,
+                            const char* addr,
+                            int port) {
+    struct sockaddr_in server;
+    memset(&server, 0, sizeof(server));
+
+    // 获取服务器IP, 域名使用可重入的 getaddrinfo 解析
+    if (inet_pton(AF_INET, addr, &server.sin_addr) != 1) {
+        struct addrinfo hints, *res;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(addr, NULL, &hints, &res) != 0) {
+            LOGE("getaddrinfo %s failed.\n", addr);
+            close(sock_fd);
+            return -1;
+        }
+        server.sin_addr = ((struct sockaddr_in*) res->ai_addr)->sin_addr;
+        freeaddrinfo(res);
+    }
+    inet_ntop(AF_INET, &server.sin_addr, s->server_ip, sizeof(s->server_ip));
+    LOGI("SERVER IP: %s\n", s->server_ip);
+
+    server.sin_family = AF_INET;
+    server.sin_port = htons(port);
+
+    if (connect(sock_fd, (struct sockaddr*) &server, sizeof(server)) < 0) {
+        LOGE("connect failed.\n");
+        close(sock_fd);
+        return -1;
+    }
+
+    // 获取客户端IP
+    struct sockaddr_in client;
+    socklen_t client_len = sizeof(client);
+    if (getsockname(sock_fd, (struct sockaddr*) &client, &client_len) < 0) {
+        LOGE("getsockname failed.\n");
+        close(sock_fd);
+        return -1;
+    }
+    inet_ntop(AF_INET, &client.sin_addr, s->client_ip, sizeof(s->client_ip));
+    LOGI("CLIENT IP: %s\n", s->client_ip);
+
+    return sock_fd;
+}
+
+/*
+    建立到 addr:port 的 TCP 连接, 返回套接字, 失败返回 -1
+*/
+int FTPConnect(ftp_session* s, const char* addr, int port) {
+    double start = FTPNow();
+    int sock_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock_fd < 0) {
+        LOGE("socket failed.\n");
+        return -1;
+    }
+    sock_fd = FTPConnectSocket(s, sock_fd, addr, port);
+    // 包含域名解析
+    if (sock_fd >= 0) FTPHistRecord("CONNECT", FTPNow() - start);
+    return sock_fd;
+}
+
+/* 被动模式数据连接, 连接前按 BDP 设置套接字缓冲区 (影响 TCP 窗口扩大因子) */
+static int FTPDataConnect(ftp_session* s) {
+    int sock_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock_fd < 0) {
+        LOGE("socket failed.\n");
+        return -1;
+    }
+    FTPTuneSockbuf(s, sock_fd);
+    return FTPConnectSocket(s, sock_fd, s->server_ip, s->data_port);
+}
+
+/*
+    命令 "prefetch on|off"
+    被动模式下每次传输结束时发送 PASV 并开始连接, 下一次 RETR/STOR/LIST 直接使用
+    省去 PASV 的往返和 TCP 握手, 适合连续传输大量小文件
+*/
+void FTPSetPrefetch(ftp_session* s, int on) {
+    s->prefetch = on;
+    if (!on) FTPSpareClose(s);
+}
+
+/* FEAT 中 "HASH SHA-256*;CRC32" 的算法列表是否包含 name, '*' 标记当前算法 */
+static int FTPHashListed(const char* list, int len, const char* name) {
+    int nname = strlen(name);
+    while (len > 0) {
+        int n = 0;
+        while (n < len && list[n] != ';') n++;
+        int m = n > 0 && list[n - 1] == '*' ? n - 1 : n;
+        if (m == nname && strncasecmp(list, name, m) == 0) return 1;
+        if (n == len) break;
+        list += n + 1;
+        len -= n + 1;
+    }
+    return 0;
+}
+
+/*
+    只校验二进制模式的传输, 当前不是二进制模式 (包括会话刚建立时) 切换为 TYPE I
+    切换失败时关闭校验
+*/
+static int FTPVerifyBinary(ftp_session* s) {
+    if (s->trans_type == FTP_TYPE_BINARY) return 0;
+    if (FTPBinary(s) == -1) {
+        s->verify = 0;
+        s->verify_xcrc = 0;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+    命令 "verify on|off"
+    开启后二进制模式的 get/put 在传输时计算摘要, 结束后与服务器的 HASH 或 XCRC 比较,
+    不一致时重新传输; 大小相同的文件也比较摘要, 不再直接认为相同
+    开启时切换为二进制模式, 之后改为 ASCII 模式的传输不校验
+    算法: 服务器 HASH 支持 SHA-256 且 CPU 有 SHA 扩展指令 (或不支持 CRC32) 时为 SHA-256,
+    其次 HASH CRC32, 不支持 HASH 时为 XCRC (CRC32); 都不支持返回 -1
+*/
+int FTPSetVerify(ftp_session* s, int on) {
+    s->verify = 0;
+    s->verify_xcrc = 0;
+    if (!on) return 0;
+    sprintf(s->send_buf, "FEAT\r\n");
+    FTPCommand(s);
+    if (FTPCheckResponse(&s->reply)) {
+        printf("<< FEAT failed. %.*s", s->reply.len, s->reply.text);
+        return -1;
+    }
+    int algo = 0;
+    int len;
+    const char* list = FTPFeatFind(&s->reply, "HASH ", &len);
+    if (list) {
+        int sha256 = FTPHashListed(list, len, "SHA-256");
+        int crc32 = FTPHashListed(list, len, "CRC32");
+        if (sha256 && (!crc32 || FTPHashAccelerated(FTP_HASH_SHA256))) {
+            algo = FTP_HASH_SHA256;
+        } else if (crc32) {
+            algo = FTP_HASH_CRC32;
+        }
+    }
+    if (algo == 0) {
+        if (FTPFeatFind(&s->reply, "XCRC", &len) == NULL) {
+            printf("<< VERIFY failed. Server supports neither HASH "
+                   "(SHA-256, CRC32) nor XCRC.\n");
+            return -1;
+        }
+        s->verify = FTP_HASH_CRC32;
+        s->verify_xcrc = 1;
+        return FTPVerifyBinary(s);
+    }
+    sprintf(s->send_buf, "OPTS HASH %s\r\n", FTPHashName(algo));
+    FTPCommand(s);
+    if (FTPCheckResponse(&s->reply)) {
+        printf("<< OPTS HASH failed. %.*s", s->reply.len, s->reply.text);
+        return -1;
+    }
+    s->verify = algo;
+    return FTPVerifyBinary(s);
+}
+
+static void FTPSpareClose(ftp_session* s) {
+    if (s->spare_fd < 0) return;
+    close(s->spare_fd);
+    s->spare_fd = -1;
+}
+
+/* 非阻塞连接 PASV 返回的端口, 不等待握手完成 */
+static void FTPSpareConnect(ftp_session* s) {
+    struct sockaddr_in server;
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(s->data_port);
+    if (inet_pton(AF_INET, s->server_ip, &server.sin_addr) != 1) return;
+
+    int sock_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (sock_fd < 0) return;
+    FTPTuneSockbuf(s, sock_fd);
+    if (connect(sock_fd, (struct sockaddr*) &server, sizeof(server)) < 0 &&
+        errno != EINPROGRESS) {
+        LOGW("prefetch connect failed.\n");
+        close(sock_fd);
+        return;
+    }
+    s->spare_fd = sock_fd;
+    s->spare_time = FTPNow();
+}
+
+/*
+    取出预先打开的数据连接, 没有或已失效返回 -1, 由调用者重新 PASV
+    失效: 超过 FTP_SPARE_TTL 秒, 连接失败, 或服务器已关闭/重置 (尚未发送命令时可读)
+*/
+static int FTPSpareTake(ftp_session* s) {
+    int sock_fd = s->spare_fd;
+    if (sock_fd < 0) return -1;
+    s->spare_fd = -1;
+
+    double age = FTPNow() - s->spare_time;
+    if (age > FTP_SPARE_TTL) {
+        LOGI("prefetched data connection expired.\n");
+        close(sock_fd);
+        return -1;
+    }
+    // 握手可能仍在进行
+    struct pollfd pfd = {sock_fd, POLLOUT, 0};
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (poll(&pfd, 1, (int) ((FTP_SPARE_TTL - age) * 1000)) != 1 ||
+        getsockopt(sock_fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+        LOGI("prefetched data connection failed.\n");
+        close(sock_fd);
+        return -1;
+    }
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, 0) != 0) {
+        LOGI("prefetched data connection closed by server.\n");
+        close(sock_fd);
+        return -1;
+    }
+    fcntl(sock_fd, F_SETFL, fcntl(sock_fd, F_GETFL) & ~O_NONBLOCK);
+    return sock_fd;
+}
+
+/*
+    命令 "MODE S" / "MODE B" / "MODE Z"
+    块模式 (B) 下数据连接在文件之间保留, 压缩模式 (Z) 以 deflate 压缩数据连接
+    服务器不支持时使用流模式
+*/
+int FTPMode(ftp_session* s, int mode) {
+    sprintf(s->send_buf, "MODE %c\r\n", mode);
+    FTPCommand(s);
+    int ret = FTPCheckResponse(&s->reply) ? -1 : 0;
+    if (ret == -1) {
+        printf("<< MODE failed, using stream mode. %.*s",
+               s->reply.len,
+               s->reply.text);
+        mode = 'S';
+    }
+    if (mode != 'B') FTPBlockClose(s);
+    s->block_mode = mode == 'B';
+    s->deflate = mode == 'Z';
+    return ret;
+}
+
+/*
+    命令 "OPTS MODE Z LEVEL n"
+    上传时本地按 level (0-9) 压缩, 同时请求服务器下载时使用相同级别
+    服务器不支持时只影响上传
+*/
+int FTPSetDeflateLevel(ftp_session* s, int level) {
+    if (level < 0) level = 0;
+    if (level > 9) level = 9;
+    s->deflate_level = level;
+    sprintf(s->send_buf, "OPTS MODE Z LEVEL %d\r\n", level);
+    FTPCommand(s);
+    if (FTPCheckResponse(&s->reply)) {
+        printf("<< OPTS MODE Z failed. %.*s", s->reply.len, s->reply.text);
+        return -1;
+    }
+    return 0;
+}
+
+static void FTPBlockClose(ftp_session* s) {
+    if (s->block_fd < 0) return;
+    close(s->block_fd);
+    s->block_fd = -1;
+}
+
+/*
+    取出块模式保留的数据连接, 没有或已被服务器关闭返回 -1
+    主动模式在 RETR 之后才取出, 连接上可能已有数据, 只把 EOF 和错误视为失效
+*/
+static int FTPBlockTake(ftp_session* s) {
+    int sock_fd = s->block_fd;
+    if (sock_fd < 0) return -1;
+    s->block_fd = -1;
+    char c;
+    ssize_t n = recv(sock_fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+        LOGI("block mode data connection closed by server.\n");
+        close(sock_fd);
+        return -1;
+    }
+    return sock_fd;
+}
+
+/* 初始化 session, 默认被动模式 不限速 */
+void FTPSessionInit(ftp_session* s) {
+    memset(s, 0, sizeof(ftp_session));
+    s->ctl_fd = -1;
+    s->data_port = -1;
+    s->data_mode = FTP_PASV_MODE;
+    s->zero_copy = 1;
+    s->bytes_per_sec = -1;
+    s->verbose = 1;
+    s->data_buf_size = FTP_DATA_BUFF_SIZE;
+    s->stats_fd = -1;
+    s->spare_fd = -1;
+    s->block_fd = -1;
+    s->deflate_level = FTP_DEFLATE_LEVEL;
+}
+
+/*
+    打开控制连接并读取服务器欢迎信息
+    "220 Service ready for new user."
+*/
+int FTPOpen(ftp_session* s, const char* addr, int port) {
+    s->ctl_fd = FTPConnect(s, addr, port);
+    if (s->ctl_fd < 0) {
+        return -1;
+    }
+    s->port = port;
+
+    FTPReadReply(s);
+    if (FTPCheckResponse(&s->reply)) {
+        printf("<< Connect failed. %.*s", s->reply.len, s->reply.text);
+        close(s->ctl_fd);
+        s->ctl_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+int FTPLogin(ftp_session* s, const char* username, const char* password) {
+    double start = FTPNow();
+    sprintf(s->send_buf, "USER %s\r\n", username);
+    send(s->ctl_fd, s->send_buf, strlen(s->send_buf), MSG_NOSIGNAL);
+    FTPReadReply(s);
+    double user = FTPNow();
+    FTPHistRecord("USER", user - start);
+    // LOGI("%.*s", s->reply.len, s->reply.text);
+    if (s->reply.code != 331) {
+        printf("Username not match.\n");
+        return -1;
+    }
+
+    sprintf(s->send_buf, "PASS %s\r\n", password);
+    send(s->ctl_fd, s->send_buf, strlen(s->send_buf), MSG_NOSIGNAL);
+    FTPReadReply(s);
+    FTPHistRecord("PASS", FTPNow() - user);
+    // LOGI("%.*s", s->reply.len, s->reply.text);
+    if (s->reply.code != 230) {
+        printf("Password not match.\n");
+        return -1;
+    }
+    // 保存登录信息 分段传输时重新登录
+    snprintf(s->username, sizeof(s->username), "%s", username);
+    snprintf(s->password, sizeof(s->password), "%s", password);
+    FTPHistRecord("LOGIN", FTPNow() - start);
+    // 登录后的目录由服务器决定, 使用缓存时记录下来解析相对路径
+    // 缓存记录过程中不发送命令, 之后只由 CWD 更新
+    s->cwd[0] = '\0';
+    if (s->cache) {
+        char cwd[BUFF_SIZE];
+        FTPGetCwd(s, cwd, sizeof(cwd));
+    }
+    return 0;
+}
+
+static int FTPOpenData(ftp_session* s) {
+    int block_fd = FTPBlockTake(s);
+    if (block_fd >= 0) return block_fd;
+    if (s->data_mode == FTP_PORT_MODE) {
+        struct sockaddr_in client_addr;
+        int client_addr_len = sizeof(client_addr);
+        int conn_sock_fd = accept(s->data_port,
+                                  (struct sockaddr*) &client_addr,
+                                  (socklen_t*) &client_addr_len);
+        if (conn_sock_fd >= 0) FTPTuneSockbuf(s, conn_sock_fd);
+        return conn_sock_fd;
+    } else if (s->data_mode == FTP_PASV_MODE) {
+        int sock_fd = FTPSpareTake(s);
+        if (sock_fd >= 0) return sock_fd;
+        if (FTPPasv(s) == -1) return -1;
+        return FTPDataConnect(s);
+    }
+    return FTPDataConnect(s);
+}
+
+/*
+    打开数据连接, 延迟记为 DATA
+    被动模式包含 PASV 命令 (另记为 PASV) 和 TCP 连接, 主动模式为等待服务器连接
+*/
+int FTPOpenDataSockfd(ftp_session* s) {
+    double start = FTPNow();
+    int fd = FTPOpenData(s);
+    if (fd >= 0) FTPHistRecord("DATA", FTPNow() - start);
+    return fd;
+}
@@ -0,0 +1,320 @@
+/*
+    libftpclient
+    所有协议状态保存在 ftp_session 中, 不同 session 可在不同线程并发使用
+*/
+#ifndef FTPCLIENT_H_
+#define FTPCLIENT_H_
+
+#include <netinet/in.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#define FTP_PORT_MODE 1
+#define FTP_PASV_MODE 2
+#define FTP_TYPE_ASCII 1
+#define FTP_TYPE_BINARY 2
+#define BUFF_SIZE 1024  // 控制连接命令和命令行参数缓冲区
+#define FTP_DATA_BUFF_SIZE (256 << 10)  // 默认数据传输块大小
+#define FTP_DATA_BUFF_MAX (64 << 20)
+#define FTP_SOCKBUF_MIN (64 << 10)  // 自动设置 SO_RCVBUF/SO_SNDBUF 的范围
+#define FTP_SOCKBUF_MAX (64 << 20)
+#define SENDFILE_MAX (1 << 30)  // 单次 sendfile 最多传输字节数
+#define SPLICE_PIPE_SIZE (1 << 20)  // splice 中转管道大小
+#define PGET_DEFAULT_SEGMENTS 4
+#define PGET_MAX_SEGMENTS 32
+#define PGET_MIN_SEGMENT_SIZE (1 << 20)  // 每个分段至少 1MB
+#define FTP_POOL_MAX 64
+#define FTP_POOL_KEEPALIVE 30  // 连接池空闲连接 NOOP 保活间隔 (秒)
+#define FTP_REPLY_RING 4096     // 控制连接接收环形缓冲区, 必须为 2 的幂
+#define FTP_ENGINE_GET 1
+#define FTP_ENGINE_PUT 2
+#define FTP_ENGINE_MAX_ACTIVE 256  // 异步引擎默认并发任务数
+#define FTP_URING_DEPTH 8  // io_uring 轮流使用的缓冲区数
+#define FTP_SPARE_TTL 10  // 预先打开的数据连接最长保留秒数
+#define FTP_DEFLATE_LEVEL 6  // MODE Z 默认压缩级别, 与 zlib 默认相同
+#define FTP_MIRROR_SESSIONS 4  // 未使用连接池时 mirror 的并发连接数
+#define FTP_MIRROR_MTIME 1     // mirror 大小相同时比较修改时间 (MDTM)
+#define FTP_MIRROR_REVERSE 2   // 上传本地目录 (reverse-mirror)
+#define FTP_BATCH_SESSIONS 4   // 未使用连接池时 mget/mput 的并发连接数
+#define FTP_RATE_SLICE_MS 10    // 限速时每次最多传输 10ms 的配额, 也是令牌桶容量
+#define FTP_LIST_ARENA (256 << 10)  // 列表解析每批的记录和名字, 写满时交给回调
+#define FTP_LIST_LINE (BUFF_SIZE * 4)  // 列表中一行的最大长度, 更长的行丢弃
+#define FTP_ENTRY_FILE 1
+#define FTP_ENTRY_DIR 2
+#define FTP_ENTRY_LINK 3
+#define FTP_ENTRY_OTHER 4
+#define FTP_PERM(c) (1u << ((c) - 'a'))  // MLSD perm 中的字母, 如 FTP_PERM('r')
+#define FTP_CACHE_TTL 30          // 命令行默认的元数据缓存有效期 (秒)
+#define FTP_CACHE_MAX (64 << 10)  // 缓存路径数上限, 超过时清除过期项或全部清空
+#define FTP_CACHE_BUCKETS 4096
+#define FTP_HASH_CRC32 1
+#define FTP_HASH_SHA256 2
+#define FTP_HASH_HEX 65       // 十六进制摘要加 '\0'
+#define FTP_VERIFY_RETRIES 2  // 校验不一致时重新传输的次数
+
+typedef struct ftp_pool ftp_pool;
+typedef struct ftp_cache ftp_cache;
+typedef struct ftp_engine ftp_engine;
+
+/* 异步任务结束回调, id 为 FTPEngineAdd 的返回值 */
+typedef void (*ftp_job_done)(int id, int ok, long bytes, void* arg);
+
+/* 令牌桶, 可被多个线程共享 */
+typedef struct ftp_rate {
+    atomic_long bytes_per_sec;  // <=0 不限速
+    atomic_llong tat;           // 令牌耗尽时刻 (CLOCK_MONOTONIC 纳秒)
+} ftp_rate;
+
+/*
+    一条完整响应 (多行响应包含所有行)
+    text 直接指向接收缓冲区, 不以 '\0' 结尾, 打印使用 "%.*s"
+    在下一次 FTPReadReply/FTPCommand/FTPPipeline 之前有效
+*/
+typedef struct ftp_reply {
+    int code;          // 响应码, 如 226
+    const char* text;  // 响应全文, 含行尾 "\r\n"
+    int len;
+} ftp_reply;
+
+/* 传输中计算的流式摘要, algo 为 0 时不计算 */
+typedef struct ftp_hash {
+    int algo;  // FTP_HASH_CRC32 或 FTP_HASH_SHA256
+    uint32_t crc;
+    uint32_t state[8];  // SHA-256 状态
+    uint64_t len;       // SHA-256 已输入的字节数
+    unsigned char block[64];
+} ftp_hash;
+
+/* 目录列表中的一项 */
+typedef struct ftp_entry {
+    const char* name;  // 以 '\0' 结尾
+    long size;         // -1 为未知
+    time_t modify;     // UTC, -1 为未知 (LIST 中的时间不精确, 不解析)
+    unsigned perm;     // FTP_PERM 位
+    int type;          // FTP_ENTRY_*
+} ftp_entry;
+
+/* 收到一批列表项, 返回后 entries 和名字所在的内存被复用 */
+typedef void (*ftp_entry_cb)(const ftp_entry* entries, int n, void* arg);
+
+/* 一次传输 (get/put/list/pget/pput) 的统计 */
+typedef struct ftp_stats {
+    char cmd[8];       // RETR/STOR/APPE/LIST/PGET/PPUT
+    char file[256];
+    long bytes;        // 本次传输的字节数
+    long wire_bytes;   // 数据连接上的字节数, 压缩模式下为压缩后大小
+    long offset;       // 断点续传起始偏移
+    double start;      // 开始时刻 (FTPNow)
+    double elapsed;    // 墙钟时间 (秒), 含控制命令
+    double net_time;   // 阻塞在数据连接读写上的时间
+    double disk_time;  // 阻塞在本地文件 (或终端) 读写上的时间
+    double rate_wait;  // 限速休眠时间
+    long syscalls;     // 数据读写系统调用次数
+    int reply;         // 最终响应码, 如 226
+} ftp_stats;
+
+/* 一个控制连接及其数据连接的全部状态 */
+typedef struct ftp_session {
+    int ctl_fd;          // 控制连接
+    int data_mode;       // FTP 主动/被动模式
+    int data_port;       // FTP client数据传输端口 由port或者pasv端口打开
+    int trans_type;      // FTP 传输类型 ASCII/二进制
+    int zero_copy;       // 二进制传输是否使用 sendfile/splice 零拷贝
+    int uring;           // 二进制传输优先使用 io_uring
+    int bytes_per_sec;   // 流量控制, 每second多少byte
+    ftp_rate* rate;      // 非空时传输使用这个共享令牌桶, 而不是 bytes_per_sec
+    int verbose;         // 是否打印服务器响应
+    int port;            // 控制连接端口
+    char server_ip[INET_ADDRSTRLEN];
+    char client_ip[INET_ADDRSTRLEN];
+    char username[BUFF_SIZE], password[BUFF_SIZE];  // 分段传输时重新登录
+    ftp_pool* pool;      // 非空时分段传输从连接池取连接
+    int data_buf_size;   // 数据连接每次 read/write 的字节数
+    int sockbuf_auto;    // 按带宽时延积设置数据连接 SO_RCVBUF/SO_SNDBUF
+    double data_rate;    // 最近传输测得的吞吐量 (byte/s), 0 为未测量
+    ftp_stats stats;     // 最近一次传输的统计
+    int stats_fd;        // >=0 时每次传输结束写入一行 JSON 统计
+    int prefetch;        // 传输结束时预先打开下一条被动模式数据连接
+    int spare_fd;        // 预先打开的数据连接, -1 为无
+    double spare_time;   // spare_fd 的打开时刻
+    int block_mode;      // MODE B 块模式
+    int deflate;         // MODE Z 压缩模式
+    int deflate_level;   // 上传时的压缩级别 0-9
+    int block_fd;        // 块模式下保留的数据连接, -1 为无
+    int mlsd;            // 服务器是否支持 MLSD: 0 未知, 1 支持, -1 不支持
+    ftp_cache* cache;    // 非空时缓存远程元数据, 分段和 mirror 连接共享
+    char cwd[BUFF_SIZE];  // 缓存解析相对路径用的当前目录, 空为未知
+    int verify;          // get/put 后校验的算法 FTP_HASH_*, 0 不校验
+    int verify_xcrc;     // 服务器不支持 HASH, 使用 XCRC
+    ftp_hash hash;       // 正在传输的文件的摘要
+    char send_buf[BUFF_SIZE];  // 控制连接命令
+    /*
+        控制连接接收环形缓冲区
+        下标为单调递增计数, 取模后访问: head <= rstart <= lstart <= scan <= tail
+        [head, rstart) 已解析但仍被 reply 引用, [rstart, tail) 待解析
+    */
+    ftp_reply reply;  // 最近一条响应
+    char ring[FTP_REPLY_RING + 1];    // 末尾 '\0' 作为哨兵
+    char linear[FTP_REPLY_RING + 1];  // 跨越缓冲区末尾的响应拷贝到这里
+    unsigned head, tail;
+    unsigned rstart;  // 当前响应起点
+    unsigned lstart;  // 当前行起点
+    unsigned scan;    // 已查找过换行符的位置
+    unsigned rbody;   // 多行响应第二行起点
+    char rcode[3];    // 多行响应的响应码, 结束行以 "ddd " 开头
+    int rmulti;       // 正在读取多行响应
+    int rskip;        // 截断过长响应后, 丢弃到下一个换行符
+} ftp_session;
+
+/* 从数据连接读取数据, 出错返回 -1 */
+typedef long (*ftp_data_recv)(ftp_session* s, int data_fd, void* arg);
+
+/* 会话 */
+void FTPSessionInit(ftp_session* s);
+int FTPOpen(ftp_session* s, const char* addr, int port);
+int FTPLogin(ftp_session* s, const char* username, const char* password);
+
+/* FTP 指令 */
+int FTPPasv(ftp_session* s);
+int FTPPort(ftp_session* s, const char* port_cmd);
+int FTPMode(ftp_session* s, int mode);
+int FTPSetDeflateLevel(ftp_session* s, int level);
+
+int FTPRest(ftp_session* s, long int offset);
+int FTPStor(ftp_session* s, const char* filename);
+int FTPAppe(ftp_session* s, const char* filename);
+int FTPRetr(ftp_session* s, const char* filename);
+int FTPCd(ftp_session* s, char* path);
+int FTPList(ftp_session* s);
+int FTPListFd(ftp_session* s, const char* dirname, int dest_fd);
+int FTPListCommand(ftp_session* s,
+                   const char* cmd,
+                   ftp_data_recv recv,
+                   void* arg);
+int FTPListEntries(ftp_session* s,
+                   const char* dirname,
+                   ftp_entry_cb fn,
+                   void* arg);
+int FTPMlst(ftp_session* s,
+            const char* path,
+            ftp_entry* e,
+            char* name,
+            int size);
+int FTPPwd(ftp_session* s);
+int FTPGetCwd(ftp_session* s, char* cwd, int size);
+int FTPMkdir(ftp_session* s, const char* dirname);
+long FTPSize(ftp_session* s, const char* filename);
+long FTPBinarySize(ftp_session* s, const char* filename);
+time_t FTPMdtm(ftp_session* s, const char* filename);
+int FTPDele(ftp_session* s, const char* filename);
+int FTPRmd(ftp_session* s, const char* dirname);
+int FTPRename(ftp_session* s, const char* oldfilename, const char* newfilename);
+int FTPAscii(ftp_session* s);
+int FTPBinary(ftp_session* s);
+int FTPQuit(ftp_session* s);
+int FTPFeat(ftp_session* s, const char* feature);
+
+/* FTP 操作 */
+void FTPSetRateLimit(ftp_session* s, double ftp_rate_limit_kb);
+void FTPCommand(ftp_session* s);
+int FTPReadReply(ftp_session* s);
+int FTPPollReply(ftp_session* s);
+int FTPPasvReply(ftp_session* s, const ftp_reply* reply);
+int FTPPipeline(ftp_session* s, int ncmds, ftp_reply* replies);
+int FTPCheckResponse(const ftp_reply* reply);
+const char* skipResponseCode(const char* response);
+void FTPSetDataBuffer(ftp_session* s, int size);
+void FTPSetPrefetch(ftp_session* s, int on);
+int FTPSetVerify(ftp_session* s, int on);
+int FTPVerifyDiffers(ftp_session* s, const char* local, const char* remote);
+long FTPTransmit(ftp_session* s, int dest_fd, int src_fd);
+long FTPSendfile(ftp_session* s, int dest_fd, int src_fd);
+long FTPSplice(ftp_session* s, int dest_fd, int src_fd);
+long FTPUringTransmit(ftp_session* s, int dest_fd, int src_fd);
+long FTPBlockSend(ftp_session* s, int data_fd, int src_fd);
+long FTPBlockRecv(ftp_session* s, int dest_fd, int data_fd);
+long FTPDeflateSend(ftp_session* s, int data_fd, int src_fd);
+long FTPInflateRecv(ftp_session* s, int dest_fd, int data_fd);
+int FTPGet(ftp_session* s, const char* filename, const char* newfilename);
+int FTPPut(ftp_session* s, const char* filename, const char* newfilename);
+int FTPPget(ftp_session* s, const char* filename, int nsegments);
+int FTPPput(ftp_session* s, const char* filename, int nsegments);
+int FTPMirror(ftp_session* s,
+              const char* remote,
+              const char* local,
+              int flags);
+int FTPMget(ftp_session* s, const char* pattern);
+int FTPMput(ftp_session* s, const char* pattern);
+int FTPConnect(ftp_session* s, const char* addr, int port);
+int FTPOpenDataSockfd(ftp_session* s);
+
+/* 限速 */
+void FTPRateInit(ftp_rate* r, long bytes_per_sec);
+ftp_rate* FTPSessionRate(ftp_session* s, ftp_rate* local);
+long FTPRateChunk(const ftp_rate* r, long max);
+double FTPRateConsume(ftp_rate* r, long nbytes);
+void FTPSetGlobalRateLimit(double ftp_rate_limit_kb);
+
+/* 传输统计 */
+double FTPNow(void);
+int FTPStatsIsNet(int fd);
+void FTPStatsBegin(ftp_session* s,
+                   const char* cmd,
+                   const char* filename,
+                   long offset);
+double FTPStatsIo(ftp_stats* st, int net, double start);
+void FTPStatsMerge(ftp_stats* st, const ftp_stats* seg);
+void FTPStatsEnd(ftp_session* s, int ret, int reply);
+int FTPStatsJson(const ftp_stats* st, char* buf, int size);
+void FTPSetStatsFd(ftp_session* s, int fd);
+
+/* 命令延迟直方图, 所有会话共享 */
+void FTPHistRecord(const char* verb, double seconds);
+void FTPHistDump(FILE* fp);
+int FTPHistSignal(int signo);
+
+/* 远程元数据缓存, 路径可为相对路径, 未启用缓存时不做任何事 */
+void FTPSetCache(ftp_session* s, double ttl);
+int FTPCachePath(ftp_session* s, const char* path, char* out, int size);
+int FTPCacheLookup(ftp_session* s, const char* path, ftp_entry* e);
+void FTPCacheStore(ftp_session* s, const char* path, const ftp_entry* e);
+void FTPCacheForget(ftp_session* s, const char* path);
+void FTPCacheRename(ftp_session* s, const char* from, const char* to);
+long FTPCacheMark(ftp_session* s);
+void FTPCacheListed(ftp_session* s, const char* dir, long mark, double start);
+
+/* 传输校验摘要 */
+void FTPHashInit(ftp_hash* h, int algo);
+void FTPHashUpdate(ftp_hash* h, const void* data, size_t len);
+void FTPHashHex(ftp_hash* h, char* hex);
+int FTPHashFile(ftp_hash* h, int fd, long offset, long length);
+const char* FTPHashName(int algo);
+int FTPHashAccelerated(int algo);
+
+/* 控制连接池 */
+ftp_pool* FTPPoolCreate(const ftp_session* parent, int nsessions);
+ftp_session* FTPPoolAcquire(ftp_pool* pool);
+void FTPPoolRelease(ftp_pool* pool, ftp_session* s);
+void FTPPoolDiscard(ftp_pool* pool, ftp_session* s);
+void FTPPoolDestroy(ftp_pool* pool);
+int FTPPoolSize(const ftp_pool* pool);
+ftp_session* FTPWorkerLogin(const ftp_session* parent,
+                            const char* cwd,
+                            ftp_rate* rate);
+void FTPWorkerLogout(const ftp_session* parent, ftp_session* s);
+
+/* epoll 异步传输引擎, 单线程驱动多个会话 */
+ftp_engine* FTPEngineCreate(int max_active);
+int FTPEngineAdd(ftp_engine* e,
+                 const ftp_session* login,
+                 int direction,
+                 const char* remote,
+                 const char* local,
+                 ftp_job_done done,
+                 void* arg);
+int FTPEngineRun(ftp_engine* e);
+void FTPEngineDestroy(ftp_engine* e);
+
+#endif  // FTPCLIENT_H_
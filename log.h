@@ -6,25 +6,65 @@
 #include <stdlib.h>
 #include <string.h>
 
-#define LOGI(format, ...)                            \
-    do {                                             \
-        fprintf(stdout,                              \
-                "[file: %s / func: %s / Line: %d] ", \
-                __FILE__,                            \
-                __func__,                            \
-                __LINE__);                           \
-        fprintf(stdout, format, ##__VA_ARGS__);      \
-    } while (0)
-
-#define LOGE(format, ...)                                       \
-    do {                                                        \
-        fprintf(stdout,                                         \
-                "[file: %s / func: %s / Line: %d] <error %s> ", \
-                __FILE__,                                       \
-                __func__,                                       \
-                __LINE__,                                       \
-                strerror(errno));                               \
-        fprintf(stdout, format, ##__VA_ARGS__);                 \
-    } while (0)
-
-#endif  // LOG_H_
\ No newline at end of file
+/*
+    分级异步日志 (ftp_log.c)
+    调用线程只把格式串指针和参数写入本线程的无锁环形缓冲区, 正文, 时间,
+    位置前缀和 strerror 由后台线程格式化后写到输出 (默认 stderr),
+    缓冲区满时丢弃并计数
+    编译时 -DFTP_LOG_LEVEL=FTP_LOG_WARN 等去掉更低级别的日志调用
+*/
+#define FTP_LOG_DEBUG 0
+#define FTP_LOG_INFO 1
+#define FTP_LOG_WARN 2
+#define FTP_LOG_ERROR 3
+#define FTP_LOG_OFF 4
+
+#ifndef FTP_LOG_LEVEL
+#define FTP_LOG_LEVEL FTP_LOG_INFO
+#endif
+
+/* 输出一行日志 (含换行), 在后台线程中调用 */
+typedef void (*ftp_log_sink)(const char* line, int len, void* arg);
+
+void FTPLogWrite(int level,
+                 const char* file,
+                 const char* func,
+                 int line,
+                 int err,
+                 const char* format,
+                 ...) __attribute__((format(printf, 6, 7)));
+void FTPLogSetLevel(int level);
+void FTPLogSetSink(ftp_log_sink sink, void* arg);
+void FTPLogFlush(void);
+
+// format 必须是字符串常量, 后台线程格式化时才读取
+#define FTP_LOG(level, err, format, ...)                                  \
+    FTPLogWrite(                                                          \
+            level, __FILE__, __func__, __LINE__, err, "" format, ##__VA_ARGS__)
+
+#if FTP_LOG_LEVEL <= FTP_LOG_DEBUG
+#define LOGD(format, ...) FTP_LOG(FTP_LOG_DEBUG, 0, format, ##__VA_ARGS__)
+#else
+#define LOGD(format, ...) ((void) 0)
+#endif
+
+#if FTP_LOG_LEVEL <= FTP_LOG_INFO
+#define LOGI(format, ...) FTP_LOG(FTP_LOG_INFO, 0, format, ##__VA_ARGS__)
+#else
+#define LOGI(format, ...) ((void) 0)
+#endif
+
+#if FTP_LOG_LEVEL <= FTP_LOG_WARN
+#define LOGW(format, ...) FTP_LOG(FTP_LOG_WARN, 0, format, ##__VA_ARGS__)
+#else
+#define LOGW(format, ...) ((void) 0)
+#endif
+
+// 错误日志附带调用时的 errno
+#if FTP_LOG_LEVEL <= FTP_LOG_ERROR
+#define LOGE(format, ...) FTP_LOG(FTP_LOG_ERROR, errno, format, ##__VA_ARGS__)
+#else
+#define LOGE(format, ...) ((void) 0)
+#endif
+
+#endif  // LOG_H_